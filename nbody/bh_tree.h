@@ -5,32 +5,342 @@
 #ifndef TREE_CODE_BH_TREE_H
 #define TREE_CODE_BH_TREE_H
 
+#include <algorithm>
+#include <iostream>
+#include <limits>
 #include <ostream>
+#include <vector>
 #include "bh_tree_node.h"
-#include "body.h"
+#include "body_store.h"
+#include "kernel.h"
+#include "morton.h"
+#include "parallel.h"
+
+//
+//  Barnes Hut Tree
+//
+//  All nodes are kept in one pool (nodes), root is nodes[0]. The bodies of the leaves
+//  are kept in a second array (slots), every leaf owns a block of it.
+//
+//  clear() only resets the size of the arrays, the memory is kept. A tree that is kept
+//  alive between steps (see compute_forces in forces.h) does not allocate at all
+//  once the arrays have grown to the size needed by the simulation.
+//
+//  The tree can also be kept between steps (TreeMode::PERSISTENT). Then refit() moves
+//  the bodies that left their leaf, and the tree is only rebuilt when it has degraded
+//  too much, as decided by the rebuild_policy.
+//
+//  Bodies outside of the global region are not put in the tree. They are kept in the
+//  far field list, and their pull is added up directly for every body (see fit_region
+//  in bounds.h for choosing a region that leaves out only the far outliers).
+//
+
+//
+//  Shape of the tree
+//
+//    leaf_capacity : a leaf is split when it gets more bodies than this
+//    max_depth     : leaves at this depth are never split (bodies at the same position
+//                    would otherwise split forever), their bucket grows instead
+//
+struct tree_parameters {
+    uint32_t leaf_capacity = 8;
+    int max_depth = 24;
+};
+
+//
+//  When is a persistent tree rebuilt
+//
+//    max_empty_leaf_fraction : leaves left behind by bodies that moved away, per body
+//    max_node_growth         : nodes in the tree compared to right after the last build
+//
+struct rebuild_policy {
+    double max_empty_leaf_fraction = 0.10;
+    double max_node_growth = 1.25;
+};
+
+//
+//  When is a node far enough away to be used whole (d = distance to its center of mass)
+//
+//    GEOMETRIC      : s / d <= theta, with s the size of the node (the classic test)
+//    BMAX           : bmax / d <= theta, with bmax the distance from the center of mass
+//                     to the furthest corner. Safe for lopsided nodes, where the center
+//                     of mass sits near an edge and the bodies reach much closer to the
+//                     target than the geometric test assumes.
+//    RELATIVE_ERROR : G M s^2 / d^4 <= alpha |a|, with |a| the acceleration of the
+//                     target at the previous step: the error of the node has to be small
+//                     compared to the force the target feels. Bodies with a strong pull
+//                     open few nodes. The node also has to be further than bmax. Targets
+//                     without a previous acceleration (first step) use GEOMETRIC.
+//
+enum OpeningCriterion { GEOMETRIC, BMAX, RELATIVE_ERROR };
+
+//
+//  How the walks use the tree
+//
+//    criterion  : the opening test, see OpeningCriterion
+//    theta      : opening angle of GEOMETRIC and BMAX
+//    alpha      : relative error of RELATIVE_ERROR
+//    quadrupole : keep the quadrupole moments of the nodes (in update) and add them to
+//                 every node used whole. At the same theta the error is 5 - 10 times
+//                 smaller; theta 0.7 with them is about as accurate as 0.5 without and
+//                 opens a third fewer nodes, 0.8 and up is already worse (see
+//                 tools/accuracy_sweep.cpp).
+//
+struct walk_parameters {
+    OpeningCriterion criterion = OpeningCriterion::GEOMETRIC;
+    double theta = opening_theta;
+    double alpha = 0.005;
+    bool quadrupole = false;
+};
+
+//
+//  What the walks did, summed over all bodies (see bh_tree::compute_forces)
+//
+//    nodes_visited     : nodes the opening test was run on
+//    node_interactions : nodes used whole, cell-body interactions
+//    body_interactions : bodies of leaves that were too close, body-body interactions
+//
+//  In a group walk the nodes are visited once for the group, and every body of the
+//  group interacts with the whole list.
+//
+struct walk_counts {
+    uint64_t nodes_visited = 0;
+    uint64_t node_interactions = 0;
+    uint64_t body_interactions = 0;
+
+    void visit() { ++nodes_visited; }
+    void node(uint64_t targets = 1) { node_interactions += targets; }
+    void bodies(uint64_t count) { body_interactions += count; }
+
+    walk_counts &operator+=(const walk_counts &rhs) {
+        nodes_visited += rhs.nodes_visited;
+        node_interactions += rhs.node_interactions;
+        body_interactions += rhs.body_interactions;
+        return *this;
+    }
+};
+
+//  The walks take their counts as a template parameter, this one counts nothing and
+//  compiles away
+struct no_walk_counts {
+    void visit() {}
+    void node(uint64_t = 1) {}
+    void bodies(uint64_t) {}
+    no_walk_counts &operator+=(const no_walk_counts &) { return *this; }
+};
+
+//
+//  The counts of one walk into the interaction counts column of the store (see
+//  body_store::count_interactions), per_body is nullptr when the column is off
+//
+//  A group walk is shared by group bodies, each of them gets its share of the
+//  interactions and all of the nodes visited.
+//
+inline void store_counts(interaction_counts *per_body, uint32_t body, const walk_counts &c, uint64_t group = 1) {
+    if (per_body != nullptr) {
+        per_body[body] = interaction_counts{ (uint32_t) c.nodes_visited, (uint32_t) (c.node_interactions / group),
+                                             (uint32_t) (c.body_interactions / group) };
+    }
+}
+inline void store_counts(interaction_counts *, uint32_t, const no_walk_counts &, uint64_t = 1) {}
+
+//
+//  Shape and size of a tree (see bh_tree::get_stats)
+//
+//    nodes, leaves, empty_leaves : leaves include the empty ones a refit leaves behind
+//    max_depth                   : deepest node, the root has depth 0
+//    nodes_per_depth             : depth histogram, nodes_per_depth[d] nodes at depth d
+//    leaves_per_depth            : the same for the leaves only
+//    leaf_occupancy              : leaf_occupancy[k] leaves hold k bodies (only leaves at
+//                                  max_depth can hold more than leaf_capacity)
+//    bodies, outside             : bodies in the tree, and in the far field list
+//    bytes_used                  : nodes, slots and far field of the current tree
+//    bytes_allocated             : every array of the tree, scratch space included
+//                                  (capacity, not size)
+//
+struct tree_stats {
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t empty_leaves = 0;
+    int max_depth = 0;
+    std::vector<size_t> nodes_per_depth;
+    std::vector<size_t> leaves_per_depth;
+    std::vector<size_t> leaf_occupancy;
+    uint32_t leaf_capacity = 0;
+    size_t bodies = 0;
+    size_t outside = 0;
+    size_t bytes_used = 0;
+    size_t bytes_allocated = 0;
+
+    //  bodies per leaf that holds any
+    double mean_occupancy() const {
+        const size_t filled = leaves - empty_leaves;
+        return filled == 0 ? 0.0 : (double) (bodies - outside) / filled;
+    }
+    double outside_fraction() const {
+        return bodies == 0 ? 0.0 : (double) outside / bodies;
+    }
+
+    //  one line summary, for the app and the tools
+    friend std::ostream &operator<<(std::ostream &os, const tree_stats &s) {
+        os << s.nodes << " nodes, " << s.leaves << " leaves (" << s.empty_leaves << " empty), depth "
+           << s.max_depth << ", " << s.mean_occupancy() << " bodies per leaf (capacity " << s.leaf_capacity
+           << "), " << s.outside_fraction() * 100.0 << "% outside, " << s.bytes_used / 1024 << " kB used, "
+           << s.bytes_allocated / 1024 << " kB allocated";
+        return os;
+    }
+};
+
+//
+//  What a persistent tree carries from one step to the next (see bh_tree::get_state)
+//
+//  A refit only moves the bodies that left their leaf, so the tree of a step depends
+//  on every step since the last build. A snapshot keeps this (snapshot.h) so that a
+//  resumed run refits the same tree as the run that saved it. The rest of the tree
+//  (masses, moments, the bodies outside the region) is computed again every step.
+//
+struct tree_state {
+    region global_region;
+    uint32_t body_count = 0;
+    uint32_t empty_leaves = 0;
+    uint32_t relocated_since_build = 0;
+    uint64_t nodes_at_build = 0;
+    std::vector<bh_tree_node> nodes;
+    std::vector<leaf_entry> slots;
+};
+
+//  bytes held by a vector (its capacity)
+template <typename T>
+size_t allocated_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
 
 class bh_tree {
 private:
-    //double grid_xmax, grid_ymax, grid_xmin, grid_ymin;
     region global_region;
 protected:
-    std::shared_ptr<bh_tree_node> root;
+    std::vector<bh_tree_node> nodes;
+    std::vector<leaf_entry> slots;
+    uint32_t body_count;     // number of bodies inserted since the last clear
+    std::vector<leaf_entry> far_field;  // bodies that were outside of the global region
+    tree_parameters params;
+
+    //  Scratch space for build(), kept so that rebuilding every step does not allocate
+    struct pending_subtree {
+        uint32_t node;      // placeholder node in the main pool
+        region r;
+        size_t lo, hi;      // range of sorted keys
+        int level;
+    };
+    std::vector<morton_entry> keys, key_scratch;
+    std::vector<size_t> radix_counts;
+    std::vector<pending_subtree> pending;
+    std::vector<std::vector<bh_tree_node>> subtrees;
+    std::vector<std::vector<leaf_entry>> subtree_slots;
+
+    //  Bookkeeping for the persistent tree
+    std::vector<uint32_t> leaf_of_body;  // leaf of each body, none for bodies outside the region
+    std::vector<uint32_t> slot_of_body;  // slot of each body in its leaf
+    uint32_t empty_leaves;               // leaves without bodies
+    uint32_t relocated_since_build;      // bodies moved to another leaf since the last build
+    size_t nodes_at_build;
+    rebuild_policy policy;
+
+    //  Walk settings, and the quadrupole moment of every node (empty when they are off)
+    walk_parameters walk_params;
+    std::vector<quadrupole> quadrupoles;
+    std::vector<double> last_acceleration;  // |a| of every body at the last compute_forces
+
+    //  Softening, and for every node (per body only) the largest softening length below
+    //  it (nodes closer than its reach are opened) and the mass weighted rms length
+    //  (the length of the node when it is used whole)
+    softening_parameters soft;
+    std::vector<double> node_softening, node_softening_rms;
+
+    //  Scratch space for compute_group_forces
+    struct group_scratch {
+        std::vector<double> sx, sy, sm, sh;  // interaction list (sh only with per body softening)
+        std::vector<uint32_t> members;    // slots of the bodies of the group
+        std::vector<double> cx, cy, ch, qxx, qxy, qyy;  // quadrupoles of the nodes used whole (ch as sh)
+    };
+    std::vector<uint32_t> subtree_bodies; // number of bodies below each node
+    std::vector<uint32_t> groups;
+    std::vector<group_scratch> scratch;   // one per worker of the task pool
+    std::vector<uint32_t> walk_order;     // bodies in the order of the leaves
 public:
-    bh_tree() : global_region(region(0,0,0,0)), root(nullptr) { }
-    bh_tree(region g_region) : global_region(g_region) {
-        root = nullptr;
-    }
-    ~bh_tree() { clear(); }
+    enum : uint32_t { root = 0 };
+
+    bh_tree() : bh_tree(region(0,0,0,0)) { }
+    bh_tree(region g_region)
+            : global_region(g_region), body_count(0),
+              empty_leaves(0), relocated_since_build(0), nodes_at_build(0) { }
+
+    //
+    //  bh_tree_node and leaf_entry are trivially destructible, so clearing is O(1)
+    //
     void clear() {
-        //clear(root);
-        if (root != nullptr) { root->clear(); }
-        root = nullptr;
+        nodes.clear();
+        slots.clear();
+        leaf_of_body.clear();
+        slot_of_body.clear();
+        far_field.clear();
+        body_count = 0;
+        empty_leaves = 0;
+        relocated_since_build = 0;
+        nodes_at_build = 0;
     }
     bool is_empty() const {
-        return root == nullptr;
+        return nodes.empty();
+    }
+
+    //
+    //  Make sure the arrays can hold a tree for num_bodies without reallocating
+    //
+    //  This is only an estimate (leaves are about half full). If it is too small the
+    //  arrays still grow, and keep their size for the following steps.
+    void reserve(size_t num_bodies) {
+        nodes.reserve(4 * num_bodies / params.leaf_capacity + 1);
+        slots.reserve(2 * num_bodies + params.leaf_capacity);
     }
 
     void set_region(region r) { global_region = r; }
+    void set_rebuild_policy(const rebuild_policy &p) { policy = p; }
+
+    //
+    //  Changing the shape clears the tree, it has to be built again
+    //
+    void set_parameters(tree_parameters p) {
+        p.leaf_capacity = std::max(p.leaf_capacity, 1u);
+        p.max_depth = std::max(0, std::min(p.max_depth, morton_levels));
+        params = p;
+        clear();
+    }
+    const tree_parameters &get_parameters() const { return params; }
+
+    //
+    //  The quadrupoles are computed by update(), call it again after turning them on
+    //
+    void set_walk_parameters(const walk_parameters &p) {
+        walk_params = p;
+        if (!walk_params.quadrupole) { quadrupoles.clear(); }
+    }
+    const walk_parameters &get_walk_parameters() const { return walk_params; }
+    const std::vector<quadrupole> &get_quadrupoles() const { return quadrupoles; }
+
+    //
+    //  The leaves keep the softening length of their bodies, so changing the softening
+    //  clears the tree, it has to be built again
+    //
+    void set_softening(const softening_parameters &p) {
+        soft = p;
+        clear();
+    }
+    const softening_parameters &get_softening() const { return soft; }
+
+    //  softening length of body i of the store
+    double softening_of(const body_store &bodies, size_t i) const {
+        return soft.per_body and bodies.has_softening() ? bodies.get_softening(i) : soft.length;
+    }
     //
     //
     //
@@ -39,57 +349,397 @@ public:
     //    todo: Add test function to ensure that leaves contain ACTUAL data, while Conglomerates contain an average of leaves
     //
     //
-    // This is a tree of shared pointers, so the added body must be a shared pointer
-    void insert_body(std::shared_ptr<body> &b) {
+    void insert_body(const body_store &bodies, size_t i) {
+        insert_body(bodies.get_position(i), bodies.get_mass(i), softening_of(bodies, i));
+    }
+    void insert_body(const point &position, double mass) {
+        insert_body(position, mass, soft.length);
+    }
+    //
+    //  Bodies are numbered in the order they are inserted. For a persistent tree this
+    //  has to be the order of the body_store passed to refit (add a body to the store,
+    //  and insert it into the tree).
+    //
+    //  The masses of the nodes are not updated until the next call to update()
+    //
+    void insert_body(const point &position, double mass, double softening) {
+        uint32_t body_index = body_count++;
+        leaf_of_body.push_back(bh_tree_node::none);
+        slot_of_body.push_back(bh_tree_node::none);
         //    ****    ****    ****    ****    ****    ****    ****
         //    CREATE ROOT NODE (if it doesn't exist)
         //    ****    ****    ****    ****    ****    ****    ****
-        if (root == nullptr) {
-            root = std::make_shared<bh_tree_node>(global_region, b);
-            return; // If the first node was root, we add it to the root and stop
+        if (nodes.empty()) {
+            new_leaf(nodes, slots, global_region, bh_tree_node::none, 0, params.leaf_capacity, true);
+            nodes_at_build = 1;
+        }
+
+        const leaf_entry entry{ position, mass, body_index, (float) softening };
+        if (!nodes[root].get_region().is_in(position)) {
+            // don't add this body to the tree, it still feels (and exerts) the force
+            far_field.push_back(entry);
+            return;
         }
+        insert_below(nodes, slots, root, entry, true);
+        // originally I would update all the bodies each step,
+        // this increased the number of computations slowing it down.
+        //
+        // We need to run "update" on the tree, but we should only do this after we have
+        // added all the nodes to the tree.
+    }
+
+    //
+    //  Build the tree for all bodies at once
+    //
+    //  This gives the same tree as calling insert_body for every body (in any order),
+    //  but the work is done by the threads of the pool:
+    //    - compute a key for every body (morton.h)
+    //    - radix sort the keys, every node is now a contiguous range of keys
+    //    - split the top of the tree into subtrees of about the same size, and build
+    //      the subtrees in parallel, each into its own arrays
+    //    - copy the subtrees into the main arrays
+    //
+    //  Bodies outside the global region go in the far field list, like insert_body.
+    //
+    void build(const body_store &bodies, task_pool &pool = default_pool()) {
+        clear();
+        reserve(bodies.size());
+        const unsigned threads = pool.size();
+
+        const size_t n = bodies.size();
+        body_count = (uint32_t) n;
+        keys.resize(n);
+        const double *x = bodies.x(), *y = bodies.y();
+        pool.run(n, 16384, [&](size_t begin, size_t end, unsigned) {
+            for (size_t i = begin; i < end; ++i) {
+                keys[i].key = morton_key(global_region, point(x[i], y[i]));
+                keys[i].body = (uint32_t) i;
+            }
+        });
+        parallel_radix_sort(keys, key_scratch, radix_counts, pool);
 
-        if (!root->get_region().is_in(b->get_position())) {
-            // don't add this body
+        // bodies outside of the region are sorted to the end
+        size_t inside = n;
+        while (inside > 0 and keys[inside - 1].key == morton_outside) { --inside; }
+        for (size_t i = inside; i < n; ++i) {
+            uint32_t b = keys[i].body;
+            far_field.push_back(leaf_entry{ bodies.get_position(b), bodies.get_mass(b), b,
+                                            (float) softening_of(bodies, b) });
         }
+        if (inside == 0) {
+            leaf_of_body.assign(n, bh_tree_node::none);
+            slot_of_body.assign(n, bh_tree_node::none);
+            return;
+        }
+
         //
-        //  Most of the time the root will exist so we can do our normal code to add a node
+        //  Build the top of the tree, ranges of at most grain keys are left as placeholders
+        //  (with one thread there is nothing to split, so the whole tree is built here)
         //
-        std::shared_ptr<bh_tree_node> current_node = root, prev = nullptr;
+        pending.clear();
+        size_t grain = threads == 1 ? 0 : inside / (8 * threads) + 1;
+        emit_range(nodes, slots, bodies, global_region, 0, inside, 0, bh_tree_node::none, grain);
+
         //
-        //  Find our way to the leaf we belong in
+        //  Build the subtrees in parallel
         //
-        while (current_node != nullptr) { // find a place to insert the node
-            prev = current_node;
-            Quadrant q = current_node->get_quadrant(b->get_position());
-            switch (q) {
-                case Quadrant::NW:
-                    current_node = current_node->get_nw();
-                    break;
-                case Quadrant::NE:
-                    current_node = current_node->get_ne();
-                    break;
-                case Quadrant::SE:
-                    current_node = current_node->get_se();
-                    break;
-                case Quadrant::SW:
-                    current_node = current_node->get_sw();
-                    break;
-                default:
-                    current_node = current_node->get_outside();
-                    std::cout << "this shouldn't happen (insert_body)" << std::endl;
-            }
-        }
-        prev->add_node(b);
-        // originally I would update all the bodies each step,
-        // this increased the number of computations slowing it down.
+        if (subtrees.size() < pending.size()) {
+            subtrees.resize(pending.size());
+            subtree_slots.resize(pending.size());
+        }
+        pool.run(pending.size(), 1, [&](size_t begin, size_t end, unsigned) {
+            for (size_t k = begin; k < end; ++k) {
+                std::vector<bh_tree_node> &local = subtrees[k];
+                std::vector<leaf_entry> &local_slots = subtree_slots[k];
+                local.clear();
+                local_slots.clear();
+                const pending_subtree &p = pending[k];
+                emit_range(local, local_slots, bodies, p.r, p.lo, p.hi, p.level, bh_tree_node::none, 0);
+            }
+        });
+
         //
-        // This line below will slow down the code increadibly. We need to run "update body" on root,
-        // but we should only do this after we have added all the nodes to the tree.
-        // ** **  DO NOT UNCOMMENT THE LINE BELOW   ** **
-        //  root->update_body();
+        //  Copy the subtrees into the arrays
+        //
+        //  The subtree root replaces the placeholder, the rest is appended to the pool.
+        //  Appended nodes always come after the placeholder, so children still come
+        //  after their parents. Parents are set by link().
+        //
+        for (size_t k = 0; k < pending.size(); ++k) {
+            const std::vector<bh_tree_node> &local = subtrees[k];
+            const std::vector<leaf_entry> &local_slots = subtree_slots[k];
+            uint32_t base = (uint32_t) nodes.size() - 1; // local index i > 0 goes to base + i
+            uint32_t slot_base = (uint32_t) slots.size();
+            slots.insert(slots.end(), local_slots.begin(), local_slots.end());
+            for (size_t i = 0; i < local.size(); ++i) {
+                bh_tree_node node = local[i];
+                if (node.is_leaf()) {
+                    node.move_bucket(slot_base + node.get_first_slot(), node.get_slot_capacity());
+                }
+                for (int q = 0; q < 4; ++q) {
+                    uint32_t child = node.get_child((Quadrant) q);
+                    if (child != bh_tree_node::none) { node.set_child((Quadrant) q, base + child); }
+                }
+                if (i == 0) {
+                    nodes[pending[k].node] = node;
+                } else {
+                    nodes.push_back(node);
+                }
+            }
+        }
+
+        link();
+    }
+
+    //
+    //  Move the tree along with the bodies, without building it again
+    //
+    //  Bodies that are still inside their leaf only update their slot. A body that left
+    //  its leaf is taken out of the bucket (possibly leaving an empty leaf behind), and
+    //  inserted again below the closest ancestor that contains it.
+    //
+    //  Returns false if the bodies don't belong to this tree (different number of
+    //  bodies), or if the tree degraded so much that the rebuild policy asks for a new
+    //  tree (refit stops right away then). The tree has to be built again in that case.
+    //
+    bool refit(const body_store &bodies) {
+        if (nodes.empty() or bodies.size() != body_count) {
+            return false;
+        }
+        const double empty_leaf_limit = policy.max_empty_leaf_fraction * body_count;
+        far_field.clear(); // filled again with the bodies that are outside now
+        for (uint32_t i = 0; i < body_count; ++i) {
+            const point position = bodies.get_position(i);
+            const double mass = bodies.get_mass(i);
+            const float softening = (float) softening_of(bodies, i);
+
+            uint32_t start;
+            uint32_t leaf = leaf_of_body[i];
+            if (leaf != bh_tree_node::none) {
+                if (nodes[leaf].get_region().is_in(position)) {
+                    leaf_entry &e = slots[slot_of_body[i]];
+                    e.position = position;
+                    e.mass = mass;
+                    e.softening = softening;
+                    continue; // most bodies stay where they are
+                }
+                //  the body left its leaf, find the closest ancestor that holds it
+                remove_from_leaf(i);
+                if (empty_leaves > empty_leaf_limit) {
+                    return false; // no point in going on, the tree will be built again
+                }
+                start = nodes[leaf].get_parent();
+                while (start != bh_tree_node::none and !nodes[start].get_region().is_in(position)) {
+                    start = nodes[start].get_parent();
+                }
+            } else {
+                //  the body was outside the region last step
+                start = nodes[root].get_region().is_in(position) ? (uint32_t) root : (uint32_t) bh_tree_node::none;
+            }
+
+            if (start == bh_tree_node::none) {
+                far_field.push_back(leaf_entry{ position, mass, i, softening }); // outside the region
+                continue;
+            }
+            insert_below(nodes, slots, start, leaf_entry{ position, mass, i, softening }, true);
+            ++relocated_since_build;
+        }
+        return true;
+    }
+
+    //
+    //  Check the tree against the rebuild policy
+    //
+    bool needs_rebuild() const {
+        if (nodes.empty()) {
+            return true;
+        }
+        return empty_leaves > policy.max_empty_leaf_fraction * body_count
+               or nodes.size() > policy.max_node_growth * nodes_at_build;
+    }
+
+    //
+    //  Refit a persistent tree, and build it again if refit isn't enough
+    //
+    //  Returns true when the tree was built again
+    //
+    bool refit_or_build(const body_store &bodies, task_pool &pool = default_pool()) {
+        if (refit(bodies) and !needs_rebuild()) {
+            return false;
+        }
+        build(bodies, pool);
+        return true;
+    }
+
+    //
+    //  Copy of the tree as the next refit would find it (s is reused, no allocation
+    //  once its arrays are large enough)
+    //
+    void get_state(tree_state &s) const {
+        s.global_region = global_region;
+        s.body_count = body_count;
+        s.empty_leaves = empty_leaves;
+        s.relocated_since_build = relocated_since_build;
+        s.nodes_at_build = nodes_at_build;
+        s.nodes.assign(nodes.begin(), nodes.end());
+        s.slots.assign(slots.begin(), slots.end());
+    }
+
+    //
+    //  Put back a tree saved by get_state, for the bodies it was saved with
+    //
+    //  The leaf and slot of every body come from the buckets. Returns false (and
+    //  clears the tree) when s doesn't hold a tree of these bodies, the next step
+    //  builds a new one then.
+    //
+    bool set_state(const tree_state &s, const body_store &bodies) {
+        clear();
+        if (s.nodes.empty() or s.body_count != bodies.size() or s.slots.size() >= bh_tree_node::none) {
+            std::cout << "saved tree doesn't match the bodies, building a new one" << std::endl;
+            return false;
+        }
+        leaf_of_body.assign(s.body_count, bh_tree_node::none);
+        slot_of_body.assign(s.body_count, bh_tree_node::none);
+        for (uint32_t i = 0; i < (uint32_t) s.nodes.size(); ++i) {
+            const bh_tree_node &node = s.nodes[i];
+            bool valid = node.get_parent() == bh_tree_node::none ? i == root : node.get_parent() < i;
+            for (unsigned q = 0; q < 4 and valid; ++q) {
+                const uint32_t child = node.get_child(q);
+                valid = child == bh_tree_node::none or (child > i and child < s.nodes.size());
+            }
+            if (valid and node.is_leaf()) {
+                const uint64_t end = (uint64_t) node.get_first_slot() + node.get_slot_capacity();
+                valid = node.get_body_count() <= node.get_slot_capacity() and end <= s.slots.size();
+                const uint32_t last = node.get_first_slot() + node.get_body_count();
+                for (uint32_t k = node.get_first_slot(); valid and k < last; ++k) {
+                    const uint32_t b = s.slots[k].body;
+                    valid = b < s.body_count and leaf_of_body[b] == bh_tree_node::none;
+                    if (valid) {
+                        leaf_of_body[b] = i;
+                        slot_of_body[b] = k;
+                    }
+                }
+            }
+            if (!valid) {
+                std::cout << "saved tree is broken at node " << i << ", building a new one" << std::endl;
+                clear();
+                return false;
+            }
+        }
+
+        global_region = s.global_region;
+        nodes.assign(s.nodes.begin(), s.nodes.end());
+        slots.assign(s.slots.begin(), s.slots.end());
+        body_count = s.body_count;
+        empty_leaves = s.empty_leaves;
+        relocated_since_build = s.relocated_since_build;
+        nodes_at_build = (size_t) s.nodes_at_build;
+        for (uint32_t b = 0; b < body_count; ++b) {
+            if (leaf_of_body[b] == bh_tree_node::none) {
+                far_field.push_back(leaf_entry{ bodies.get_position(b), bodies.get_mass(b), b,
+                                                (float) softening_of(bodies, b) });
+            }
+        }
+        return true;
+    }
+
+    //
+    // Updates the masses and positions (center of mass) of all nodes
+    //
+    //  Children are always stored after their parent, so a single sweep from the back
+    //  of the pool to the front is a bottom-up pass (no recursion needed)
+    //
+    //  With walk_parameters::quadrupole the same sweep adds up the quadrupoles: the
+    //  bodies of a leaf about its center of mass, and for a conglomerate the children's
+    //  quadrupoles moved to its center of mass (their mass at their center, plus their
+    //  own moment).
+    //
+    //  With per body softening it also keeps the largest softening length below every
+    //  node, a node is softened like its softest body.
+    //
+    void update() {
+        const bool with_quadrupoles = walk_params.quadrupole;
+        if (with_quadrupoles) { quadrupoles.resize(nodes.size()); }
+        const bool with_softening = soft.per_body;
+        if (with_softening) {
+            node_softening.assign(nodes.size(), 0.0);
+            node_softening_rms.assign(nodes.size(), 0.0);
+        }
+        for (size_t i = nodes.size(); i-- > 0; ) {
+            bh_tree_node &node = nodes[i];
+            double mass = 0.0;
+            point position(0,0);
+            if (node.is_leaf()) {
+                const leaf_entry *e = slots.data() + node.get_first_slot();
+                for (uint32_t k = 0; k < node.get_body_count(); ++k) {
+                    mass += e[k].mass;
+                    position += e[k].position * e[k].mass;
+                }
+            } else {
+                for (int q = 0; q < 4; ++q) {
+                    uint32_t child = node.get_child((Quadrant) q);
+                    if (child != bh_tree_node::none) {
+                        const bh_tree_node &c = nodes[child];
+                        mass += c.get_mass();
+                        position += c.get_position() * c.get_mass();
+                    }
+                }
+            }
+            if (mass > 0.0) {
+                position /= mass;
+            } else {
+                position = node.get_region().get_center(); // every body below moved away
+            }
+            node.set_mass_and_position(mass, position);
+
+            if (with_softening) {
+                double h = 0.0, h_2 = 0.0;
+                if (node.is_leaf()) {
+                    const leaf_entry *e = slots.data() + node.get_first_slot();
+                    for (uint32_t k = 0; k < node.get_body_count(); ++k) {
+                        h = std::max(h, (double) e[k].softening);
+                        h_2 += e[k].mass * e[k].softening * e[k].softening;
+                    }
+                } else {
+                    for (int q_i = 0; q_i < 4; ++q_i) {
+                        uint32_t child = node.get_child((Quadrant) q_i);
+                        if (child != bh_tree_node::none) {
+                            h = std::max(h, node_softening[child]);
+                            h_2 += nodes[child].get_mass() * node_softening_rms[child] * node_softening_rms[child];
+                        }
+                    }
+                }
+                node_softening[i] = h;
+                node_softening_rms[i] = mass > 0.0 ? std::sqrt(h_2 / mass) : 0.0;
+            }
+            if (!with_quadrupoles) {
+                continue;
+            }
+            quadrupole q = { 0.0, 0.0, 0.0 };
+            auto add_moment = [&q, &position](const point &p, double m) {
+                const double dx = p.x - position.x, dy = p.y - position.y;
+                q.xx += 0.5 * m * dx * dx;
+                q.xy += m * dx * dy;
+                q.yy += 0.5 * m * dy * dy;
+            };
+            if (node.is_leaf()) {
+                const leaf_entry *e = slots.data() + node.get_first_slot();
+                for (uint32_t k = 0; k < node.get_body_count(); ++k) { add_moment(e[k].position, e[k].mass); }
+            } else {
+                for (int q_i = 0; q_i < 4; ++q_i) {
+                    uint32_t child = node.get_child((Quadrant) q_i);
+                    if (child != bh_tree_node::none) {
+                        const quadrupole &c = quadrupoles[child];
+                        add_moment(nodes[child].get_position(), nodes[child].get_mass());
+                        q.xx += c.xx;
+                        q.xy += c.xy;
+                        q.yy += c.yy;
+                    }
+                }
+            }
+            quadrupoles[i] = q;
+        }
     }
-    void update() { root->update_body(); }
 
     bool is_outside(const point pos) const {
         return !global_region.is_in(pos);
@@ -97,21 +747,833 @@ public:
 
     region get_global_region() const { return global_region; }
 
-    point compute_force(std::shared_ptr<body> &b) {
-        if (root == nullptr) {
-            // no bodies for force computation
-            return point(0, 0);
+    size_t get_node_count() const { return nodes.size(); }
+    uint32_t get_outside_count() const { return (uint32_t) far_field.size(); }
+    uint32_t get_body_count() const { return body_count; }
+    uint32_t get_empty_leaf_count() const { return empty_leaves; }
+    uint32_t get_relocated_count() const { return relocated_since_build; }
+
+    //
+    //  Statistics of the tree, in one pass over the node pool (no walk)
+    //
+    //  Cheap enough to call every frame, unlike printing the tree with operator<<.
+    //
+    tree_stats get_stats() const {
+        tree_stats s;
+        s.leaf_capacity = params.leaf_capacity;
+        s.nodes = nodes.size();
+        s.outside = far_field.size();
+        s.bodies = body_count;
+        for (const bh_tree_node &node : nodes) {
+            const int depth = node.get_depth();
+            if (depth >= (int) s.nodes_per_depth.size()) {
+                s.nodes_per_depth.resize(depth + 1, 0);
+                s.leaves_per_depth.resize(depth + 1, 0);
+            }
+            ++s.nodes_per_depth[depth];
+            s.max_depth = std::max(s.max_depth, depth);
+            if (!node.is_leaf()) {
+                continue;
+            }
+            ++s.leaves;
+            ++s.leaves_per_depth[depth];
+            const uint32_t k = node.get_body_count();
+            if (k == 0) { ++s.empty_leaves; }
+            if (k >= s.leaf_occupancy.size()) { s.leaf_occupancy.resize(k + 1, 0); }
+            ++s.leaf_occupancy[k];
         }
 
-        return root->compute_force(b);
+        s.bytes_used = nodes.size() * sizeof(bh_tree_node) + slots.size() * sizeof(leaf_entry)
+                       + far_field.size() * sizeof(leaf_entry);
+        size_t bytes = allocated_bytes(nodes) + allocated_bytes(slots) + allocated_bytes(far_field)
+                       + allocated_bytes(keys) + allocated_bytes(key_scratch) + allocated_bytes(pending)
+                       + allocated_bytes(subtrees) + allocated_bytes(subtree_slots)
+                       + allocated_bytes(leaf_of_body) + allocated_bytes(slot_of_body)
+                       + allocated_bytes(quadrupoles) + allocated_bytes(last_acceleration)
+                       + allocated_bytes(node_softening) + allocated_bytes(node_softening_rms)
+                       + allocated_bytes(subtree_bodies) + allocated_bytes(groups)
+                       + allocated_bytes(scratch) + allocated_bytes(walk_order);
+        for (const auto &v : subtrees) { bytes += allocated_bytes(v); }
+        for (const auto &v : subtree_slots) { bytes += allocated_bytes(v); }
+        for (const group_scratch &g : scratch) {
+            bytes += allocated_bytes(g.sx) + allocated_bytes(g.sy) + allocated_bytes(g.sm) + allocated_bytes(g.sh)
+                     + allocated_bytes(g.members) + allocated_bytes(g.cx) + allocated_bytes(g.cy)
+                     + allocated_bytes(g.qxx) + allocated_bytes(g.qxy) + allocated_bytes(g.qyy);
+        }
+        s.bytes_allocated = bytes;
+        return s;
     }
 
+    //  Read only access to the arrays, for solvers that work on the tree (see fmm.h)
+    const std::vector<bh_tree_node> &get_nodes() const { return nodes; }
+    const std::vector<leaf_entry> &get_slots() const { return slots; }
+    const std::vector<leaf_entry> &get_far_field() const { return far_field; }
+    //  per body softening only, empty otherwise (see update)
+    const std::vector<double> &get_node_softening_rms() const { return node_softening_rms; }
+
+    //
+    //  Forces on all bodies (forces[i] is the force on body i), with one walk per group
+    //
+    //  Bodies of the same leaf open almost the same nodes, so instead of a walk per body
+    //  there is one walk for each group: the highest nodes with at most group_size
+    //  bodies. A node is used whole only if it is far enough away from every point of
+    //  the bounding box of the group, so every body of the group gets at least the
+    //  accuracy of its own walk. The walk builds one interaction list, and every body
+    //  of the group runs the interaction kernel over it.
+    //
+    //  The groups are shared out to the threads of the pool. With totals, the walks are
+    //  counted (see walk_counts) and added to it. With per_body (the interactions column
+    //  of the store), the counts of every body are stored there.
+    //
+    void compute_group_forces(const body_store &bodies, std::vector<point> &forces, uint32_t group_size = 32,
+                              task_pool &pool = default_pool(), walk_counts *totals = nullptr,
+                              interaction_counts *per_body = nullptr) {
+        if (totals != nullptr or per_body != nullptr) {
+            walk_counts sum;
+            group_forces(bodies, forces, group_size, pool, sum, per_body);
+            if (totals != nullptr) { *totals += sum; }
+        } else {
+            no_walk_counts none;
+            group_forces(bodies, forces, group_size, pool, none, nullptr);
+        }
+    }
+
+    //
+    //  Forces on all bodies (forces[i] is the force on body i), one walk per body
+    //
+    //  The walks are shared out to the threads of the pool. Bodies are taken in the
+    //  order of the leaves, so the chunks of the pool are patches of nearby bodies,
+    //  which open about the same nodes. With totals, the walks are counted (see
+    //  walk_counts) and added to it, with per_body the counts of every body are stored
+    //  there. Without either, the walks are compiled without counters.
+    //
+    void compute_forces(const body_store &bodies, std::vector<point> &forces, task_pool &pool = default_pool(),
+                        walk_counts *totals = nullptr, interaction_counts *per_body = nullptr) {
+        if (totals != nullptr or per_body != nullptr) {
+            walk_counts sum;
+            body_forces(bodies, forces, pool, sum, per_body);
+            if (totals != nullptr) { *totals += sum; }
+        } else {
+            no_walk_counts none;
+            body_forces(bodies, forces, pool, none, nullptr);
+        }
+    }
+
+protected:
+    template <typename Counts>
+    void group_forces(const body_store &bodies, std::vector<point> &forces, uint32_t group_size,
+                      task_pool &pool, Counts &totals, interaction_counts *per_body) {
+        std::vector<Counts> counts(pool.size());
+        forces.assign(bodies.size(), point(0, 0));
+        for (const leaf_entry &e : far_field) {
+            Counts c;
+            forces[e.body] = compute_force(e.position, e.mass, 0.0, e.softening, c);
+            store_counts(per_body, e.body, c);
+            counts[0] += c;
+        }
+        if (nodes.empty()) {
+            return;
+        }
+
+        //  bodies below every node (children come after their parents)
+        subtree_bodies.assign(nodes.size(), 0);
+        for (size_t i = nodes.size(); i-- > 0; ) {
+            const bh_tree_node &node = nodes[i];
+            if (node.is_leaf()) {
+                subtree_bodies[i] = node.get_body_count();
+                continue;
+            }
+            for (int q = 0; q < 4; ++q) {
+                uint32_t child = node.get_child((Quadrant) q);
+                if (child != bh_tree_node::none) { subtree_bodies[i] += subtree_bodies[child]; }
+            }
+        }
+
+        //  the groups
+        groups.clear();
+        uint32_t stack[walk_stack_size];
+        int top = 0;
+        stack[top++] = root;
+        while (top > 0) {
+            uint32_t i = stack[--top];
+            if (subtree_bodies[i] == 0) {
+                continue;
+            }
+            if (subtree_bodies[i] <= group_size or nodes[i].is_leaf()) {
+                groups.push_back(i);
+                continue;
+            }
+            for (int q = 3; q >= 0; --q) {
+                uint32_t child = nodes[i].get_child((Quadrant) q);
+                if (child != bh_tree_node::none) { stack[top++] = child; }
+            }
+        }
+
+        if (scratch.size() < pool.size()) { scratch.resize(pool.size()); }
+        pool.run(groups.size(), 4, [&](size_t begin, size_t end, unsigned worker) {
+            for (size_t k = begin; k < end; ++k) {
+                group_walk(groups[k], bodies, forces, scratch[worker], counts[worker], per_body);
+            }
+        });
+        for (const Counts &c : counts) { totals += c; }
+        remember_accelerations(bodies, forces, pool);
+    }
+
+    template <typename Counts>
+    void body_forces(const body_store &bodies, std::vector<point> &forces, task_pool &pool, Counts &totals,
+                     interaction_counts *per_body) {
+        std::vector<Counts> counts(pool.size());
+        forces.assign(bodies.size(), point(0, 0));
+        walk_order.clear();
+        if (!nodes.empty()) {
+            uint32_t stack[walk_stack_size];
+            int top = 0;
+            stack[top++] = root;
+            while (top > 0) {
+                const bh_tree_node &node = nodes[stack[--top]];
+                if (node.is_leaf()) {
+                    for (uint32_t s = node.get_first_slot(); s < node.get_first_slot() + node.get_body_count(); ++s) {
+                        walk_order.push_back(slots[s].body);
+                    }
+                    continue;
+                }
+                for (int q = 3; q >= 0; --q) {
+                    uint32_t child = node.get_child((Quadrant) q);
+                    if (child != bh_tree_node::none) { stack[top++] = child; }
+                }
+            }
+        }
+        for (const leaf_entry &e : far_field) { walk_order.push_back(e.body); }
+
+        pool.run(walk_order.size(), 256, [&](size_t begin, size_t end, unsigned worker) {
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t b = walk_order[k];
+                Counts c;
+                forces[b] = compute_force(bodies, b, c);
+                store_counts(per_body, b, c);
+                counts[worker] += c;
+            }
+        });
+        for (const Counts &c : counts) { totals += c; }
+        remember_accelerations(bodies, forces, pool);
+    }
+
+public:
+    //
+    //  Forces on the bodies in active only (forces[i] for every i in active, the other
+    //  forces are left as they are), for block time steps (see integrator.h)
+    //
+    //  The active bodies are walked in the order of their slots, so the chunks of the
+    //  pool are still patches of nearby bodies. totals and per_body as above.
+    //
+    void compute_forces(const body_store &bodies, const std::vector<uint32_t> &active, std::vector<point> &forces,
+                        task_pool &pool = default_pool(), walk_counts *totals = nullptr,
+                        interaction_counts *per_body = nullptr) {
+        if (totals != nullptr or per_body != nullptr) {
+            walk_counts sum;
+            active_forces(bodies, active, forces, pool, sum, per_body);
+            if (totals != nullptr) { *totals += sum; }
+        } else {
+            no_walk_counts none;
+            active_forces(bodies, active, forces, pool, none, nullptr);
+        }
+    }
+
+protected:
+    template <typename Counts>
+    void active_forces(const body_store &bodies, const std::vector<uint32_t> &active, std::vector<point> &forces,
+                       task_pool &pool, Counts &totals, interaction_counts *per_body) {
+        std::vector<Counts> counts(pool.size());
+        forces.resize(bodies.size(), point(0, 0));
+        walk_order.assign(active.begin(), active.end());
+        if (slot_of_body.size() == bodies.size()) {
+            std::sort(walk_order.begin(), walk_order.end(), [this](uint32_t a, uint32_t b) {
+                return slot_of_body[a] < slot_of_body[b]; // bodies outside the region (none) go last
+            });
+        }
+
+        pool.run(walk_order.size(), 256, [&](size_t begin, size_t end, unsigned worker) {
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t b = walk_order[k];
+                Counts c;
+                forces[b] = compute_force(bodies, b, c);
+                store_counts(per_body, b, c);
+                counts[worker] += c;
+            }
+        });
+        for (const Counts &c : counts) { totals += c; }
+        remember_accelerations(bodies, active, forces, pool);
+    }
+
+public:
+
+    //
+    //  Previous accelerations from forces computed somewhere else (the forces of a
+    //  snapshot, see simulation::resume), as if compute_forces had given them
+    //
+    void set_previous_accelerations(const body_store &bodies, const std::vector<point> &forces,
+                                    task_pool &pool = default_pool()) {
+        if (forces.size() != bodies.size()) {
+            last_acceleration.clear();
+            return;
+        }
+        remember_accelerations(bodies, forces, pool);
+    }
+
+    //
+    //  Force on body i of the store (with its previous acceleration, if the opening
+    //  criterion needs it)
+    //
+    point compute_force(const body_store &bodies, size_t i) const {
+        no_walk_counts none;
+        return compute_force(bodies, i, none);
+    }
+    template <typename Counts>
+    point compute_force(const body_store &bodies, size_t i, Counts &counts) const {
+        return compute_force(bodies.get_position(i), bodies.get_mass(i), previous_acceleration(i),
+                             softening_of(bodies, i), counts);
+    }
+    //
+    //  Walk the tree for the force on a body at position
+    //
+    //  The walk is a loop over an explicit stack of node indices (no recursion). The
+    //  opening test (see is_far_enough) works on squared distances, so the square root
+    //  is only taken for the nodes that are actually used.
+    //
+    //  The stack holds at most 3 siblings per level plus the node being opened, so
+    //  walk_stack_size covers the deepest tree that build and insert_body can make.
+    //
+    enum { walk_stack_size = 4 * (morton_levels + 1) };
+
+    //  accel is the acceleration of the body at the previous step, for the
+    //  RELATIVE_ERROR criterion (0 if there is none), softening its softening length
+    //
+    point compute_force(const point &position, double mass, double accel = 0.0) const {
+        return compute_force(position, mass, accel, soft.length);
+    }
+    point compute_force(const point &position, double mass, double accel, double softening) const {
+        no_walk_counts none;
+        return compute_force(position, mass, accel, softening, none);
+    }
+    template <typename Counts>
+    point compute_force(const point &position, double mass, double accel, double softening, Counts &counts) const {
+        point force(0, 0);
+        if (!nodes.empty()) {
+            force = walk(position, mass, accel, softening, counts);
+        }
+        if (!far_field.empty()) {
+            force += direct_force(far_field.data(), (uint32_t) far_field.size(), position, mass, softening,
+                                  gravity_G, soft.kernel);
+            counts.bodies(far_field.size());
+        }
+        return force;
+    }
+
+protected:
+    //
+    //  The walk does not add up the forces as it goes. Nodes that are used whole, and
+    //  the bodies of leaves that are too close, go in an interaction list (mass and
+    //  position of every source, one array each), and the list is handed to the
+    //  interaction kernel (kernel.h) whenever it is full and at the end.
+    //
+    enum { interaction_batch = 256 };
+
+    //  quadrupoles are turned on and up to date with the pool (see update)
+    bool has_quadrupoles() const {
+        return walk_params.quadrupole and quadrupoles.size() == nodes.size();
+    }
+
+    //  softening lengths are per body and up to date with the pool (see update)
+    bool has_node_softening() const {
+        return soft.per_body and node_softening.size() == nodes.size();
+    }
+
+    //
+    //  The opening test (see OpeningCriterion) for node index, d_2 is the squared
+    //  distance from the target (or from the box of a group) to the center of mass of
+    //  the node, h the softening length of the target. Nodes within the reach of the
+    //  softening are always opened.
+    //
+    //  The CUTOFF force jumps at h, so the mass (and quadrupole) of a node is no good
+    //  when some of its bodies may be closer than h: these nodes are opened as well.
+    //  PLUMMER and SPLINE are smooth, a node is expanded in the softened potential.
+    //
+    bool is_far_enough(uint32_t index, double d_2, double accel, double h) const {
+        const bh_tree_node &node = nodes[index];
+        double reach = soft.reach(has_node_softening() ? std::max(h, node_softening[index]) : h);
+        if (soft.kernel == Softening::CUTOFF) {
+            reach += std::sqrt(node.get_bmax_2());
+        }
+        if (d_2 < reach * reach) {
+            return false;
+        }
+        const double theta_2 = walk_params.theta * walk_params.theta;
+        switch (walk_params.criterion) {
+            case OpeningCriterion::BMAX:
+                return node.get_bmax_2() <= theta_2 * d_2;
+            case OpeningCriterion::RELATIVE_ERROR:
+                if (accel > 0.0) {
+                    const double s = node.get_size();
+                    return node.get_bmax_2() <= d_2
+                           and gravity_G * node.get_mass() * s * s <= walk_params.alpha * accel * d_2 * d_2;
+                }
+                break; // no previous acceleration, use the geometric test
+            default:
+                break;
+        }
+        const double s = node.get_size();
+        return s * s <= theta_2 * d_2;
+    }
+
+    //  acceleration of body i at the last compute_forces, 0 if not known
+    double previous_acceleration(size_t i) const {
+        if (walk_params.criterion != OpeningCriterion::RELATIVE_ERROR or i >= last_acceleration.size()) {
+            return 0.0;
+        }
+        return last_acceleration[i];
+    }
+
+    //
+    //  Keep |a| of every body for the next step (RELATIVE_ERROR only). Bodies added
+    //  after this have no previous acceleration until the next call.
+    //
+    void remember_accelerations(const body_store &bodies, const std::vector<point> &forces, task_pool &pool) {
+        if (walk_params.criterion != OpeningCriterion::RELATIVE_ERROR) {
+            last_acceleration.clear();
+            return;
+        }
+        last_acceleration.resize(bodies.size());
+        const double *mass = bodies.mass();
+        pool.run(bodies.size(), 16384, [&](size_t begin, size_t end, unsigned) {
+            for (size_t i = begin; i < end; ++i) {
+                last_acceleration[i] = mass[i] > 0.0 ? forces[i].length() / mass[i] : 0.0;
+            }
+        });
+    }
+    //  Same as above, for the active bodies only (the others keep their acceleration)
+    void remember_accelerations(const body_store &bodies, const std::vector<uint32_t> &active,
+                                const std::vector<point> &forces, task_pool &pool) {
+        if (walk_params.criterion != OpeningCriterion::RELATIVE_ERROR) {
+            last_acceleration.clear();
+            return;
+        }
+        last_acceleration.resize(bodies.size(), 0.0);
+        const double *mass = bodies.mass();
+        pool.run(active.size(), 16384, [&](size_t begin, size_t end, unsigned) {
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t i = active[k];
+                last_acceleration[i] = mass[i] > 0.0 ? forces[i].length() / mass[i] : 0.0;
+            }
+        });
+    }
+
+    //
+    //  Walk for the group below node group, see compute_group_forces
+    //
+    template <typename Counts>
+    void group_walk(uint32_t group, const body_store &bodies, std::vector<point> &forces, group_scratch &g,
+                    Counts &totals, interaction_counts *body_counts) const {
+        Counts counts;   // of this group
+        const bool use_quadrupoles = has_quadrupoles();
+        const bool per_body = has_node_softening();
+        const bh_tree_node *pool = nodes.data();
+        const leaf_entry *entries = slots.data();
+
+        //
+        //  Bodies of the group, their bounding box, the weakest previous acceleration and
+        //  the largest softening length
+        //
+        g.members.clear();
+        double accel = std::numeric_limits<double>::infinity();
+        double h = 0.0;
+        double xmin = std::numeric_limits<double>::infinity(), ymin = xmin;
+        double xmax = -xmin, ymax = -xmin;
+        uint32_t stack[walk_stack_size];
+        int top = 0;
+        stack[top++] = group;
+        while (top > 0) {
+            const bh_tree_node &node = pool[stack[--top]];
+            if (!node.is_leaf()) {
+                for (int q = 3; q >= 0; --q) {
+                    uint32_t child = node.get_child((Quadrant) q);
+                    if (child != bh_tree_node::none) { stack[top++] = child; }
+                }
+                continue;
+            }
+            for (uint32_t s = node.get_first_slot(); s < node.get_first_slot() + node.get_body_count(); ++s) {
+                g.members.push_back(s);
+                accel = std::min(accel, previous_acceleration(entries[s].body));
+                h = std::max(h, (double) entries[s].softening);
+                xmin = std::min(xmin, entries[s].position.x);
+                xmax = std::max(xmax, entries[s].position.x);
+                ymin = std::min(ymin, entries[s].position.y);
+                ymax = std::max(ymax, entries[s].position.y);
+            }
+        }
+
+        //
+        //  Interaction list of the group
+        //
+        g.sx.clear(); g.sy.clear(); g.sm.clear(); g.sh.clear();
+        g.cx.clear(); g.cy.clear(); g.ch.clear(); g.qxx.clear(); g.qxy.clear(); g.qyy.clear();
+        auto add = [&g, per_body](const point &p, double m, double softening) {
+            g.sx.push_back(p.x);
+            g.sy.push_back(p.y);
+            g.sm.push_back(m);
+            if (per_body) { g.sh.push_back(softening); }
+        };
+        stack[top++] = root;
+        while (top > 0) {
+            const bh_tree_node &node = pool[stack[--top]];
+            const double node_mass = node.get_mass();
+            if (node_mass == 0.0) {
+                continue;
+            }
+            counts.visit();
+
+            //  distance from the center of mass to the closest point of the box
+            const point &c = node.get_position();
+            const double dx = std::max(0.0, std::max(xmin - c.x, c.x - xmax));
+            const double dy = std::max(0.0, std::max(ymin - c.y, c.y - ymax));
+            if (is_far_enough(stack[top], dx*dx + dy*dy, accel, h)) {
+                add(c, node_mass, per_body ? node_softening_rms[stack[top]] : 0.0);
+                counts.node(g.members.size());
+                if (use_quadrupoles) {
+                    const quadrupole &q = quadrupoles[stack[top]];
+                    g.cx.push_back(c.x); g.cy.push_back(c.y);
+                    if (per_body) { g.ch.push_back(node_softening_rms[stack[top]]); }
+                    g.qxx.push_back(q.xx); g.qxy.push_back(q.xy); g.qyy.push_back(q.yy);
+                }
+                continue;
+            }
+            if (node.is_leaf()) {
+                const leaf_entry *e = entries + node.get_first_slot();
+                for (uint32_t k = 0; k < node.get_body_count(); ++k) { add(e[k].position, e[k].mass, e[k].softening); }
+                counts.bodies((uint64_t) node.get_body_count() * g.members.size());
+                continue;
+            }
+            for (int q = 3; q >= 0; --q) {
+                uint32_t child = node.get_child((Quadrant) q);
+                if (child != bh_tree_node::none) { stack[top++] = child; }
+            }
+        }
+        for (const leaf_entry &e : far_field) { add(e.position, e.mass, e.softening); }
+        counts.bodies((uint64_t) far_field.size() * g.members.size());
+
+        //
+        //  Every body of the group against the list
+        //
+        const interaction_kernel kernel = active_kernel(soft.kernel);
+        const quadrupole_kernel q_kernel = active_quadrupole_kernel(soft.kernel);
+        for (uint32_t s : g.members) {
+            double ax = 0.0, ay = 0.0;
+            kernel(entries[s].position.x, entries[s].position.y, entries[s].softening,
+                   g.sx.data(), g.sy.data(), g.sm.data(), per_body ? g.sh.data() : nullptr, g.sx.size(), ax, ay);
+            q_kernel(entries[s].position.x, entries[s].position.y, entries[s].softening, g.cx.data(), g.cy.data(),
+                     per_body ? g.ch.data() : nullptr, g.qxx.data(), g.qxy.data(), g.qyy.data(), g.cx.size(), ax, ay);
+            const uint32_t b = entries[s].body;
+            const double f = gravity_G * bodies.get_mass(b);
+            forces[b] = point(f * ax, f * ay);
+            store_counts(body_counts, b, counts, g.members.size());
+        }
+        totals += counts;
+    }
+
+    template <typename Counts>
+    point walk(const point &position, double mass, double accel, double h, Counts &counts) const {
+        const bool use_quadrupoles = has_quadrupoles();
+        const bool per_body = has_node_softening();
+        const bh_tree_node *pool = nodes.data();
+        const leaf_entry *entries = slots.data();
+        const interaction_kernel kernel = active_kernel(soft.kernel);
+        const quadrupole_kernel q_kernel = active_quadrupole_kernel(soft.kernel);
+
+        double ax = 0.0, ay = 0.0;
+        double sx[interaction_batch], sy[interaction_batch], sm[interaction_batch], sh[interaction_batch];
+        double cx[interaction_batch], cy[interaction_batch], ch[interaction_batch];
+        double qxx[interaction_batch], qxy[interaction_batch], qyy[interaction_batch];
+        size_t count = 0, q_count = 0;
+        auto flush = [&]() {
+            kernel(position.x, position.y, h, sx, sy, sm, per_body ? sh : nullptr, count, ax, ay);
+            q_kernel(position.x, position.y, h, cx, cy, per_body ? ch : nullptr, qxx, qxy, qyy, q_count, ax, ay);
+            count = 0;
+            q_count = 0;
+        };
+
+        uint32_t stack[walk_stack_size];
+        int top = 0;
+        stack[top++] = root;
+        while (top > 0) {
+            const bh_tree_node &node = pool[stack[--top]];
+            const double node_mass = node.get_mass();
+            if (node_mass == 0.0) {
+                continue; // nothing here (every body moved away)
+            }
+            counts.visit();
+
+            //
+            //  Far enough away: use the center of mass of the node
+            //
+            const double dx = node.get_position().x - position.x;
+            const double dy = node.get_position().y - position.y;
+            if (is_far_enough(stack[top], dx*dx + dy*dy, accel, h)) {
+                counts.node();
+                if (count == interaction_batch) { flush(); }
+                sx[count] = node.get_position().x;
+                sy[count] = node.get_position().y;
+                sm[count] = node_mass;
+                if (per_body) { sh[count] = node_softening_rms[stack[top]]; }
+                ++count;
+                if (use_quadrupoles) {
+                    const quadrupole &q = quadrupoles[stack[top]];
+                    cx[q_count] = node.get_position().x;
+                    cy[q_count] = node.get_position().y;
+                    if (per_body) { ch[q_count] = node_softening_rms[stack[top]]; }
+                    qxx[q_count] = q.xx;
+                    qxy[q_count] = q.xy;
+                    qyy[q_count] = q.yy;
+                    ++q_count;
+                }
+                continue;
+            }
+
+            //
+            //  A leaf that is too close, every body in the bucket acts on its own
+            //
+            if (node.is_leaf()) {
+                const leaf_entry *e = entries + node.get_first_slot();
+                counts.bodies(node.get_body_count());
+                for (uint32_t k = 0; k < node.get_body_count(); ++k) {
+                    if (count == interaction_batch) { flush(); }
+                    sx[count] = e[k].position.x;
+                    sy[count] = e[k].position.y;
+                    sm[count] = e[k].mass;
+                    sh[count] = e[k].softening;
+                    ++count;
+                }
+                continue;
+            }
+
+            //
+            //  Open the node, children are pushed backwards so they are visited NW, NE, SE, SW
+            //
+            for (int q = 3; q >= 0; --q) {
+                uint32_t child = node.get_child((Quadrant) q);
+                if (child != bh_tree_node::none) { stack[top++] = child; }
+            }
+        }
+        flush();
+        const double f = gravity_G * mass;
+        return point(f * ax, f * ay);
+    }
+
+    //
+    //  Create an empty leaf with a bucket of capacity slots, and return its index
+    //
+    //  track is set when working on the main arrays, and keeps the persistent tree
+    //  bookkeeping up to date. It is not set while subtrees are built in parallel.
+    //
+    uint32_t new_leaf(std::vector<bh_tree_node> &pool, std::vector<leaf_entry> &pool_slots,
+                      const region &r, uint32_t parent, int depth, uint32_t capacity, bool track) {
+        uint32_t index = (uint32_t) pool.size();
+        uint32_t first = (uint32_t) pool_slots.size();
+        pool_slots.resize(first + capacity);
+        pool.emplace_back(r, first, capacity, parent, depth);
+        if (track) { ++empty_leaves; }
+        return index;
+    }
+
+    //
+    //  Put a body in the bucket of a leaf
+    //
+    //  A full bucket (only at the maximum depth) moves to a block twice as large at the
+    //  end of the slots. The old block is not used again until the next build.
+    //
+    void add_to_leaf(std::vector<bh_tree_node> &pool, std::vector<leaf_entry> &pool_slots,
+                     uint32_t leaf, const leaf_entry &entry, bool track) {
+        if (pool[leaf].is_full()) {
+            uint32_t old_first = pool[leaf].get_first_slot();
+            uint32_t count = pool[leaf].get_body_count();
+            uint32_t capacity = std::max(2 * count, params.leaf_capacity);
+            uint32_t first = (uint32_t) pool_slots.size();
+            pool_slots.resize(first + capacity);
+            std::copy(pool_slots.begin() + old_first, pool_slots.begin() + old_first + count,
+                      pool_slots.begin() + first);
+            pool[leaf].move_bucket(first, capacity);
+            if (track) {
+                for (uint32_t k = 0; k < count; ++k) { slot_of_body[pool_slots[first + k].body] = first + k; }
+            }
+        }
+        if (track and pool[leaf].get_body_count() == 0) { --empty_leaves; }
+        uint32_t slot = pool[leaf].add_slot();
+        pool_slots[slot] = entry;
+        if (track) {
+            leaf_of_body[entry.body] = leaf;
+            slot_of_body[entry.body] = slot;
+        }
+    }
+
+    //
+    //  Take a body out of its leaf (the last body of the bucket takes its slot)
+    //
+    void remove_from_leaf(uint32_t body_index) {
+        bh_tree_node &node = nodes[leaf_of_body[body_index]];
+        uint32_t slot = slot_of_body[body_index];
+        uint32_t last = node.get_first_slot() + node.get_body_count() - 1;
+        if (slot != last) {
+            slots[slot] = slots[last];
+            slot_of_body[slots[slot].body] = slot;
+        }
+        node.remove_last_slot();
+        if (node.get_body_count() == 0) { ++empty_leaves; }
+        leaf_of_body[body_index] = bh_tree_node::none;
+        slot_of_body[body_index] = bh_tree_node::none;
+    }
+
+    //
+    //  Insert a body in the subtree starting at node start
+    //
+    //  Note: pool.emplace_back may move the pool, so we only hold on to indices
+    //
+    void insert_below(std::vector<bh_tree_node> &pool, std::vector<leaf_entry> &pool_slots, uint32_t start,
+                      const leaf_entry &entry, bool track) {
+        //
+        //  Find our way to the leaf we belong in
+        //
+        uint32_t current = start;
+        while (true) {
+            //
+            //  If LEAF
+            //
+            //  If there is room in the bucket (or the leaf is as deep as we go), the body
+            //  goes in the bucket. Otherwise the leaf is split: it becomes a conglomerate,
+            //  and the bodies of the bucket move to new leaves below it.
+            //
+            if (pool[current].is_leaf()) {
+                if (!pool[current].is_full() or pool[current].get_depth() >= params.max_depth) {
+                    add_to_leaf(pool, pool_slots, current, entry, track);
+                    return;
+                }
+                uint32_t first = pool[current].get_first_slot();
+                uint32_t count = pool[current].get_body_count();
+                pool[current].make_conglomerate();
+                for (uint32_t k = 0; k < count; ++k) {
+                    leaf_entry moved = pool_slots[first + k];
+                    add_to_child(pool, pool_slots, current, moved, track);
+                }
+                // the new body goes down from the conglomerate below
+            }
+            //
+            //  If Conglomerate node, go to the quadrant, or make a new leaf there
+            //
+            Quadrant q = pool[current].get_quadrant(entry.position);
+            uint32_t next = pool[current].get_child(q);
+            if (next == bh_tree_node::none) {
+                add_to_child(pool, pool_slots, current, entry, track);
+                return;
+            }
+            current = next;
+        }
+    }
+
+    //
+    //  Add a body to the child of a conglomerate, the child is created (as a leaf)
+    //  if there is none. The child must not need a split (used when splitting a leaf,
+    //  the children get at most leaf_capacity bodies).
+    //
+    void add_to_child(std::vector<bh_tree_node> &pool, std::vector<leaf_entry> &pool_slots,
+                      uint32_t parent, const leaf_entry &entry, bool track) {
+        Quadrant q = pool[parent].get_quadrant(entry.position);
+        uint32_t child = pool[parent].get_child(q);
+        if (child == bh_tree_node::none) {
+            region r = pool[parent].get_subregion_for_point(entry.position);
+            child = new_leaf(pool, pool_slots, r, parent, pool[parent].get_depth() + 1, params.leaf_capacity, track);
+            pool[parent].set_child(q, child);
+        }
+        add_to_leaf(pool, pool_slots, child, entry, track);
+    }
+
+    //
+    //  Add the node for the sorted keys [lo, hi) to pool, and return its index
+    //
+    //  All keys in the range share their first level digits. A range with at most
+    //  leaf_capacity bodies (or at the maximum depth) is a leaf. Ranges with at most
+    //  grain keys (below the top level) become placeholders in the pending list.
+    //
+    uint32_t emit_range(std::vector<bh_tree_node> &pool, std::vector<leaf_entry> &pool_slots,
+                        const body_store &bodies,
+                        const region &r, size_t lo, size_t hi, int level, uint32_t parent, size_t grain) {
+        const uint32_t count = (uint32_t) (hi - lo);
+        if (count <= params.leaf_capacity or level >= params.max_depth) {
+            uint32_t leaf = new_leaf(pool, pool_slots, r, parent, level, std::max(count, params.leaf_capacity), false);
+            for (size_t i = lo; i < hi; ++i) {
+                uint32_t b = keys[i].body;
+                pool_slots[pool[leaf].add_slot()] = leaf_entry{ bodies.get_position(b), bodies.get_mass(b), b,
+                                                                (float) softening_of(bodies, b) };
+            }
+            return leaf;
+        }
+
+        uint32_t self = (uint32_t) pool.size();
+        pool.emplace_back(r, 0, 0, parent, level);
+        if (level > 0 and count <= grain) {
+            pending.push_back(pending_subtree{ self, r, lo, hi, level });
+            return self;
+        }
+
+        pool[self].make_conglomerate();
+        size_t begin = lo;
+        for (int q = 0; q < 4 and begin < hi; ++q) {
+            // keys are sorted, so the bodies in quadrant q are the next ones in the range
+            size_t end = std::partition_point(keys.begin() + begin, keys.begin() + hi,
+                                              [&](const morton_entry &e) { return morton_digit(e.key, level) == q; })
+                         - keys.begin();
+            if (end > begin) {
+                uint32_t child = emit_range(pool, pool_slots, bodies, r.create_subregion((Quadrant) q),
+                                            begin, end, level + 1, self, grain);
+                pool[self].set_child((Quadrant) q, child);
+            }
+            begin = end;
+        }
+        return self;
+    }
+
+    //
+    //  After build: set the parent of every node, and the leaf and slot of every body
+    //
+    //  (parents set while building the subtrees refer to the subtree pools)
+    //
+    void link() {
+        leaf_of_body.assign(body_count, bh_tree_node::none);
+        slot_of_body.assign(body_count, bh_tree_node::none);
+        nodes[root].set_parent(bh_tree_node::none);
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            const bh_tree_node &node = nodes[i];
+            if (node.is_leaf()) {
+                uint32_t first = node.get_first_slot();
+                for (uint32_t s = first; s < first + node.get_body_count(); ++s) {
+                    leaf_of_body[slots[s].body] = i;
+                    slot_of_body[slots[s].body] = s;
+                }
+                continue;
+            }
+            for (int q = 0; q < 4; ++q) {
+                uint32_t child = node.get_child((Quadrant) q);
+                if (child != bh_tree_node::none) { nodes[child].set_parent(i); }
+            }
+        }
+        empty_leaves = 0;
+        relocated_since_build = 0;
+        nodes_at_build = nodes.size();
+    }
+
+public:
     friend std::ostream &operator<<(std::ostream &os, const bh_tree &tree) {
         os << "root: " << tree.global_region << " : ";
-        if (tree.root == nullptr) {
+        if (tree.nodes.empty()) {
             os << "nullptr" << std::endl;
         } else {
-            tree.root->to_stream(os, "  ");
+            tree.nodes[root].to_stream(os, tree.nodes.data(), "  ");
         }
         return os;
     }
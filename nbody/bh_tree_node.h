@@ -8,8 +8,10 @@
 //
 //  C++ STL Includes
 //
-#include <queue>
-#include <stack>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
 #include <ostream>
 #include <cmath>
 
@@ -19,424 +21,306 @@
 //
 #include "region.h"
 #include "body.h"
+#include "kernel.h"
 
 //
 //  Each node has a state
 //
-//    LEAF         : node with no subnodes
+//    LEAF         : node with no subnodes, holds a bucket of bodies
 //    CONGLOMERATE : node is, from a physics standpoint, an average of all its children
 //
 enum NodeState {
     LEAF, CONGLOMERATE };
 
+//
+//  Gravitational constant, and the default softening length
+//
+//  if points are too close, they are considered to be the same point
+//  later add code to handle collision physics
+//  todo: add colision mechanics here
+//
+const double gravity_G = 6.674e-11;
+const double gravity_epsilon = 2.0e1;
+
+//
+//  How close encounters are softened (see Softening in kernel.h)
+//
+//    kernel   : CUTOFF (no force closer than length), PLUMMER or SPLINE
+//    length   : softening length of every body
+//    per_body : use the softening column of the body_store instead (bodies without
+//               one use length). A pair is softened with the larger of its lengths.
+//
+//  With PLUMMER or SPLINE the force between two bodies stays bounded, so close
+//  encounters no longer kick bodies out and the time step can be several times larger.
+//
+struct softening_parameters {
+    Softening kernel = Softening::PLUMMER;
+    double length = gravity_epsilon;
+    bool per_body = false;
+
+    //  distance below which a pair is not plain 1/d^2 (a node this close is opened)
+    double reach(double h) const { return kernel == Softening::SPLINE ? spline_support * h : h; }
+};
+
+//
+//  A node is far enough away to be used as a whole when s/d <= theta
+//    s = size of the node, d = distance to its center of mass
+//
+const double opening_theta = 0.5;
+
+//
+//  A body in the bucket of a leaf
+//
+//  The buckets of all leaves are stored in one array owned by the tree, so the
+//  bodies of a leaf are next to each other in memory for the direct sum.
+//
+struct leaf_entry {
+    point position;
+    double mass;
+    uint32_t body;    // index of the body (in insertion order)
+    float softening;  // softening length (fits in what would be padding)
+};
+
+//
+//  Force on a body from a list of bodies, added up one by one
+//
+//  Every pair is softened with the larger softening length of the two, bodies on
+//  top of the body are skipped (this includes the body itself)
+//
+inline point direct_force(const leaf_entry *e, uint32_t count, const point &b_position, double b_mass,
+                          double b_softening, double G, Softening softening) {
+    double fx = 0.0, fy = 0.0;
+    for (uint32_t i = 0; i < count; ++i) {
+        double dx = e[i].position.x - b_position.x;
+        double dy = e[i].position.y - b_position.y;
+        double d_2 = dx*dx + dy*dy;
+        if (d_2 == 0.0) {
+            continue;
+        }
+        double f = G * b_mass * e[i].mass
+                   * softened_inverse_cube(softening, d_2, std::max(b_softening, (double) e[i].softening));
+        fx += f * dx;
+        fy += f * dy;
+    }
+    return point(fx, fy);
+}
+
+//
+//  Quadrupole moment of the bodies below a node, about their center of mass c
+//
+//    xx = sum m dx^2 / 2,  xy = sum m dx dy,  yy = sum m dy^2 / 2   (d = body - c)
+//
+//  The dipole about the center of mass is zero, so this is the next term after the
+//  mass, and it makes a node accurate enough to be used from closer by.
+//
+//  The walks add these terms with the quadrupole kernel (kernel.h)
+//
+struct quadrupole {
+    double xx, xy, yy;
+};
+
 
 //
 //  Barnes Hut Tree Node Class
 //
-//  Each node has a body object containing information necessary for the physics
-//    - my_body contains the physical properties
+//  Nodes no longer own each other. Every node of a tree lives in one contiguous pool
+//  (a std::vector<bh_tree_node> owned by bh_tree), and the children are 32-bit indices
+//  into that pool. This keeps the whole tree in one block of memory that is reused
+//  from step to step instead of thousands of separately allocated shared pointers.
+//
+//  The physics is stored inline
+//    - mass     : total mass of the bodies in the bucket (leaf), or of the children (conglomerate)
+//    - position : center of mass
 //
-//  Then it has 4 children
+//  Then it has 4 children, indexed by Quadrant
 //    - Northwest
 //    - Northeast
 //    - Southeast
 //    - Southwest
-//    - OUTSIDE (not in any of the 4 nodes above)
+//
+//  A leaf holds a bucket of up to the tree's leaf capacity bodies: slots
+//  [first_slot, first_slot + count) of the tree's leaf_entry array. A leaf at the
+//  maximum depth is never split, its bucket grows instead.
 //
 //  NodeState is an enumeration used to determine if the body is a Leaf or Conglomerate of subnodes
 //    - state : NodeState value to hold node type
 //
+//  Since a child is always created after its parent, children always have a larger
+//  index than their parent. Walking the pool from the back to the front therefore
+//  visits every child before its parent (see bh_tree::update).
+//
 
 class bh_tree_node {
-protected:
-    std::shared_ptr<body> my_body;
-    std::shared_ptr<bh_tree_node> nw, ne, se, sw, outside;
+public:
+    // index used for "no child" (an enum, so it can be passed by reference without a definition)
+    enum : uint32_t { none = 0xffffffffu };
 
+protected:
     region my_region;
+    point my_position;
+    double my_mass;
+
+    uint32_t children[4];   // indexed by Quadrant: NW, NE, SE, SW
+    uint32_t my_parent;     // bh_tree_node::none for the root
+
+    // bucket of a leaf
+    uint32_t first_slot;
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+
+    uint16_t my_depth;      // the root has depth 0
     NodeState state;
 
 public:
-    // Object constructor
+    // Object constructor, creates an empty leaf
     // Required input:
-    //    region : r        -  region that this node represents
-    //    body   : my_body  -  body that represents this region
-    bh_tree_node(region r,
-                 std::shared_ptr<body> my_body,
-                 std::shared_ptr<bh_tree_node> nw = nullptr,
-                 std::shared_ptr<bh_tree_node> ne = nullptr,
-                 std::shared_ptr<bh_tree_node> se = nullptr,
-                 std::shared_ptr<bh_tree_node> sw = nullptr)
-            : my_region(r), my_body(my_body), nw(nw), ne(ne), se(se), sw(sw) { state = NodeState::LEAF; outside = nullptr; }
-
-    // Object destructor
-    // When a node is destroyed, we will clear out subnodes, and destroy the node
-    // When we destroy a node, set each node to nullptr
-    virtual ~bh_tree_node() {
-        this->clear();
-        my_body = nullptr;
-        nw = nullptr;
-        ne = nullptr;
-        se = nullptr;
-        sw = nullptr;
-        outside = nullptr;
+    //    region : r          -  region that this node represents
+    //    uint32 : first      -  first slot of the bucket
+    //    uint32 : capacity   -  number of slots in the bucket
+    //    uint32 : parent     -  index of the parent node
+    //    int    : depth      -  depth of the node in the tree
+    bh_tree_node(const region &r, uint32_t first, uint32_t capacity, uint32_t parent, int depth)
+            : my_region(r), my_position(r.get_center()), my_mass(0.0), my_parent(parent),
+              first_slot(first), slot_count(0), slot_capacity(capacity),
+              my_depth((uint16_t) depth), state(NodeState::LEAF)
+    {
+        children[0] = children[1] = children[2] = children[3] = none;
     }
 
     //
-    //  Deletes all data in the node, and sub-nodes
+    //  A node with every field given, to put a saved tree back (bh_tree::set_state)
     //
-    void clear() {
-        // if the node is a leaf, clear out the pointers
-        if (state == NodeState::LEAF) {
-            my_body = nullptr;
-            nw = nullptr;
-            ne = nullptr;
-            se = nullptr;
-            sw = nullptr;
-            outside = nullptr;
-            return;
-        }
-        // For Conglomerate nodes
-        // If the quadrant is not null, then clear it
-        if (nw != nullptr) {
-            nw->clear();
-            nw = nullptr;
-        }
-        if (ne != nullptr) {
-            ne->clear();
-            ne = nullptr;
-        }
-        if (se != nullptr) {
-            se->clear();
-            se = nullptr;
-        }
-        if (sw != nullptr) {
-            sw->clear();
-            sw = nullptr;
-        }
-        if (outside != nullptr) {
-            outside->clear();
-            outside = nullptr;
-        }
-        my_body = nullptr;
-        return;
+    bh_tree_node(const region &r, const point &position, double mass, const uint32_t child[4], uint32_t parent,
+                 uint32_t first, uint32_t count, uint32_t capacity, int depth, NodeState s)
+            : my_region(r), my_position(position), my_mass(mass), my_parent(parent),
+              first_slot(first), slot_count(count), slot_capacity(capacity),
+              my_depth((uint16_t) depth), state(s)
+    {
+        std::copy(child, child + 4, children);
     }
 
     //
-    //  Subregions are created and used to create subnodes based on the quadrant
+    //  Turn a leaf into an (empty) conglomerate
+    //
+    //  The mass and center of mass are filled in later by bh_tree::update
+    //
+    void make_conglomerate() {
+        state = NodeState::CONGLOMERATE;
+        my_mass = 0.0;
+        my_position = point(0, 0);
+        slot_count = 0;
+        slot_capacity = 0;
+    }
+
     //
-    //  There are two versions of the fucntion exist so it works with point or body
-    // objects.
+    //  Subregions are created and used to create subnodes based on the quadrant
     //
-    region get_subregion_for_point(const point &p) {
+    region get_subregion_for_point(const point &p) const {
         Quadrant q = my_region.get_quadrant(p);
         return my_region.create_subregion(q);
     }
-    region get_subregion_for_body(const std::shared_ptr<body> &b) {
-        region r = get_subregion_for_point(b->get_position());
-        return r;
+
+    // Getters: for retreiving sub-nodes (bh_tree_node::none if there is no sub-node)
+    //
+    //  q is a child, NW to SW. Quadrant::OUTSIDE (a point the region doesn't hold) has
+    //  no child: it stops here in a debug build, and is no child (none, set_child does
+    //  nothing) otherwise, instead of reading past the children.
+    //
+    uint32_t get_child(unsigned q) const {
+        assert(q < 4);
+        return q < 4 ? children[q] : none;
+    }
+    uint32_t get_nw() const { return children[Quadrant::NW]; }
+    uint32_t get_ne() const { return children[Quadrant::NE]; }
+    uint32_t get_se() const { return children[Quadrant::SE]; }
+    uint32_t get_sw() const { return children[Quadrant::SW]; }
+
+    void set_child(unsigned q, uint32_t index) {
+        assert(q < 4);
+        if (q < 4) { children[q] = index; }
     }
 
-    // Getters: for retreiving pointers to sub-nodes;
-    std::shared_ptr<bh_tree_node> get_nw() { return nw; }
-    std::shared_ptr<bh_tree_node> get_ne() { return ne; }
-    std::shared_ptr<bh_tree_node> get_se() { return se; }
-    std::shared_ptr<bh_tree_node> get_sw() { return sw; }
-    std::shared_ptr<bh_tree_node> get_outside() { return outside; }
+    uint32_t get_parent() const { return my_parent; }
+    void set_parent(uint32_t index) { my_parent = index; }
 
-    // Setters for setting subnodes, these aren't used at this time
-    //    void set_nw(std::shared_ptr<bh_tree_node> node) { nw = node; }
-    //    void set_ne(std::shared_ptr<bh_tree_node> node) { ne = node; }
-    //    void set_se(std::shared_ptr<bh_tree_node> node) { se = node; }
-    //    void set_sw(std::shared_ptr<bh_tree_node> node) { sw = node; }
+    int get_depth() const { return my_depth; }
 
     // getter for retreiving the region
-    region get_region() const { return my_region; }
+    const region &get_region() const { return my_region; }
 
     // getter to get the quadrant for a point
     Quadrant get_quadrant(const point &p) const { return my_region.get_quadrant(p); };
 
-    // Used to determine if the node is a leaf or conglomerate
-    // not used at this time
-    //
     //  get_state() will get the state for this node
     //  is_leaf() is a quick boolian check to see if the node is a leaf
-    NodeState get_state() const { return bh_tree_node::state; }
-    bool is_leaf() { return this->state == NodeState::LEAF; }
-
-
-    // The heart of the program  to add a node
-    void add_node(std::shared_ptr<body> &b){
-        //
-        //  If LEAF
-        //
-        //  In the case of adding to a leaf, we need to move the body to a subnode
-        // before we add the new node.
-        //  There are two cases,
-        //    - current body and the new body are in the same quadrant
-        //    - current body and the new body are in different quadrants
-        //
-        if (is_leaf()) {
-            Quadrant leaf_body_quadrant = get_quadrant(my_body->get_position());
-            Quadrant new_body_quadrant = get_quadrant(b->get_position());
-
-            //
-            // Add ing a node follows one of two paths, depending on if the two nodes are in
-            //  the same quadrant or not. If the two are in the same quadrant, the insertion
-            //  method is recursive, and will terminate when they are in separate quadrants.
-            //    - create a region
-            //    - use that region to create a sub-node with our current body
-            //    - set our current sub-node to the appropriate quadrant
-            //   -*- If the quadrant is the same
-            //         use a recursive call to try inserting the new body
-            //         recursion means this will keep dividing until the nodes
-            //         are in different quadrants.
-            //   -*- If the quadrant is the different
-            //         set the new node in its quadrant.
-            //    - reset the current body
-            //    - set the state of this node to CONGLOMERATE
-            //
-
-            //
-            //  If the current node is in teh same quadrant as the new body
-            //
-            if (leaf_body_quadrant == new_body_quadrant) {
-                region r_shared = get_subregion_for_body(my_body);
-                std::shared_ptr<bh_tree_node> subnode = std::make_shared<bh_tree_node>(r_shared, my_body);
-                set_node_in_quadrant(subnode, leaf_body_quadrant);
-                subnode->add_node(b);    // recursive call
-                my_body = std::make_shared<body>(0, point(0,0), point(0,0)); // reset it
-                this->state = NodeState::CONGLOMERATE;
-            } else {
-                //
-                //  If the current node is in a different quadrant than the new body
-                //
-                region r_old = get_subregion_for_body(my_body);
-                region r_new = get_subregion_for_body(b);
-                std::shared_ptr<bh_tree_node> node_for_old = std::make_shared<bh_tree_node>(r_old, my_body);
-                std::shared_ptr<bh_tree_node> node_for_new = std::make_shared<bh_tree_node>(r_new, b);
-                set_node_in_quadrant(node_for_old, leaf_body_quadrant);
-                set_node_in_quadrant(node_for_new, new_body_quadrant);
-                my_body = std::make_shared<body>(0, point(0,0), point(0,0)); // reset it
-                this->state = NodeState::CONGLOMERATE;
-            }
-        //
-        //  If Conglomerate node, we can simply set the body to the correct quadrant
-        //
-        } else {
-            region r = this->get_subregion_for_body(b);
-            std::shared_ptr<bh_tree_node> new_node = std::make_shared<bh_tree_node>(r, b);
-            Quadrant q = this->get_region().get_quadrant(b->get_position());
-            set_node_in_quadrant(new_node, q);
-        }
-    }
+    NodeState get_state() const { return state; }
+    bool is_leaf() const { return state == NodeState::LEAF; }
 
-    //
-    //  Place node in the selected quadrant
-    //
-    void set_node_in_quadrant(const std::shared_ptr<bh_tree_node> &new_node, const Quadrant &q) {
-        switch (q) {
-            case NW:
-                nw = new_node;
-                break;
-            case NE:
-                ne = new_node;
-                break;
-            case SE:
-                se = new_node;
-                break;
-            case SW:
-                sw = new_node;
-                break;
-            case OUTSIDE:
-                // todo: handle points outside of region
-                outside = new_node;
-                break;
-        }
-    }
+    //  A leaf whose bodies all moved away (see bh_tree::refit), it has no mass
+    bool is_empty_leaf() const { return state == NodeState::LEAF and slot_count == 0; }
 
-    double get_mass() {
-        return my_body->get_mass();
-    }
+    double get_mass() const { return my_mass; }
+    const point &get_position() const { return my_position; }
 
-    point get_position() {
-        return my_body->get_position();
+    void set_mass_and_position(double mass, const point &position) {
+        my_mass = mass;
+        my_position = position;
     }
 
-    // compute s/d < 0.5
-    // s = width of region, d is distance
-    point compute_force(std::shared_ptr<body> &b) {
-        point force(0,0);
-
-        // is far away?
-        double G = 6.674e-11;
-        double width = my_region.width();
-        double height = my_region.height();
-        double s = width > height ? width : height; // s is the max of width and height
-        double d = distance(b->get_position(), this->my_body->get_position());
-        double sd_ratio = s/d;
-        double theta = 0.5;
-
-        // if points are too close, they are considered to be the same point
-        // later add code to handle collision physics
-        // todo: add colision mechanics here
-        double epsilon = 2.0e1;
-        if (d < epsilon) {
-            return force;
-        }
-
-        // Compute the force on the body if this node is a leaf,
-        // or the sd ratio for this node and the body are less than our theta
-        //
-        if (this->state == NodeState::LEAF or sd_ratio <= theta) {
-            // Force magnitude and direction
-            double force_magnitude = G*b->get_mass() * my_body->get_mass() / (d*d);
-            point force_direction = my_body->get_position() - b->get_position();
-            force_direction /= d; // normalize the force direction
-            force_direction *= force_magnitude;
-            return force_direction;
-        }
-        //
-        //   if the s/d condition is not met, try again for sub-nodes
-        //     (this will terminate when it reaches a leaf node)
-        //
-        if (nw != nullptr) {
-            force += nw->compute_force(b);
-        }
-        if (ne != nullptr) {
-            force += ne->compute_force(b);
-        }
-        if (se != nullptr) {
-            force += se->compute_force(b);
-        }
-        if (sw != nullptr) {
-            force += sw->compute_force(b);
-        }
-
-        return force;
-    }
-
-    //
-    // Updates the masses and positions for body nodes
     //
-    //  This calls recursively through the subnodes
+    //  Bucket of a leaf
     //
-    void update_body() {
-        if (state == NodeState::LEAF) {
-            return; // for leafs, do nothing
-        }
-        double mass = 0.0;
-        point velocity(0,0);
-        point position(0,0);
-
-        if (nw != nullptr) {
-            nw->update_body();
-
-            double nw_mass = nw->get_mass();
-            point nw_position = nw->get_position();
-
-            mass += nw_mass;
-            position += (nw_position *= nw_mass);
-        }
-        if (ne != nullptr) {
-            ne->update_body();
-
-            double ne_mass = ne->get_mass();
-            point ne_position = ne->get_position();
-
-            mass += ne->get_mass();
-            position += (ne_position *= ne_mass);
-        }
-        if (sw != nullptr) {
-            sw->update_body();
-
-            double sw_mass = sw->get_mass();
-            point sw_position = sw->get_position();
-
-            mass += sw->get_mass();
-            position += (sw_position *= sw_mass);
-        }
-        if (se != nullptr) {
-            se->update_body();
-
-            double se_mass = se->get_mass();
-            point se_position = se->get_position();
-
-            mass += se->get_mass();
-            position += (se_position *= se_mass);
-        }
-        my_body->set_mass(mass);
-        position /= mass;
-        my_body->set_position(position);
-
+    uint32_t get_first_slot() const { return first_slot; }
+    uint32_t get_body_count() const { return slot_count; }
+    uint32_t get_slot_capacity() const { return slot_capacity; }
+    bool is_full() const { return slot_count == slot_capacity; }
+
+    //  returns the slot for the new body, the caller makes sure the bucket is not full
+    uint32_t add_slot() { return first_slot + slot_count++; }
+    //  the last slot is dropped, the caller moves its body to the slot being freed
+    void remove_last_slot() { --slot_count; }
+    //  the bucket moved to a larger block of slots (only for leaves at the maximum depth)
+    void move_bucket(uint32_t first, uint32_t capacity) {
+        first_slot = first;
+        slot_capacity = capacity;
     }
 
-    std::ostream &to_stream(std::ostream &os, std::string buffer="") {
-        os << std::endl << buffer << "Body: " << *my_body << " : " << my_region << std::endl;
-
-        os << buffer << "nw: ";
-        if (nw == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            nw->to_stream(os, buffer + "  ");
-        }
-        os << buffer << "ne: ";
-        if (ne == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            ne->to_stream(os, buffer + "  ");
-        }
-
-        os << buffer << "se: ";
-        if (se == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            se->to_stream(os, buffer + "  ");
-        }
-
-        os << buffer << "sw: ";
-        if (sw == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            sw->to_stream(os, buffer + "  ");
-        }
-
-        return os;
+    //  Size of the node for the opening test, the max of width and height
+    double get_size() const {
+        double width = my_region.width();
+        double height = my_region.height();
+        return width > height ? width : height;
+    }
 
+    //  Squared distance from the center of mass to the furthest corner of the node
+    double get_bmax_2() const {
+        point lo = my_region.get_min_corner(), hi = my_region.get_max_corner();
+        double dx = std::max(my_position.x - lo.x, hi.x - my_position.x);
+        double dy = std::max(my_position.y - lo.y, hi.y - my_position.y);
+        return dx*dx + dy*dy;
     }
 
-    friend std::ostream &operator<<(std::ostream &os, const bh_tree_node &node) {
-        os << "\n" << "mass: " << *(node.my_body) << " : " << node.my_region << std::endl;
-        os << "nw: ";
-        if (node.nw == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            os << *(node.nw);
-        }
-        os << "ne: ";
-        if (node.ne == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            os << *(node.ne);
-        }
+    std::ostream &to_stream(std::ostream &os, const bh_tree_node *pool, std::string buffer="") const {
+        os << std::endl << buffer << "Body: mass: " << my_mass << " position: " << my_position
+           << " : " << my_region << std::endl;
 
-        os << "se: ";
-        if (node.se == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            os << *(node.se);
+        if (state == NodeState::LEAF) {
+            os << buffer << "bodies: " << slot_count << std::endl;
+            return os;
         }
 
-        os << "sw: ";
-        if (node.sw == nullptr) {
-            os << "nullptr" << std::endl;
-        } else {
-            os << *(node.sw);
+        const char *names[4] = { "nw: ", "ne: ", "se: ", "sw: " };
+        for (int q = 0; q < 4; ++q) {
+            os << buffer << names[q];
+            if (children[q] == none) {
+                os << "nullptr" << std::endl;
+            } else {
+                pool[children[q]].to_stream(os, pool, buffer + "  ");
+            }
         }
 
         return os;
     }
-
-    //friend class bh_tree;
 };
 
 
@@ -11,12 +11,16 @@
 #define TREE_CODE_BODY_BUILDER_H
 
 
+#include <fstream>
 #include <iostream>
 
+#include <sstream>
+#include <string>
 #include <vector>
 #include <cmath>
 
-#include "body.h"
+#include "body_store.h"
+#include "region.h"
 #include "point.h"  // redundant, but included for clarity that points are used here
 
 //
@@ -25,14 +29,13 @@
 //  Looks at the orbit of four bodies around a large Central mass
 //
 //
-//  We need the input to be a vector of shared pointers
-void body_test_1(std::vector<std::shared_ptr<body>> &bodies) {
+//  The bodies are added to a body_store
+inline void body_test_1(body_store &bodies) {
     double G = 6.674e-14;
 
     bodies.clear(); // empty the list
 
     double big_mass = 200;
-    std::shared_ptr<body> central_body = std::make_shared<body>(big_mass, point(0,0), point(0,0));
     double mass = 100;
     double distance = 500;
 
@@ -52,28 +55,24 @@ void body_test_1(std::vector<std::shared_ptr<body>> &bodies) {
     // first body will be located east, traveling south
     point b1_loc = direction_east; b1_loc *= distance;
     point b1_vel = direction_south; b1_vel *= velocity;
-    std::shared_ptr<body> b1 = std::make_shared<body>(mass, b1_loc, b1_vel);
     // second body will be located south, traveling west
     point b2_loc = direction_south; b2_loc *= distance;
     point b2_vel = direction_west; b2_vel *= velocity;
-    std::shared_ptr<body> b2 = std::make_shared<body>(mass, b2_loc, b2_vel);
     // third body will be located west, traveling north
     point b3_loc = direction_west; b3_loc *= distance;
     point b3_vel = direction_north; b3_vel *= velocity;
-    std::shared_ptr<body> b3 = std::make_shared<body>(mass, b3_loc, b3_vel);
     // fourth body will be located north, traveling east
     point b4_loc = direction_north; b4_loc *= distance;
     point b4_vel = direction_east; b4_vel *= velocity;
-    std::shared_ptr<body> b4 = std::make_shared<body>(mass, b4_loc, b4_vel);
 
     //
     //  Add bodies to list
     //
-    bodies.push_back(central_body);
-    bodies.push_back(b1);
-    bodies.push_back(b2);
-    bodies.push_back(b3);
-    bodies.push_back(b4);
+    bodies.add(big_mass, point(0,0), point(0,0));
+    bodies.add(mass, b1_loc, b1_vel);
+    bodies.add(mass, b2_loc, b2_vel);
+    bodies.add(mass, b3_loc, b3_vel);
+    bodies.add(mass, b4_loc, b4_vel);
 }
 
 #include <random>
@@ -89,7 +88,7 @@ void body_test_1(std::vector<std::shared_ptr<body>> &bodies) {
 //
 //  get the number of bodies as an argument passed
 //    ****    ****    ****    ****    ****    ****    ****    ****    ****    ****    ****    ****
-void many_bodies_test(std::vector<std::shared_ptr<body>> &bodies, int num_bodies = 500) {
+inline void many_bodies_test(body_store &bodies, int num_bodies = 500) {
     double G = 6.674e-11;
     double pi = acos(-1);
 
@@ -102,8 +101,7 @@ void many_bodies_test(std::vector<std::shared_ptr<body>> &bodies, int num_bodies
     bodies.clear(); // empty the list
 
     // create and add central mass (black hole)
-    std::shared_ptr<body> bdy = std::make_shared<body>(big_mass, point(0,0), point(0,0));
-    bodies.push_back(bdy);
+    bodies.add(big_mass, point(0,0), point(0,0));
 
 
 
@@ -123,18 +121,16 @@ void many_bodies_test(std::vector<std::shared_ptr<body>> &bodies, int num_bodies
 
         point pos(x, y);
         point vel(vx, vy);
-        std::shared_ptr<body> b = std::make_shared<body>(mass, pos, vel);
-
-        bodies.push_back(b);
+        bodies.add(mass, pos, vel);
     }
 
 
 }
 
 enum Rotation{ CLOCKWISE, COUNTERCLOCKWISE };
-void add_galaxy_to_body_list(std::vector<std::shared_ptr<body>> &bodies, point center,
-                             double min_radius = 500, double max_radius = 1000,
-                             int num_bodies = 500, Rotation rotation = Rotation::CLOCKWISE)
+inline void add_galaxy_to_body_list(body_store &bodies, point center,
+                                    double min_radius = 500, double max_radius = 1000,
+                                    int num_bodies = 500, Rotation rotation = Rotation::CLOCKWISE)
 {
     double G = 6.674e-11;
     double pi = acos(-1);
@@ -144,8 +140,7 @@ void add_galaxy_to_body_list(std::vector<std::shared_ptr<body>> &bodies, point c
 
 
     // create and add central mass (black hole)
-    std::shared_ptr<body> bdy = std::make_shared<body>(big_mass, center, point(0,0));
-    bodies.push_back(bdy);
+    bodies.add(big_mass, center, point(0,0));
 
 
 
@@ -174,9 +169,7 @@ void add_galaxy_to_body_list(std::vector<std::shared_ptr<body>> &bodies, point c
 
         point pos(x, y);
         point vel(vx, vy);
-        std::shared_ptr<body> b = std::make_shared<body>(mass, pos, vel);
-
-        bodies.push_back(b);
+        bodies.add(mass, pos, vel);
     }
 
 
@@ -185,7 +178,7 @@ void add_galaxy_to_body_list(std::vector<std::shared_ptr<body>> &bodies, point c
 //
 //  Create a galaxy in the upper right, and lower left quadrants
 //
-void create_two_galaxies(std::vector<std::shared_ptr<body>> &bodies, const region &r, int num_bodies=500) {
+inline void create_two_galaxies(body_store &bodies, const region &r, int num_bodies=500) {
 
     point global_center = r.get_center();
 //    double width = r.width();
@@ -210,5 +203,31 @@ void create_two_galaxies(std::vector<std::shared_ptr<body>> &bodies, const regio
 
 
 }
+//
+//  Read bodies from a text file, one body per line: mass x y vx vy
+//
+//  Empty lines and lines starting with # are skipped. The bodies replace the ones in
+//  the store, returns false if the file can't be read or holds no bodies.
+//
+inline bool read_bodies(const std::string &path, body_store &bodies) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cout << "can't read " << path << std::endl;
+        return false;
+    }
+    bodies.clear();
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() or line[0] == '#') {
+            continue;
+        }
+        std::stringstream ss(line);
+        double m, x, y, vx, vy;
+        if (ss >> m >> x >> y >> vx >> vy) {
+            bodies.add(m, point(x, y), point(vx, vy));
+        }
+    }
+    return !bodies.empty();
+}
 
 #endif //TREE_CODE_BODY_BUILDER_H
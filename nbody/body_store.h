@@ -0,0 +1,306 @@
+//
+// Created on 10/17/26.
+//
+//  Storage for all bodies of a simulation, one array per quantity
+//
+//  Every pass over the bodies (building the tree, computing forces, moving the bodies,
+//  drawing them) reads the same few quantities of every body. Keeping each quantity in
+//  its own contiguous array means these passes stream through memory in order,
+//  instead of following a pointer to a separately allocated body for every one.
+//
+
+#ifndef TREE_CODE_BODY_STORE_H
+#define TREE_CODE_BODY_STORE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "body.h"
+#include "point.h"
+
+//
+//  Work done by the last force walk of a body (see bh_tree::compute_forces)
+//
+//    nodes_visited     : nodes the opening test was run on
+//    node_interactions : nodes used whole, cell-body interactions
+//    body_interactions : bodies of leaves that were too close, body-body interactions
+//
+//  In a group walk the nodes are shared by the group, every body gets the nodes visited
+//  by the group and the interactions of the whole list.
+//
+struct interaction_counts {
+    uint32_t nodes_visited;
+    uint32_t node_interactions;
+    uint32_t body_interactions;
+
+    //  the cost of the body, a weight for schedulers and partitioners
+    uint32_t cost() const { return node_interactions + body_interactions; }
+};
+
+//
+//  Structure of arrays for the bodies
+//
+//  Always present:
+//    - x, y   : position
+//    - vx, vy : velocity
+//    - mass
+//
+//  Optional columns are only allocated when something asks for them
+//    - last_x, last_y : position before the last step (for drawing trails)
+//    - softening      : softening length of every body (see softening_parameters)
+//    - interactions   : work of the last force walk of every body (interaction_counts)
+//
+//  Bodies are addressed by index (0 .. size()-1), which is also the body index used by
+//  bh_tree. Removing a body moves the last body into its place, so indices change.
+//  Every body also has an id that never changes and is never reused, use index_of to
+//  find a body again after removals.
+//
+class body_store {
+public:
+    // id / index used for "no body" (an enum, so it can be passed by reference without a definition)
+    enum : uint32_t { none = 0xffffffffu };
+
+protected:
+    std::vector<double> m_x, m_y;
+    std::vector<double> m_vx, m_vy;
+    std::vector<double> m_mass;
+
+    // optional columns (empty when not tracked)
+    bool m_track_last_position;
+    std::vector<double> m_last_x, m_last_y;
+    bool m_has_softening;
+    double m_default_softening;      // softening of the bodies added without one
+    std::vector<double> m_softening;
+    bool m_count_interactions;
+    std::vector<interaction_counts> m_interactions;
+
+    std::vector<uint32_t> m_id;        // id of the body at each index
+    std::vector<uint32_t> m_index_of;  // index of each id, none once the body is removed
+
+public:
+    body_store() : m_track_last_position(false), m_has_softening(false), m_default_softening(0.0),
+                   m_count_interactions(false) { }
+
+    size_t size() const { return m_mass.size(); }
+    bool empty() const { return m_mass.empty(); }
+
+    //
+    //  Removes all bodies, ids start again from 0
+    //
+    void clear() {
+        m_x.clear(); m_y.clear();
+        m_vx.clear(); m_vy.clear();
+        m_mass.clear();
+        m_last_x.clear(); m_last_y.clear();
+        m_softening.clear();
+        m_interactions.clear();
+        m_id.clear();
+        m_index_of.clear();
+    }
+
+    void reserve(size_t n) {
+        m_x.reserve(n); m_y.reserve(n);
+        m_vx.reserve(n); m_vy.reserve(n);
+        m_mass.reserve(n);
+        m_id.reserve(n);
+        if (m_track_last_position) {
+            m_last_x.reserve(n); m_last_y.reserve(n);
+        }
+        if (m_has_softening) {
+            m_softening.reserve(n);
+        }
+        if (m_count_interactions) {
+            m_interactions.reserve(n);
+        }
+    }
+
+    //
+    //  Add a body at the end, returns its id
+    //
+    uint32_t add(double mass, const point &position, const point &velocity) {
+        uint32_t id = (uint32_t) m_index_of.size();
+        m_index_of.push_back((uint32_t) size());
+        m_id.push_back(id);
+        m_x.push_back(position.x);
+        m_y.push_back(position.y);
+        m_vx.push_back(velocity.x);
+        m_vy.push_back(velocity.y);
+        m_mass.push_back(mass);
+        if (m_track_last_position) {
+            m_last_x.push_back(position.x);
+            m_last_y.push_back(position.y);
+        }
+        if (m_has_softening) {
+            m_softening.push_back(m_default_softening);
+        }
+        if (m_count_interactions) {
+            m_interactions.push_back(interaction_counts{ 0, 0, 0 });
+        }
+        return id;
+    }
+    // same as above, with a softening length (turns the softening column on)
+    uint32_t add(double mass, const point &position, const point &velocity, double softening) {
+        if (!m_has_softening) {
+            use_softening(true, softening);
+        }
+        uint32_t id = add(mass, position, velocity);
+        m_softening.back() = softening;
+        return id;
+    }
+    uint32_t add(const body &b) {
+        return add(b.get_mass(), b.get_position(), b.get_velocity());
+    }
+
+    //
+    //  Remove the body at index i, the last body takes its index
+    //
+    void remove(size_t i) {
+        size_t last = size() - 1;
+        m_index_of[m_id[i]] = none;
+        if (i != last) {
+            m_x[i] = m_x[last]; m_y[i] = m_y[last];
+            m_vx[i] = m_vx[last]; m_vy[i] = m_vy[last];
+            m_mass[i] = m_mass[last];
+            if (m_track_last_position) {
+                m_last_x[i] = m_last_x[last];
+                m_last_y[i] = m_last_y[last];
+            }
+            if (m_has_softening) {
+                m_softening[i] = m_softening[last];
+            }
+            if (m_count_interactions) {
+                m_interactions[i] = m_interactions[last];
+            }
+            m_id[i] = m_id[last];
+            m_index_of[m_id[i]] = (uint32_t) i;
+        }
+        m_x.pop_back(); m_y.pop_back();
+        m_vx.pop_back(); m_vy.pop_back();
+        m_mass.pop_back();
+        if (m_track_last_position) {
+            m_last_x.pop_back();
+            m_last_y.pop_back();
+        }
+        if (m_has_softening) {
+            m_softening.pop_back();
+        }
+        if (m_count_interactions) {
+            m_interactions.pop_back();
+        }
+        m_id.pop_back();
+    }
+
+    //
+    //  Ids
+    //
+    uint32_t get_id(size_t i) const { return m_id[i]; }
+    // index of the body with this id, none if it was removed
+    uint32_t index_of(uint32_t id) const { return id < m_index_of.size() ? m_index_of[id] : (uint32_t) none; }
+
+    //
+    //  Getters and Setters for one body
+    //
+    double get_mass(size_t i) const { return m_mass[i]; }
+    void set_mass(size_t i, double m) { m_mass[i] = m; }
+
+    point get_position(size_t i) const { return point(m_x[i], m_y[i]); }
+    void set_position(size_t i, const point &p) { m_x[i] = p.x; m_y[i] = p.y; }
+
+    point get_velocity(size_t i) const { return point(m_vx[i], m_vy[i]); }
+    void set_velocity(size_t i, const point &v) { m_vx[i] = v.x; m_vy[i] = v.y; }
+
+    point get_momentum(size_t i) const { return get_velocity(i) * m_mass[i]; }
+
+    // a copy of the body, for code that works with single bodies
+    body get_body(size_t i) const { return body(m_mass[i], get_position(i), get_velocity(i)); }
+
+    //
+    //  Columns, for passes over all bodies
+    //
+    const double *x() const { return m_x.data(); }
+    const double *y() const { return m_y.data(); }
+    const double *vx() const { return m_vx.data(); }
+    const double *vy() const { return m_vy.data(); }
+    const double *mass() const { return m_mass.data(); }
+    double *x() { return m_x.data(); }
+    double *y() { return m_y.data(); }
+    double *vx() { return m_vx.data(); }
+    double *vy() { return m_vy.data(); }
+    double *mass() { return m_mass.data(); }
+
+    //
+    //  Last position column
+    //
+    //  Turning it on allocates the column, starting from the current positions.
+    //  Turning it off frees it.
+    //
+    void track_last_position(bool track) {
+        if (track == m_track_last_position) {
+            return;
+        }
+        m_track_last_position = track;
+        if (track) {
+            m_last_x = m_x;
+            m_last_y = m_y;
+        } else {
+            std::vector<double>().swap(m_last_x);
+            std::vector<double>().swap(m_last_y);
+        }
+    }
+    bool has_last_position() const { return m_track_last_position; }
+    point get_last_position(size_t i) const { return point(m_last_x[i], m_last_y[i]); }
+    double *last_x() { return m_last_x.data(); }
+    double *last_y() { return m_last_y.data(); }
+    const double *last_x() const { return m_last_x.data(); }
+    const double *last_y() const { return m_last_y.data(); }
+
+    //
+    //  Softening column
+    //
+    //  Turning it on gives every body (and the ones added later without a length of
+    //  their own) the softening length, turning it off frees it.
+    //
+    void use_softening(bool use, double length) {
+        m_default_softening = length;
+        if (use == m_has_softening) {
+            return;
+        }
+        m_has_softening = use;
+        if (use) {
+            m_softening.assign(size(), length);
+        } else {
+            std::vector<double>().swap(m_softening);
+        }
+    }
+    bool has_softening() const { return m_has_softening; }
+    double get_softening(size_t i) const { return m_softening[i]; }
+    void set_softening(size_t i, double h) { m_softening[i] = h; }
+    double *softening() { return m_softening.data(); }
+    const double *softening() const { return m_softening.data(); }
+
+    //
+    //  Interaction counts column
+    //
+    //  While it is on, the tree walks count their work for every body (see
+    //  compute_forces in forces.h), the counts of a body are those of its last walk.
+    //  Turning it on starts every body at 0, turning it off frees it.
+    //
+    void count_interactions(bool count) {
+        if (count == m_count_interactions) {
+            return;
+        }
+        m_count_interactions = count;
+        if (count) {
+            m_interactions.assign(size(), interaction_counts{ 0, 0, 0 });
+        } else {
+            std::vector<interaction_counts>().swap(m_interactions);
+        }
+    }
+    bool has_interaction_counts() const { return m_count_interactions; }
+    const interaction_counts &get_interactions(size_t i) const { return m_interactions[i]; }
+    interaction_counts *interactions() { return m_interactions.data(); }
+    const interaction_counts *interactions() const { return m_interactions.data(); }
+};
+
+
+#endif //TREE_CODE_BODY_STORE_H
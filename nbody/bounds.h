@@ -0,0 +1,142 @@
+//
+// Created on 10/17/26.
+//
+//  Root region of the tree, computed from the bodies every step
+//
+//  A fixed region has to be large enough for anything that might happen, and every
+//  level of the tree above the extent of the bodies is wasted. Fitting the region to
+//  the bodies keeps the depth of the tree tied to the real size of the system.
+//
+
+#ifndef TREE_CODE_BOUNDS_H
+#define TREE_CODE_BOUNDS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "body_store.h"
+#include "region.h"
+#include "parallel.h"
+
+//
+//  How the region is fitted to the bodies
+//
+//    outlier_sigmas : bodies further than this many standard deviations from the mean
+//                     position are left out of the region (one ejected body would
+//                     otherwise stretch the whole tree). The tree keeps them in its far
+//                     field list, they still pull on and feel every other body.
+//    margin         : the region is made this much larger than the bodies, so that a
+//                     persistent tree can keep its region for a few steps
+//
+struct region_policy {
+    double outlier_sigmas = 8.0;
+    double margin = 0.05;
+};
+
+//
+//  Square region around the bodies, following the policy
+//
+//  Two passes on the pool: the mean and spread of the positions, then the min/max of
+//  the bodies that are not outliers. Each block of fit_block bodies is reduced on its
+//  own, the blocks are combined at the end in order. The blocks don't depend on the
+//  number of threads, so neither do the sums (and the region).
+//
+const size_t fit_block = 16384;
+
+inline region fit_region(const body_store &bodies, const region_policy &policy = region_policy(),
+                         task_pool &pool = default_pool()) {
+    const size_t n = bodies.size();
+    if (n == 0) {
+        return region(-1, -1, 1, 1);
+    }
+    const size_t blocks = (n + fit_block - 1) / fit_block;
+
+    //
+    //  Mean and variance (relative to the first body, to keep the sums small)
+    //
+    const point origin = bodies.get_position(0);
+    const double *x = bodies.x(), *y = bodies.y();
+    struct moments { double sx = 0, sy = 0, sxx = 0, syy = 0; };
+    std::vector<moments> partial(blocks);
+    pool.run(n, fit_block, [&](size_t begin, size_t end, unsigned) {
+        moments m;
+        for (size_t i = begin; i < end; ++i) {
+            point p = point(x[i], y[i]) - origin;
+            m.sx += p.x;
+            m.sy += p.y;
+            m.sxx += p.x * p.x;
+            m.syy += p.y * p.y;
+        }
+        partial[begin / fit_block] = m;
+    });
+    moments total;
+    for (const moments &m : partial) {
+        total.sx += m.sx;
+        total.sy += m.sy;
+        total.sxx += m.sxx;
+        total.syy += m.syy;
+    }
+    const double mx = total.sx / n, my = total.sy / n;
+    const double variance = std::max(0.0, total.sxx / n - mx * mx) + std::max(0.0, total.syy / n - my * my);
+    const point mean = origin + point(mx, my);
+    double cutoff_2 = policy.outlier_sigmas * policy.outlier_sigmas * variance;
+    if (policy.outlier_sigmas <= 0.0 or cutoff_2 == 0.0) {
+        cutoff_2 = std::numeric_limits<double>::infinity(); // no outliers
+    }
+
+    //
+    //  Extent of the bodies that are not outliers
+    //
+    struct extent {
+        double xmin = std::numeric_limits<double>::infinity(), ymin = std::numeric_limits<double>::infinity();
+        double xmax = -std::numeric_limits<double>::infinity(), ymax = -std::numeric_limits<double>::infinity();
+    };
+    std::vector<extent> extents(blocks);
+    pool.run(n, fit_block, [&](size_t begin, size_t end, unsigned) {
+        extent e;
+        for (size_t i = begin; i < end; ++i) {
+            point p(x[i], y[i]);
+            point d = p - mean;
+            if (d.x * d.x + d.y * d.y > cutoff_2) {
+                continue; // outlier
+            }
+            e.xmin = std::min(e.xmin, p.x);
+            e.xmax = std::max(e.xmax, p.x);
+            e.ymin = std::min(e.ymin, p.y);
+            e.ymax = std::max(e.ymax, p.y);
+        }
+        extents[begin / fit_block] = e;
+    });
+    extent all;
+    for (const extent &e : extents) {
+        all.xmin = std::min(all.xmin, e.xmin);
+        all.xmax = std::max(all.xmax, e.xmax);
+        all.ymin = std::min(all.ymin, e.ymin);
+        all.ymax = std::max(all.ymax, e.ymax);
+    }
+
+    //
+    //  Square around the extent, so the cells of the tree are square too
+    //
+    point center((all.xmin + all.xmax) / 2.0, (all.ymin + all.ymax) / 2.0);
+    double half = std::max(all.xmax - all.xmin, all.ymax - all.ymin) / 2.0 * (1.0 + policy.margin);
+    if (!(half > 0.0)) {
+        half = 1.0; // all bodies at one point
+    }
+    return region(center.x - half, center.y - half, center.x + half, center.y + half);
+}
+
+//
+//  Can a tree keep its region, now that the bodies fit in fitted?
+//
+//  The old region has to hold the fitted one, and not be so much larger that the top
+//  level of the tree is wasted.
+//
+inline bool region_still_fits(const region &current, const region &fitted) {
+    return current.is_in(fitted.get_min_corner()) and current.is_in(fitted.get_max_corner())
+           and current.width() < 2.0 * fitted.width();
+}
+
+#endif //TREE_CODE_BOUNDS_H
@@ -0,0 +1,182 @@
+//
+// Created on 10/17/26.
+//
+//  Direct summation: the force on every body from every other body, O(N^2)
+//
+//  Below a few thousand bodies, building and walking a tree costs more than adding up
+//  all the pairs (see direct_crossover). The sum is also exact up to the rounding of
+//  the kernels, which makes it the reference to check the tree and the FMM against.
+//
+//  The bodies are cut into tiles of direct_tile bodies, and every pair of tiles
+//  (I <= J) is one task: the mutual kernel (kernel.h) runs every body of tile I over
+//  the bodies of tile J (over the bodies after it when I == J). Every pair of bodies
+//  is visited once, the force on the second body comes from Newton's third law. The
+//  positions, masses and sums of two tiles fit in the L1 cache.
+//
+//  Two tasks can add to the same body, so the tile pairs are cut into direct_groups
+//  groups of consecutive pairs, every group sums into columns of its own, and the
+//  columns are added up at the end in the order of the groups. The groups depend on
+//  the number of bodies only, not on the pool, so the forces are the same bit for bit
+//  with any number of threads.
+//
+
+#ifndef TREE_CODE_DIRECT_H
+#define TREE_CODE_DIRECT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "bh_tree_node.h"
+#include "body_store.h"
+#include "kernel.h"
+#include "parallel.h"
+#include "point.h"
+
+//
+//  Bodies per tile
+//
+const uint32_t direct_tile = 256;
+
+//
+//  Groups of tile pairs summed on their own (see above). Up to this many threads share
+//  the work, more than that wait; each group keeps two columns of n doubles.
+//
+const size_t direct_groups = 16;
+
+//
+//  Number of bodies from which the tree is faster than the direct sum (compute_forces
+//  in forces.h switches at this number)
+//
+//  Measured with the default tree and walk settings on a disk of bodies
+//  (many_bodies_test), with the AVX512 kernels: at 1000 bodies the direct sum takes
+//  0.75 ms against 2.4 ms for build + update + walk, at 4000 bodies 10.9 ms against
+//  12.7 ms, at 6000 bodies 32 ms against 20 ms. Both split over the pool the same way.
+//
+const size_t direct_crossover = 4000;
+
+class direct_solver {
+protected:
+    //  the bodies (h only with per body softening)
+    std::vector<double> x, y, m, h;
+
+    //  the sums of every group of tile pairs
+    std::vector<std::vector<double>> sum_x, sum_y;
+
+    std::vector<std::pair<uint32_t, uint32_t>> tile_pairs;
+
+    void load(const body_store &bodies, const softening_parameters &soft) {
+        const size_t n = bodies.size();
+        x.assign(bodies.x(), bodies.x() + n);
+        y.assign(bodies.y(), bodies.y() + n);
+        m.assign(bodies.mass(), bodies.mass() + n);
+        h.clear();
+        if (soft.per_body and bodies.has_softening()) {
+            h.resize(n);
+            for (size_t i = 0; i < n; ++i) { h[i] = bodies.get_softening(i); }
+        }
+    }
+
+    double length_of(size_t i, const softening_parameters &soft) const {
+        return h.empty() ? soft.length : h[i];
+    }
+
+public:
+    //
+    //  Forces on all bodies (forces[i] is the force on body i), with the softening of
+    //  the tree (bh_tree::get_softening)
+    //
+    void compute_forces(const body_store &bodies, const softening_parameters &soft, std::vector<point> &forces,
+                        task_pool &pool = default_pool()) {
+        const size_t n = bodies.size();
+        load(bodies, soft);
+        forces.assign(n, point(0, 0));
+        if (n == 0) {
+            return;
+        }
+
+        const uint32_t tiles = (uint32_t) ((n + direct_tile - 1) / direct_tile);
+        tile_pairs.clear();
+        for (uint32_t a = 0; a < tiles; ++a) {
+            for (uint32_t b = a; b < tiles; ++b) { tile_pairs.push_back(std::make_pair(a, b)); }
+        }
+        const size_t pairs = tile_pairs.size();
+        const size_t groups = std::min(direct_groups, pairs);
+        if (sum_x.size() < groups) {
+            sum_x.resize(groups);
+            sum_y.resize(groups);
+        }
+
+        const mutual_kernel kernel = active_mutual_kernel(soft.kernel);
+        const double *lengths = h.empty() ? nullptr : h.data();
+        pool.run(groups, 1, [&](size_t begin, size_t end, unsigned) {
+            for (size_t g = begin; g < end; ++g) {
+                std::vector<double> &ax = sum_x[g], &ay = sum_y[g];
+                ax.assign(n, 0.0);
+                ay.assign(n, 0.0);
+                for (size_t k = pairs * g / groups; k < pairs * (g + 1) / groups; ++k) {
+                    const size_t a_first = (size_t) tile_pairs[k].first * direct_tile;
+                    const size_t a_end = std::min(n, a_first + direct_tile);
+                    const size_t b_first = (size_t) tile_pairs[k].second * direct_tile;
+                    const size_t b_end = std::min(n, b_first + direct_tile);
+                    for (size_t i = a_first; i < a_end; ++i) {
+                        const size_t first = a_first == b_first ? i + 1 : b_first;
+                        if (first >= b_end) {
+                            continue;
+                        }
+                        kernel(x[i], y[i], m[i], length_of(i, soft), &x[first], &y[first], &m[first],
+                               lengths != nullptr ? lengths + first : nullptr, b_end - first,
+                               ax[i], ay[i], &ax[first], &ay[first]);
+                    }
+                }
+            }
+        });
+
+        pool.run(n, 4096, [&](size_t begin, size_t end, unsigned) {
+            for (size_t g = 0; g < groups; ++g) {
+                for (size_t i = begin; i < end; ++i) {
+                    forces[i].x += sum_x[g][i];
+                    forces[i].y += sum_y[g][i];
+                }
+            }
+            for (size_t i = begin; i < end; ++i) { forces[i] *= gravity_G * m[i]; }
+        });
+    }
+
+    //
+    //  Forces on the bodies in active only (forces[i] for every i in active, the other
+    //  forces are left as they are), for block time steps (see integrator.h)
+    //
+    //  Only the active bodies get a force, so there is no third law to use here, every
+    //  active body runs the interaction kernel over all bodies.
+    //
+    void compute_forces(const body_store &bodies, const softening_parameters &soft,
+                        const std::vector<uint32_t> &active, std::vector<point> &forces,
+                        task_pool &pool = default_pool()) {
+        const size_t n = bodies.size();
+        load(bodies, soft);
+        forces.resize(n, point(0, 0));
+
+        const interaction_kernel kernel = active_kernel(soft.kernel);
+        const double *lengths = h.empty() ? nullptr : h.data();
+        pool.run(active.size(), 16, [&](size_t begin, size_t end, unsigned) {
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t i = active[k];
+                double ax = 0.0, ay = 0.0;
+                kernel(x[i], y[i], length_of(i, soft), x.data(), y.data(), m.data(), lengths, n, ax, ay);
+                forces[i] = point(ax, ay) * (gravity_G * m[i]);
+            }
+        });
+    }
+};
+
+//
+//  Solver shared by the compute_forces functions (forces.h), like default_pool
+//
+inline direct_solver &default_direct_solver() {
+    static direct_solver solver;
+    return solver;
+}
+
+#endif //TREE_CODE_DIRECT_H
@@ -0,0 +1,294 @@
+//
+// Created on 10/17/26.
+//
+//  Forces on the bodies with the solver of choice, and the Euler update
+//
+//  These used to live in nbody_cinder.h with the Cinder conversions, they only need
+//  the nbody headers so the simulation (simulation.h) and the tools can use them
+//  without Cinder.
+//
+
+#ifndef TREE_CODE_FORCES_H
+#define TREE_CODE_FORCES_H
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "bh_tree.h"
+#include "bounds.h"
+#include "direct.h"
+#include "fmm.h"
+#include "integrator.h"
+#include "timers.h"
+
+//
+// todo: figure out how to remove bodies, following code isn't working
+//
+inline void pluck_outside_bodies(body_store &bodies, const region &r) {
+    // removing a body moves the last body in its place, so walk backwards
+    for (size_t i = bodies.size(); i-- > 0; ) {
+        if (!r.is_in(bodies.get_position(i))) {
+            std::cout << "something needs to be removed" << std::endl;
+            bodies.remove(i);
+        }
+    }
+}
+
+//
+//  How the tree is handled between steps
+//
+//    REBUILD    : build the tree from scratch every step
+//    PERSISTENT : keep the tree, refit it to the new positions and only rebuild it
+//                 when it has degraded (see bh_tree::refit_or_build)
+//
+enum TreeMode { REBUILD, PERSISTENT };
+
+//
+//  Which solver computes the forces from the tree
+//
+//    BARNES_HUT : every body walks the tree (bh_tree::compute_force)
+//    GROUP_WALK : one walk per group of nearby bodies (bh_tree::compute_group_forces)
+//    FMM        : fast multipole method on the same tree (fmm.h), works best with
+//                 larger leaves (leaf_capacity around 32)
+//    DIRECT     : every pair of bodies (direct.h), no tree
+//
+//  Below direct_crossover bodies the tree solvers use the direct sum as well, it is
+//  faster there and exact.
+//
+enum Solver { BARNES_HUT, GROUP_WALK, FMM, DIRECT };
+
+inline bool use_direct(const body_store &bodies, Solver solver) {
+    return solver == Solver::DIRECT or bodies.size() < direct_crossover;
+}
+
+//
+//  Put the bodies in the tree, and compute the masses and centers of mass of the nodes
+//
+inline void prepare_tree(body_store &bodies, const region r, bh_tree &tree, TreeMode mode,
+                         task_pool &pool = default_pool()) {
+    // todo: uncomment code below once code to remove bodies is fixed
+    //pluck_outside_bodies(bodies, tree.get_global_region());
+
+    //
+    //  Put bodies in the tree (all at once, see bh_tree::build)
+    //
+    {
+        scoped_timer timer(Phase::TREE_BUILD);
+        if (mode == TreeMode::PERSISTENT and tree.get_global_region() == r) {
+            tree.refit_or_build(bodies, pool);
+        } else {
+            tree.set_region(r);
+            tree.build(bodies, pool);
+        }
+    }
+    //
+    // Update the tree so that all Conglomerate nodes will have the
+    //   proper mass and position (based on center of gravity)
+    //   this is much faster if we do it once all bodies are in place
+    //
+    scoped_timer timer(Phase::MOMENTS);
+    tree.update();
+}
+
+//
+//  Region fitted to the bodies (see fit_region in bounds.h)
+//
+//  A persistent tree keeps its region as long as the bodies still fit in it, changing
+//  the region means building the tree again.
+//
+inline region fitted_region(const body_store &bodies, const bh_tree &tree, TreeMode mode, const region_policy &policy,
+                            task_pool &pool = default_pool()) {
+    scoped_timer timer(Phase::TREE_BUILD);
+    region r = fit_region(bodies, policy, pool);
+    if (mode == TreeMode::PERSISTENT and !tree.is_empty() and region_still_fits(tree.get_global_region(), r)) {
+        r = tree.get_global_region();
+    }
+    return r;
+}
+
+//
+//  Interaction counts column of the store, nullptr when it is off (see
+//  body_store::count_interactions)
+//
+inline interaction_counts *interactions_of(body_store &bodies) {
+    return bodies.has_interaction_counts() ? bodies.interactions() : nullptr;
+}
+
+//
+//  The direct sum does the same work for every body: n - 1 body interactions (only the
+//  active bodies, if active is given)
+//
+inline void count_direct(body_store &bodies, const std::vector<uint32_t> *active, walk_counts *totals) {
+    const uint32_t others = bodies.empty() ? 0 : (uint32_t) bodies.size() - 1;
+    const size_t targets = active != nullptr ? active->size() : bodies.size();
+    if (totals != nullptr) { totals->bodies((uint64_t) targets * others); }
+    interaction_counts *per_body = interactions_of(bodies);
+    if (per_body == nullptr) {
+        return;
+    }
+    for (size_t k = 0; k < targets; ++k) {
+        per_body[active != nullptr ? (*active)[k] : k] = interaction_counts{ 0, 0, others };
+    }
+}
+
+//
+//  The FMM only counts its work in total (m2l and p2p, see fmm_solver)
+//
+inline void count_fmm(const fmm_solver &fmm, walk_counts *totals) {
+    if (totals != nullptr) {
+        totals->node(fmm.get_m2l_count());
+        totals->bodies(fmm.get_p2p_count());
+    }
+}
+
+//
+//  Compute forces for each body in the body vector
+//
+//  The tree is passed in so the caller can keep it alive between steps, this way the
+//  node pool is reused and building the tree does not allocate.
+//
+//  With totals, the work of the walks is added to it (see walk_counts). When the store
+//  counts interactions, every walk also stores its own counts there.
+//
+inline std::vector<point> compute_forces(body_store &bodies, const region r, bh_tree &tree,
+                                         TreeMode mode = TreeMode::REBUILD, walk_counts *totals = nullptr){
+    //
+    // Compute vector of forces for each body (on all threads of default_pool)
+    //
+    std::vector<point> forces;
+    if (use_direct(bodies, Solver::BARNES_HUT)) {
+        // with the softening of the tree, the tree itself is left alone
+        scoped_timer timer(Phase::FORCES);
+        default_direct_solver().compute_forces(bodies, tree.get_softening(), forces);
+        count_direct(bodies, nullptr, totals);
+        return forces;
+    }
+
+    prepare_tree(bodies, r, tree, mode);
+    scoped_timer timer(Phase::FORCES);
+    tree.compute_forces(bodies, forces, default_pool(), totals, interactions_of(bodies));
+
+    return forces;
+}
+inline std::vector<point> compute_forces(body_store &bodies, const region r){
+    bh_tree tree(r);
+    return compute_forces(bodies, r, tree);
+}
+
+//
+//  Same as above, with the region fitted to the bodies
+//
+inline std::vector<point> compute_forces(body_store &bodies, bh_tree &tree,
+                                         TreeMode mode = TreeMode::REBUILD,
+                                         const region_policy &policy = region_policy(),
+                                         walk_counts *totals = nullptr) {
+    return compute_forces(bodies, fitted_region(bodies, tree, mode, policy), tree, mode, totals);
+}
+
+//
+//  Same as above, with the solver chosen by the caller
+//
+//  The fmm_solver is kept by the caller like the tree, it holds the expansions and
+//  its settings (order, opening angle).
+//
+inline std::vector<point> compute_forces(body_store &bodies, bh_tree &tree, fmm_solver &fmm, Solver solver,
+                                         TreeMode mode = TreeMode::REBUILD,
+                                         const region_policy &policy = region_policy(),
+                                         walk_counts *totals = nullptr) {
+    std::vector<point> forces;
+    if (use_direct(bodies, solver)) {
+        scoped_timer timer(Phase::FORCES);
+        default_direct_solver().compute_forces(bodies, tree.get_softening(), forces);
+        count_direct(bodies, nullptr, totals);
+        return forces;
+    }
+    if (solver == Solver::BARNES_HUT) {
+        return compute_forces(bodies, tree, mode, policy, totals);
+    }
+    prepare_tree(bodies, fitted_region(bodies, tree, mode, policy), tree, mode);
+    scoped_timer timer(Phase::FORCES);
+    if (solver == Solver::GROUP_WALK) {
+        tree.compute_group_forces(bodies, forces, 32, default_pool(), totals, interactions_of(bodies));
+    } else {
+        fmm.compute_forces(tree, bodies, forces);
+        count_fmm(fmm, totals);
+    }
+    return forces;
+}
+
+//
+//  Forces on the active bodies only (forces[i] for i in active), the force function of
+//  block time steps (see integrator::block_step)
+//
+//  All bodies moved a little since the last substep but only a few need a force, so
+//  the tree is refit instead of built (unless the rebuild policy asks for a new tree).
+//  When every body is active this is compute_forces with the caller's tree mode. The
+//  FMM has no per body walk, it computes all forces.
+//
+inline void compute_active_forces(body_store &bodies, const std::vector<uint32_t> &active, std::vector<point> &forces,
+                                  bh_tree &tree, fmm_solver &fmm, Solver solver,
+                                  TreeMode mode = TreeMode::PERSISTENT,
+                                  const region_policy &policy = region_policy(),
+                                  walk_counts *totals = nullptr) {
+    if (active.size() == bodies.size()) {
+        forces = compute_forces(bodies, tree, fmm, solver, mode, policy, totals);
+        return;
+    }
+    if (use_direct(bodies, solver)) {
+        scoped_timer timer(Phase::FORCES);
+        default_direct_solver().compute_forces(bodies, tree.get_softening(), active, forces);
+        count_direct(bodies, &active, totals);
+        return;
+    }
+    const TreeMode refit = TreeMode::PERSISTENT;
+    prepare_tree(bodies, fitted_region(bodies, tree, refit, policy), tree, refit);
+    scoped_timer timer(Phase::FORCES);
+    if (solver == Solver::FMM) {
+        fmm.compute_forces(tree, bodies, forces);
+        count_fmm(fmm, totals);
+    } else {
+        tree.compute_forces(bodies, active, forces, default_pool(), totals, interactions_of(bodies));
+    }
+}
+
+
+//
+//  Move the bodies (same update as body::update_based_on_force_dt), one pass over
+//  the columns of the store, split over the threads of the pool
+//
+//  This is one EULER step with forces computed by the caller, integrator (integrator.h)
+//  takes the forces from a force function and also has the leapfrog schemes.
+//
+inline void update_bodies_with_forces(body_store &bodies, const std::vector<point> &forces,
+                                      double dt = default_time_step, task_pool &pool = default_pool()) {
+    if (bodies.size() != forces.size()) {
+        std::cout << "error in updating bodies with forces, sizes don't match" << std::endl;
+        return;
+    }
+    scoped_timer timer(Phase::INTEGRATE);
+    const size_t n = bodies.size();
+    double *x = bodies.x(), *y = bodies.y();
+    double *vx = bodies.vx(), *vy = bodies.vy();
+    const double *mass = bodies.mass();
+    double *last_x = bodies.has_last_position() ? bodies.last_x() : nullptr;
+    double *last_y = bodies.has_last_position() ? bodies.last_y() : nullptr;
+    pool.run(n, 16384, [&](size_t begin, size_t end, unsigned) {
+        if (last_x != nullptr) {
+            std::copy(x + begin, x + end, last_x + begin);
+            std::copy(y + begin, y + end, last_y + begin);
+        }
+        for (size_t i = begin; i < end; ++i) {
+            // F = ma  --> F/m = a
+            vx[i] += forces[i].x / mass[i] * dt;
+            vy[i] += forces[i].y / mass[i] * dt;
+            x[i] += vx[i] * dt;
+            y[i] += vy[i] * dt;
+        }
+    });
+}
+
+
+//
+
+#endif //TREE_CODE_FORCES_H
@@ -0,0 +1,316 @@
+//
+// Created on 10/17/26.
+//
+//  Time integration of the bodies
+//
+//  A step moves the bodies forward by dt with the forces of a force function, which is
+//  called as compute(bodies, forces) and fills forces (one per body) for the current
+//  positions, for example
+//
+//      stepper.step(bodies, [&](body_store &b, std::vector<point> &f) {
+//          f = compute_forces(b, tree, fmm, solver, tree_mode);
+//      });
+//
+//  The schemes
+//
+//    EULER    : semi-implicit Euler (kick dt, then drift dt), what the app used to do.
+//               First order, the energy of an orbit drifts away step after step.
+//    LEAPFROG : kick-drift-kick. Second order and symplectic: the energy error stays
+//               bounded instead of growing, so much larger steps keep galaxies bound.
+//               The forces at the end of a step are the forces at the start of the
+//               next one, so it costs one force evaluation per step, the same as EULER.
+//    YOSHIDA  : three leapfrog steps of w1 dt, w0 dt, w1 dt (w0 < 0), fourth order.
+//               Three force evaluations per step, worth it when accuracy matters more
+//               than speed.
+//
+//  Block time steps (integrator_parameters::block_steps, see block_step) let every
+//  body take the leapfrog step it needs instead of the step of the fastest body.
+//
+
+#ifndef TREE_CODE_INTEGRATOR_H
+#define TREE_CODE_INTEGRATOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bh_tree_node.h"
+#include "body_store.h"
+#include "parallel.h"
+#include "point.h"
+#include "timers.h"
+
+//
+//  Time step the app has always used
+//
+const double default_time_step = 1.0e4;
+
+enum Integrator { EULER, LEAPFROG, YOSHIDA };
+
+//
+//  scheme, dt : see above, dt is the longest step with block time steps
+//
+//  Block time steps (LEAPFROG only)
+//    block_steps : give every body its own step dt / 2^rung
+//    max_rung    : the shortest step is dt / 2^max_rung (at most 30)
+//    eta, length : the step of a body is at most sqrt(2 eta length / |a|), length is
+//                  the softening length (the softening column of the store, if any)
+//
+struct integrator_parameters {
+    Integrator scheme = Integrator::LEAPFROG;
+    double dt = default_time_step;
+
+    bool block_steps = false;
+    int max_rung = 10;
+    double eta = 0.005;
+    double length = gravity_epsilon;
+};
+
+//
+//  v += F/m dt  and  x += v dt  over the columns of the store, split over the pool
+//
+inline void kick(body_store &bodies, const std::vector<point> &forces, double dt,
+                 task_pool &pool = default_pool()) {
+    scoped_timer timer(Phase::INTEGRATE);
+    double *vx = bodies.vx(), *vy = bodies.vy();
+    const double *mass = bodies.mass();
+    pool.run(bodies.size(), 16384, [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            // F = ma  --> F/m = a
+            vx[i] += forces[i].x / mass[i] * dt;
+            vy[i] += forces[i].y / mass[i] * dt;
+        }
+    });
+}
+
+inline void drift(body_store &bodies, double dt, task_pool &pool = default_pool()) {
+    scoped_timer timer(Phase::INTEGRATE);
+    double *x = bodies.x(), *y = bodies.y();
+    const double *vx = bodies.vx(), *vy = bodies.vy();
+    pool.run(bodies.size(), 16384, [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            x[i] += vx[i] * dt;
+            y[i] += vy[i] * dt;
+        }
+    });
+}
+
+//
+//  Keeps the forces of the last evaluation, so a leapfrog step can start from them
+//
+//  The forces are only reused while they belong to the current positions. They are
+//  dropped when the number of bodies changes, and reset() has to be called when the
+//  bodies are changed some other way (replaced by a new set of the same size, moved
+//  by hand, ...)
+//
+class integrator {
+protected:
+    integrator_parameters params;
+
+    std::vector<point> forces;
+    bool forces_current;
+    size_t evaluations;   // force evaluations since the integrator was created
+    size_t body_forces;   // forces of single bodies computed by them
+
+    //  Block time steps: the rung of every body, and the bodies that need a force
+    std::vector<uint8_t> rungs;
+    std::vector<uint32_t> active;
+
+    template <typename ForceFunction>
+    void evaluate(body_store &bodies, ForceFunction &compute) {
+        compute(bodies, forces);
+        forces_current = true;
+        ++evaluations;
+        body_forces += bodies.size();
+    }
+
+    //  with block steps the force function only computes the forces of the active bodies
+    template <typename ActiveForceFunction>
+    void evaluate_active(body_store &bodies, ActiveForceFunction &compute) {
+        compute(bodies, (const std::vector<uint32_t> &) active, forces);
+        ++evaluations;
+        body_forces += active.size();
+    }
+
+    void all_active(size_t n) {
+        active.resize(n);
+        for (size_t i = 0; i < n; ++i) { active[i] = (uint32_t) i; }
+    }
+
+    //  smallest rung whose step is short enough for body i (from its current force)
+    int wanted_rung(const body_store &bodies, size_t i, int max_rung) const {
+        const double a = forces[i].length() / bodies.get_mass(i);
+        if (!(a > 0.0)) {
+            return 0;
+        }
+        const double length = bodies.has_softening() ? bodies.get_softening(i) : params.length;
+        const double step = std::sqrt(2.0 * params.eta * length / a);
+        if (step >= params.dt) {
+            return 0;
+        }
+        const int rung = (int) std::ceil(std::log2(params.dt / step));
+        return std::min(rung, max_rung);
+    }
+
+    //  v += F/m step/2 for body i, with the step of its rung
+    void half_kick(body_store &bodies, size_t i, int rung) {
+        const double h = 0.5 * std::ldexp(params.dt, -rung) / bodies.get_mass(i);
+        bodies.vx()[i] += forces[i].x * h;
+        bodies.vy()[i] += forces[i].y * h;
+    }
+
+    //  kick dt/2, drift dt, kick dt/2, starting from forces at the current positions
+    template <typename ForceFunction>
+    void leapfrog(body_store &bodies, double dt, ForceFunction &compute, task_pool &pool) {
+        if (!forces_current or forces.size() != bodies.size()) {
+            evaluate(bodies, compute);
+        }
+        kick(bodies, forces, 0.5 * dt, pool);
+        drift(bodies, dt, pool);
+        evaluate(bodies, compute);
+        kick(bodies, forces, 0.5 * dt, pool);
+    }
+
+public:
+    explicit integrator(const integrator_parameters &p = integrator_parameters())
+            : params(p), forces_current(false), evaluations(0), body_forces(0) {}
+
+    const integrator_parameters &get_parameters() const { return params; }
+    void set_parameters(const integrator_parameters &p) { params = p; }
+
+    //  the bodies changed outside of step(), the forces have to be computed again
+    void reset() { forces_current = false; }
+
+    //  forces of the last evaluation (at the current positions after a LEAPFROG step)
+    const std::vector<point> &get_forces() const { return forces; }
+    bool has_current_forces() const { return forces_current; }
+
+    //
+    //  Forces saved from an earlier run (see snapshot.h), current when they belong to
+    //  the positions of the bodies, so the next step starts from them like the step
+    //  after the one that computed them
+    //
+    void set_forces(const std::vector<point> &f, bool current) {
+        forces = f;
+        forces_current = current;
+    }
+    size_t get_force_evaluations() const { return evaluations; }
+    size_t get_body_forces() const { return body_forces; }
+    //  rung of every body in the last block step (empty without block steps)
+    const std::vector<uint8_t> &get_rungs() const { return rungs; }
+
+    //
+    //  Move the bodies forward by dt
+    //
+    template <typename ForceFunction>
+    void step(body_store &bodies, ForceFunction compute, task_pool &pool = default_pool()) {
+        if (bodies.has_last_position()) {
+            std::copy(bodies.x(), bodies.x() + bodies.size(), bodies.last_x());
+            std::copy(bodies.y(), bodies.y() + bodies.size(), bodies.last_y());
+        }
+
+        const double dt = params.dt;
+        if (params.scheme == Integrator::EULER) {
+            evaluate(bodies, compute);
+            kick(bodies, forces, dt, pool);
+            drift(bodies, dt, pool);
+            forces_current = false;
+        } else if (params.scheme == Integrator::LEAPFROG) {
+            leapfrog(bodies, dt, compute, pool);
+        } else {
+            const double cbrt_2 = std::cbrt(2.0);
+            const double w1 = 1.0 / (2.0 - cbrt_2);
+            const double w0 = -cbrt_2 * w1;
+            leapfrog(bodies, w1 * dt, compute, pool);
+            leapfrog(bodies, w0 * dt, compute, pool);
+            leapfrog(bodies, w1 * dt, compute, pool);
+        }
+    }
+
+    //
+    //  Move the bodies forward by dt, with a force function that is called as
+    //  compute(bodies, active, forces) and only has to fill in forces[i] for the bodies
+    //  i in active (for example bh_tree::compute_forces on a refit tree)
+    //
+    //  Without block_steps this is step() with every body active. With block_steps,
+    //  body i moves in leapfrog steps of dt / 2^rung_i, the rung chosen from its force
+    //  (see integrator_parameters). Time is counted in ticks of dt / 2^max_rung: all
+    //  bodies drift to the next tick where some step ends, the bodies whose step ends
+    //  there get a new force, the closing half kick, a new rung and the opening half
+    //  kick of their next step. A body can only move to a longer step where that step
+    //  would start, so at the end of dt all bodies are in step again.
+    //
+    //  Most of the bodies of a galaxy are on slow orbits in the disk, so they only need
+    //  a force once or twice per dt while the bodies close to the center take many
+    //  short steps.
+    //
+    template <typename ActiveForceFunction>
+    void block_step(body_store &bodies, ActiveForceFunction compute, task_pool &pool = default_pool()) {
+        if (!params.block_steps or params.scheme != Integrator::LEAPFROG) {
+            rungs.clear();
+            step(bodies, [&](body_store &b, std::vector<point> &f) {
+                all_active(b.size());
+                compute(b, (const std::vector<uint32_t> &) active, f);
+            }, pool);
+            return;
+        }
+
+        const size_t n = bodies.size();
+        if (bodies.has_last_position()) {
+            std::copy(bodies.x(), bodies.x() + n, bodies.last_x());
+            std::copy(bodies.y(), bodies.y() + n, bodies.last_y());
+        }
+        if (!forces_current or forces.size() != n) {
+            forces.assign(n, point(0, 0));
+            all_active(n);
+            evaluate_active(bodies, compute);
+        }
+
+        //  everybody starts a step
+        const int max_rung = std::max(0, std::min(params.max_rung, 30));
+        const uint32_t ticks = 1u << max_rung;
+        rungs.resize(n);
+        int deepest = 0;
+        {
+            scoped_timer timer(Phase::INTEGRATE);
+            for (size_t i = 0; i < n; ++i) {
+                const int rung = wanted_rung(bodies, i, max_rung);
+                rungs[i] = (uint8_t) rung;
+                deepest = std::max(deepest, rung);
+                half_kick(bodies, i, rung);
+            }
+        }
+
+        uint32_t t = 0;
+        while (t < ticks) {
+            const uint32_t stride = ticks >> deepest;
+            const uint32_t next = (t / stride + 1) * stride;
+            drift(bodies, std::ldexp(params.dt, -max_rung) * (next - t), pool);
+            t = next;
+
+            active.clear();
+            for (size_t i = 0; i < n; ++i) {
+                if (t % (ticks >> rungs[i]) == 0) { active.push_back((uint32_t) i); }
+            }
+            evaluate_active(bodies, compute);
+
+            scoped_timer timer(Phase::INTEGRATE);
+            for (uint32_t i : active) {
+                half_kick(bodies, i, rungs[i]);
+                if (t == ticks) {
+                    continue;
+                }
+                //  longer steps have to start on one of their own ticks
+                int rung = wanted_rung(bodies, i, max_rung);
+                while (t % (ticks >> rung) != 0) { ++rung; }
+                rungs[i] = (uint8_t) rung;
+                half_kick(bodies, i, rung);
+            }
+            deepest = 0;
+            for (size_t i = 0; i < n; ++i) { deepest = std::max(deepest, (int) rungs[i]); }
+        }
+        forces_current = true;
+    }
+};
+
+#endif //TREE_CODE_INTEGRATOR_H
@@ -0,0 +1,869 @@
+//
+// Created on 10/17/26.
+//
+//  Particle-particle interaction kernel
+//
+//  Once the walk knows which nodes and bodies act on a body, the force is a plain sum
+//  over a list of sources. This file has one version of that sum for each instruction
+//  set, and picks the best one the CPU supports the first time it is used.
+//
+//    SCALAR : plain C++, used on every other CPU and for the left over sources
+//    SSE2   : 2 sources at a time
+//    AVX2   : 4 sources at a time, with FMA
+//    AVX512 : 8 sources at a time
+//
+//  The SIMD versions get 1/d from an approximate reciprocal square root, refined with
+//  Newton steps. SSE2 and AVX2 only have a single precision rsqrt, so they go through
+//  float: squared distances have to stay below ~1e38 (distances below ~1e19).
+//
+//  Every version comes in one variant per softening (see Softening below), chosen
+//  with the instruction set.
+//
+//  The quadrupole terms of the tree nodes (see walk_parameters in bh_tree.h) have a
+//  kernel of their own, scalar or AVX2, also one variant per softening.
+//
+//  The direct sum (direct.h) uses a mutual kernel, which also adds the opposite
+//  force to every source: scalar, AVX2 or AVX512 (SSE2 CPUs use the scalar one).
+//
+//  The variant can be forced with the environment variable NBODY_KERNEL
+//  (scalar, sse2, avx2 or avx512), to compare them.
+//
+
+#ifndef TREE_CODE_KERNEL_H
+#define TREE_CODE_KERNEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NBODY_KERNEL_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+//  GCC and Clang need to be told that a function may use instructions beyond the
+//  ones the file is compiled for, MSVC does not
+#if defined(__GNUC__)
+#define NBODY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define NBODY_TARGET(isa)
+#endif
+
+enum KernelIsa { SCALAR, SSE2, AVX2, AVX512 };
+
+//
+//  How the force between two bodies is softened at short distances
+//
+//    CUTOFF  : no force closer than h, 1/d^2 further away (the force jumps from 0 to
+//              its largest value at d = h)
+//    PLUMMER : m / (d^2 + h^2)^(3/2), smooth everywhere, but never exactly Newtonian
+//    SPLINE  : the cubic spline kernel (Monaghan & Lattanzio) with support
+//              spline_support * h: exactly Newtonian beyond it, smooth and bounded
+//              inside. With the factor 2.8 the potential at d = 0 is the one of
+//              PLUMMER with the same h.
+//
+//  h of a pair is the larger of the two softening lengths.
+//
+enum Softening { CUTOFF, PLUMMER, SPLINE };
+
+const double spline_support = 2.8;
+
+//
+//  1/d^3 softened, the force of a source of mass m at d (the vector) is m d * this
+//
+template <Softening S>
+inline double softened_inverse_cube(double d_2, double h) {
+    if (S == Softening::CUTOFF) {
+        return d_2 < h * h ? 0.0 : 1.0 / (d_2 * std::sqrt(d_2));
+    }
+    if (S == Softening::PLUMMER) {
+        const double r_2 = d_2 + h * h;
+        return 1.0 / (r_2 * std::sqrt(r_2));
+    }
+    const double d = std::sqrt(d_2), support = spline_support * h;
+    if (!(d < support)) {
+        return 1.0 / (d_2 * d);
+    }
+    const double u = d / support, h_3 = 1.0 / (support * support * support);
+    if (u < 0.5) {
+        return h_3 * (32.0 / 3.0 + u * u * (32.0 * u - 38.4));
+    }
+    return h_3 * (64.0 / 3.0 - 48.0 * u + 38.4 * u * u - 32.0 / 3.0 * u * u * u) - 1.0 / 15.0 / (d_2 * d);
+}
+inline double softened_inverse_cube(Softening softening, double d_2, double h) {
+    switch (softening) {
+        case Softening::CUTOFF: return softened_inverse_cube<Softening::CUTOFF>(d_2, h);
+        case Softening::PLUMMER: return softened_inverse_cube<Softening::PLUMMER>(d_2, h);
+        default: return softened_inverse_cube<Softening::SPLINE>(d_2, h);
+    }
+}
+
+//
+//  Sum over the sources j of
+//      m_j * (s_j - t) / |s_j - t|^3   (softened)
+//  for the target t = (tx, ty) with softening length th. sh holds the softening
+//  length of every source, or is nullptr when they all have th. Sources on top of the
+//  target are skipped. The sums are added to ax and ay. Multiply by G and the mass of
+//  the target for the force.
+//
+typedef void (*interaction_kernel)(double tx, double ty, double th,
+                                   const double *sx, const double *sy, const double *sm, const double *sh,
+                                   size_t n, double &ax, double &ay);
+
+//
+//  Quadrupole terms of n nodes at (cx_j, cy_j), with moments (qxx_j, qxy_j, qyy_j)
+//  about those points (see struct quadrupole in bh_tree_node.h), added to ax and ay
+//  like the kernel above. th, ch are the softening lengths of the target and of the
+//  nodes (ch nullptr when they all have th), the same as for the masses of the nodes.
+//
+//  These are the third derivatives of the softened potential at r = t - c_j (see
+//  softened_quadrupole_factors), contracted with q_j, so the quadrupole corrects the
+//  softened monopole it is added to. The walks open nodes within the reach of the
+//  softening, but a node beyond it still has bodies inside: PLUMMER is softened at
+//  every distance.
+//
+typedef void (*quadrupole_kernel)(double tx, double ty, double th, const double *cx, const double *cy,
+                                  const double *ch, const double *qxx, const double *qxy, const double *qyy,
+                                  size_t n, double &ax, double &ay);
+
+//
+//  Mutual version of the interaction kernel, for pairs that are only visited once:
+//  adds the sum for the target (mass tm) to ax and ay like the kernel above, and
+//      tm * (t - s_j) / |s_j - t|^3   (softened)
+//  to sax[j] and say[j] for every source (Newton's third law).
+//
+typedef void (*mutual_kernel)(double tx, double ty, double tm, double th,
+                              const double *sx, const double *sy, const double *sm, const double *sh,
+                              size_t n, double &ax, double &ay, double *sax, double *say);
+
+template <Softening S>
+inline void interact_scalar(double tx, double ty, double th,
+                            const double *sx, const double *sy, const double *sm, const double *sh,
+                            size_t n, double &ax, double &ay) {
+    double fx = 0.0, fy = 0.0;
+    for (size_t j = 0; j < n; ++j) {
+        double dx = sx[j] - tx;
+        double dy = sy[j] - ty;
+        double d_2 = dx*dx + dy*dy;
+        if (d_2 == 0.0) {
+            continue; // the body itself
+        }
+        double h = sh != nullptr ? std::max(th, sh[j]) : th;
+        double w = sm[j] * softened_inverse_cube<S>(d_2, h);
+        fx += w * dx;
+        fy += w * dy;
+    }
+    ax += fx;
+    ay += fy;
+}
+
+template <Softening S>
+inline void mutual_scalar(double tx, double ty, double tm, double th,
+                          const double *sx, const double *sy, const double *sm, const double *sh,
+                          size_t n, double &ax, double &ay, double *sax, double *say) {
+    double fx = 0.0, fy = 0.0;
+    for (size_t j = 0; j < n; ++j) {
+        double dx = sx[j] - tx;
+        double dy = sy[j] - ty;
+        double d_2 = dx*dx + dy*dy;
+        if (d_2 == 0.0) {
+            continue;
+        }
+        double h = sh != nullptr ? std::max(th, sh[j]) : th;
+        double w = softened_inverse_cube<S>(d_2, h);
+        fx += sm[j] * w * dx;
+        fy += sm[j] * w * dy;
+        sax[j] -= tm * w * dx;
+        say[j] -= tm * w * dy;
+    }
+    ax += fx;
+    ay += fy;
+}
+
+//
+//  Radial factors of the third derivatives of the softened potential
+//
+//  The pull of a source is m d w(r) with w = softened_inverse_cube. With D1 = -w,
+//  D2 = D1'(r) / r and D3 = D2'(r) / r the third derivatives are
+//      d_ijk = (x_i delta_jk + x_j delta_ik + x_k delta_ij) D2 + x_i x_j x_k D3
+//  Unsoftened D2 = 3/r^5 and D3 = -15/r^7. PLUMMER is the same with r^2 + h^2, SPLINE
+//  has the derivatives of its polynomials inside the support, and CUTOFF has no pull
+//  inside h. d2, d3 are zero for d_2 == 0.
+//
+template <Softening S>
+inline void softened_quadrupole_factors(double d_2, double h, double &d2, double &d3) {
+    if (S == Softening::PLUMMER) {
+        const double r_i2 = 1.0 / (d_2 + h * h);
+        d2 = 3.0 * r_i2 * r_i2 * std::sqrt(r_i2);
+        d3 = -5.0 * r_i2 * d2;
+        return;
+    }
+    const double support = S == Softening::SPLINE ? spline_support * h : h;
+    if (!(d_2 < support * support)) {
+        const double r_i2 = 1.0 / d_2;
+        d2 = 3.0 * r_i2 * r_i2 * std::sqrt(r_i2);
+        d3 = -5.0 * r_i2 * d2;
+        return;
+    }
+    if (S == Softening::CUTOFF or d_2 == 0.0) {
+        d2 = d3 = 0.0;
+        return;
+    }
+    const double d = std::sqrt(d_2), h_1 = 1.0 / support, u = d * h_1;
+    const double h_5 = h_1 * h_1 * h_1 * h_1 * h_1, h_7 = h_5 * h_1 * h_1;
+    if (u < 0.5) {
+        d2 = h_5 * (76.8 - 96.0 * u);
+        d3 = -96.0 * h_7 / u;
+        return;
+    }
+    d2 = h_5 * (48.0 / u - 76.8 + 32.0 * u) - 0.2 / (d_2 * d_2 * d);
+    d3 = h_7 * (32.0 / u - 48.0 / (u * u * u)) + 1.0 / (d_2 * d_2 * d_2 * d);
+}
+
+template <Softening S>
+inline void quadrupole_scalar(double tx, double ty, double th, const double *cx, const double *cy,
+                              const double *ch, const double *qxx, const double *qxy, const double *qyy,
+                              size_t n, double &ax, double &ay) {
+    double fx = 0.0, fy = 0.0;
+    for (size_t j = 0; j < n; ++j) {
+        const double x = tx - cx[j], y = ty - cy[j];
+        double d2, d3;
+        softened_quadrupole_factors<S>(x*x + y*y, ch != nullptr ? std::max(th, ch[j]) : th, d2, d3);
+        const double ux = d3 * x * x, uy = d3 * y * y;
+        const double xxx = x * (3.0 * d2 + ux);
+        const double xxy = y * (d2 + ux);
+        const double xyy = x * (d2 + uy);
+        const double yyy = y * (3.0 * d2 + uy);
+        fx += qxx[j]*xxx + qxy[j]*xxy + qyy[j]*xyy;
+        fy += qxx[j]*xxy + qxy[j]*xyy + qyy[j]*yyy;
+    }
+    ax += fx;
+    ay += fy;
+}
+
+#ifdef NBODY_KERNEL_X86
+
+//
+//  Softened 1/d^3 of 2 pairs, zero for d_2 == 0
+//
+//  12 bit estimate of 1/sqrt, three Newton steps: y = y * (1.5 - 0.5 * x * y * y)
+//
+template <Softening S>
+NBODY_TARGET("sse2")
+inline __m128d softened_inverse_cube_sse2(__m128d d_2, __m128d h) {
+    const __m128d half = _mm_set1_pd(0.5), three_halves = _mm_set1_pd(1.5);
+    const __m128d r_2 = S == Softening::PLUMMER ? _mm_add_pd(d_2, _mm_mul_pd(h, h)) : d_2;
+    __m128d y = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(r_2)));
+    __m128d hr = _mm_mul_pd(half, r_2);
+    y = _mm_mul_pd(y, _mm_sub_pd(three_halves, _mm_mul_pd(hr, _mm_mul_pd(y, y))));
+    y = _mm_mul_pd(y, _mm_sub_pd(three_halves, _mm_mul_pd(hr, _mm_mul_pd(y, y))));
+    y = _mm_mul_pd(y, _mm_sub_pd(three_halves, _mm_mul_pd(hr, _mm_mul_pd(y, y))));
+    __m128d w = _mm_mul_pd(y, _mm_mul_pd(y, y));
+    if (S == Softening::SPLINE) {
+        // no blend in SSE2, select with and / andnot / or
+        const __m128d support = _mm_mul_pd(_mm_set1_pd(spline_support), h);
+        const __m128d h_1 = _mm_div_pd(_mm_set1_pd(1.0), support);
+        const __m128d h_3 = _mm_mul_pd(h_1, _mm_mul_pd(h_1, h_1));
+        const __m128d u = _mm_mul_pd(_mm_mul_pd(d_2, y), h_1);
+        const __m128d u_2 = _mm_mul_pd(u, u);
+        __m128d inner = _mm_add_pd(_mm_set1_pd(32.0 / 3.0),
+                                   _mm_mul_pd(u_2, _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(32.0), u), _mm_set1_pd(38.4))));
+        __m128d middle = _mm_add_pd(_mm_set1_pd(64.0 / 3.0),
+                                    _mm_mul_pd(u, _mm_add_pd(_mm_set1_pd(-48.0),
+                                    _mm_mul_pd(u, _mm_sub_pd(_mm_set1_pd(38.4), _mm_mul_pd(_mm_set1_pd(32.0 / 3.0), u))))));
+        inner = _mm_mul_pd(h_3, inner);
+        middle = _mm_sub_pd(_mm_mul_pd(h_3, middle), _mm_mul_pd(_mm_set1_pd(1.0 / 15.0), w));
+        const __m128d in_inner = _mm_cmplt_pd(u, half);
+        const __m128d in_support = _mm_cmplt_pd(u, _mm_set1_pd(1.0));
+        const __m128d close = _mm_or_pd(_mm_and_pd(in_inner, inner), _mm_andnot_pd(in_inner, middle));
+        w = _mm_or_pd(_mm_and_pd(in_support, close), _mm_andnot_pd(in_support, w));
+    }
+    if (S == Softening::CUTOFF) {
+        return _mm_and_pd(w, _mm_cmpge_pd(d_2, _mm_mul_pd(h, h))); // also clears the NaN of d_2 == 0
+    }
+    return _mm_and_pd(w, _mm_cmpgt_pd(d_2, _mm_setzero_pd()));
+}
+
+template <Softening S>
+NBODY_TARGET("sse2")
+inline void interact_sse2(double tx, double ty, double th,
+                          const double *sx, const double *sy, const double *sm, const double *sh,
+                          size_t n, double &ax, double &ay) {
+    const __m128d vtx = _mm_set1_pd(tx), vty = _mm_set1_pd(ty), vth = _mm_set1_pd(th);
+    __m128d accx = _mm_setzero_pd(), accy = _mm_setzero_pd();
+    size_t j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(sx + j), vtx);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(sy + j), vty);
+        __m128d d_2 = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+        __m128d h = sh != nullptr ? _mm_max_pd(vth, _mm_loadu_pd(sh + j)) : vth;
+        __m128d w = _mm_mul_pd(_mm_loadu_pd(sm + j), softened_inverse_cube_sse2<S>(d_2, h));
+        accx = _mm_add_pd(accx, _mm_mul_pd(w, dx));
+        accy = _mm_add_pd(accy, _mm_mul_pd(w, dy));
+    }
+    double x[2], y[2];
+    _mm_storeu_pd(x, accx);
+    _mm_storeu_pd(y, accy);
+    ax += x[0] + x[1];
+    ay += y[0] + y[1];
+    interact_scalar<S>(tx, ty, th, sx + j, sy + j, sm + j, sh != nullptr ? sh + j : nullptr, n - j, ax, ay);
+}
+
+//
+//  Softened 1/d^3 of 4 pairs, zero for d_2 == 0
+//
+template <Softening S>
+NBODY_TARGET("avx2,fma")
+inline __m256d softened_inverse_cube_avx2(__m256d d_2, __m256d h) {
+    const __m256d half = _mm256_set1_pd(0.5), three_halves = _mm256_set1_pd(1.5);
+    const __m256d r_2 = S == Softening::PLUMMER ? _mm256_fmadd_pd(h, h, d_2) : d_2;
+    __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r_2)));
+    __m256d hr = _mm256_mul_pd(half, r_2);
+    y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(hr, y), y, three_halves));
+    y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(hr, y), y, three_halves));
+    y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(hr, y), y, three_halves));
+    __m256d w = _mm256_mul_pd(y, _mm256_mul_pd(y, y));
+    if (S == Softening::SPLINE) {
+        const __m256d support = _mm256_mul_pd(_mm256_set1_pd(spline_support), h);
+        const __m256d h_1 = _mm256_div_pd(_mm256_set1_pd(1.0), support);
+        const __m256d h_3 = _mm256_mul_pd(h_1, _mm256_mul_pd(h_1, h_1));
+        const __m256d u = _mm256_mul_pd(_mm256_mul_pd(d_2, y), h_1);
+        const __m256d u_2 = _mm256_mul_pd(u, u);
+        __m256d inner = _mm256_fmadd_pd(u_2, _mm256_fmsub_pd(_mm256_set1_pd(32.0), u, _mm256_set1_pd(38.4)),
+                                        _mm256_set1_pd(32.0 / 3.0));
+        __m256d middle = _mm256_fmadd_pd(u, _mm256_fmadd_pd(u, _mm256_fnmadd_pd(_mm256_set1_pd(32.0 / 3.0), u,
+                                         _mm256_set1_pd(38.4)), _mm256_set1_pd(-48.0)), _mm256_set1_pd(64.0 / 3.0));
+        inner = _mm256_mul_pd(h_3, inner);
+        middle = _mm256_fnmadd_pd(_mm256_set1_pd(1.0 / 15.0), w, _mm256_mul_pd(h_3, middle));
+        const __m256d close = _mm256_blendv_pd(middle, inner, _mm256_cmp_pd(u, half, _CMP_LT_OQ));
+        w = _mm256_blendv_pd(w, close, _mm256_cmp_pd(u, _mm256_set1_pd(1.0), _CMP_LT_OQ));
+    }
+    if (S == Softening::CUTOFF) {
+        return _mm256_and_pd(w, _mm256_cmp_pd(d_2, _mm256_mul_pd(h, h), _CMP_GE_OQ));
+    }
+    return _mm256_and_pd(w, _mm256_cmp_pd(d_2, _mm256_setzero_pd(), _CMP_GT_OQ));
+}
+
+template <Softening S>
+NBODY_TARGET("avx2,fma")
+inline void interact_avx2(double tx, double ty, double th,
+                          const double *sx, const double *sy, const double *sm, const double *sh,
+                          size_t n, double &ax, double &ay) {
+    const __m256d vtx = _mm256_set1_pd(tx), vty = _mm256_set1_pd(ty), vth = _mm256_set1_pd(th);
+    __m256d accx = _mm256_setzero_pd(), accy = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(sx + j), vtx);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(sy + j), vty);
+        __m256d d_2 = _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy));
+        __m256d h = sh != nullptr ? _mm256_max_pd(vth, _mm256_loadu_pd(sh + j)) : vth;
+        __m256d w = _mm256_mul_pd(_mm256_loadu_pd(sm + j), softened_inverse_cube_avx2<S>(d_2, h));
+        accx = _mm256_fmadd_pd(w, dx, accx);
+        accy = _mm256_fmadd_pd(w, dy, accy);
+    }
+    double x[4], y[4];
+    _mm256_storeu_pd(x, accx);
+    _mm256_storeu_pd(y, accy);
+    ax += (x[0] + x[1]) + (x[2] + x[3]);
+    ay += (y[0] + y[1]) + (y[2] + y[3]);
+    interact_scalar<S>(tx, ty, th, sx + j, sy + j, sm + j, sh != nullptr ? sh + j : nullptr, n - j, ax, ay);
+}
+
+template <Softening S>
+NBODY_TARGET("avx2,fma")
+inline void mutual_avx2(double tx, double ty, double tm, double th,
+                        const double *sx, const double *sy, const double *sm, const double *sh,
+                        size_t n, double &ax, double &ay, double *sax, double *say) {
+    const __m256d vtx = _mm256_set1_pd(tx), vty = _mm256_set1_pd(ty), vtm = _mm256_set1_pd(tm);
+    const __m256d vth = _mm256_set1_pd(th);
+    __m256d accx = _mm256_setzero_pd(), accy = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(sx + j), vtx);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(sy + j), vty);
+        __m256d d_2 = _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy));
+        __m256d h = sh != nullptr ? _mm256_max_pd(vth, _mm256_loadu_pd(sh + j)) : vth;
+        __m256d w = softened_inverse_cube_avx2<S>(d_2, h);
+        __m256d ws = _mm256_mul_pd(_mm256_loadu_pd(sm + j), w);
+        __m256d wt = _mm256_mul_pd(vtm, w);
+        accx = _mm256_fmadd_pd(ws, dx, accx);
+        accy = _mm256_fmadd_pd(ws, dy, accy);
+        _mm256_storeu_pd(sax + j, _mm256_fnmadd_pd(wt, dx, _mm256_loadu_pd(sax + j)));
+        _mm256_storeu_pd(say + j, _mm256_fnmadd_pd(wt, dy, _mm256_loadu_pd(say + j)));
+    }
+    double x[4], y[4];
+    _mm256_storeu_pd(x, accx);
+    _mm256_storeu_pd(y, accy);
+    ax += (x[0] + x[1]) + (x[2] + x[3]);
+    ay += (y[0] + y[1]) + (y[2] + y[3]);
+    mutual_scalar<S>(tx, ty, tm, th, sx + j, sy + j, sm + j, sh != nullptr ? sh + j : nullptr, n - j,
+                     ax, ay, sax + j, say + j);
+}
+
+//
+//  Quadrupoles 4 at a time. There are far fewer of them than sources, so this one uses
+//  the exact square root and division (same results as the scalar version up to
+//  rounding), and serves the AVX512 CPUs too.
+//
+//  Only PLUMMER is softened beyond the reach of the softening. The walks open the
+//  nodes within it, so for CUTOFF and SPLINE the 4 nodes are taken by the scalar
+//  version in the rare case one of them is inside.
+//
+template <Softening S>
+NBODY_TARGET("avx2,fma")
+inline void quadrupole_avx2(double tx, double ty, double th, const double *cx, const double *cy,
+                            const double *ch, const double *qxx, const double *qxy, const double *qyy,
+                            size_t n, double &ax, double &ay) {
+    const __m256d vtx = _mm256_set1_pd(tx), vty = _mm256_set1_pd(ty), vth = _mm256_set1_pd(th);
+    const __m256d one = _mm256_set1_pd(1.0), three = _mm256_set1_pd(3.0), five = _mm256_set1_pd(5.0);
+    const __m256d support = _mm256_set1_pd(S == Softening::SPLINE ? spline_support : 1.0);
+    __m256d accx = _mm256_setzero_pd(), accy = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d x = _mm256_sub_pd(vtx, _mm256_loadu_pd(cx + j));
+        __m256d y = _mm256_sub_pd(vty, _mm256_loadu_pd(cy + j));
+        __m256d h = ch != nullptr ? _mm256_max_pd(vth, _mm256_loadu_pd(ch + j)) : vth;
+        __m256d d_2 = _mm256_fmadd_pd(x, x, _mm256_mul_pd(y, y));
+        if (S == Softening::PLUMMER) {
+            d_2 = _mm256_fmadd_pd(h, h, d_2);
+        } else {
+            const __m256d reach = _mm256_mul_pd(support, h);
+            if (_mm256_movemask_pd(_mm256_cmp_pd(d_2, _mm256_mul_pd(reach, reach), _CMP_LT_OQ)) != 0) {
+                quadrupole_scalar<S>(tx, ty, th, cx + j, cy + j, ch != nullptr ? ch + j : nullptr,
+                                     qxx + j, qxy + j, qyy + j, 4, ax, ay);
+                continue;
+            }
+        }
+        __m256d r_i2 = _mm256_div_pd(one, d_2);
+        __m256d d2 = _mm256_mul_pd(three, _mm256_mul_pd(_mm256_mul_pd(r_i2, r_i2), _mm256_sqrt_pd(r_i2)));
+        __m256d d3 = _mm256_mul_pd(_mm256_mul_pd(five, r_i2), d2); // -D3
+        __m256d ux = _mm256_mul_pd(d3, _mm256_mul_pd(x, x));
+        __m256d uy = _mm256_mul_pd(d3, _mm256_mul_pd(y, y));
+        __m256d xxx = _mm256_mul_pd(x, _mm256_fmsub_pd(three, d2, ux));
+        __m256d xxy = _mm256_mul_pd(y, _mm256_sub_pd(d2, ux));
+        __m256d xyy = _mm256_mul_pd(x, _mm256_sub_pd(d2, uy));
+        __m256d yyy = _mm256_mul_pd(y, _mm256_fmsub_pd(three, d2, uy));
+        __m256d q_xx = _mm256_loadu_pd(qxx + j), q_xy = _mm256_loadu_pd(qxy + j), q_yy = _mm256_loadu_pd(qyy + j);
+        accx = _mm256_fmadd_pd(q_xx, xxx, _mm256_fmadd_pd(q_xy, xxy, _mm256_fmadd_pd(q_yy, xyy, accx)));
+        accy = _mm256_fmadd_pd(q_xx, xxy, _mm256_fmadd_pd(q_xy, xyy, _mm256_fmadd_pd(q_yy, yyy, accy)));
+    }
+    double sx[4], sy[4];
+    _mm256_storeu_pd(sx, accx);
+    _mm256_storeu_pd(sy, accy);
+    ax += (sx[0] + sx[1]) + (sx[2] + sx[3]);
+    ay += (sy[0] + sy[1]) + (sy[2] + sy[3]);
+    quadrupole_scalar<S>(tx, ty, th, cx + j, cy + j, ch != nullptr ? ch + j : nullptr,
+                         qxx + j, qxy + j, qyy + j, n - j, ax, ay);
+}
+
+//
+//  Softened 1/d^3 of 8 pairs, zero outside of live and for d_2 == 0
+//
+//  14 bit estimate of 1/sqrt, two Newton steps
+//
+template <Softening S>
+NBODY_TARGET("avx512f")
+inline __m512d softened_inverse_cube_avx512(__m512d d_2, __m512d h, __mmask8 live) {
+    const __m512d half = _mm512_set1_pd(0.5), three_halves = _mm512_set1_pd(1.5);
+    const __m512d r_2 = S == Softening::PLUMMER ? _mm512_fmadd_pd(h, h, d_2) : d_2;
+    __m512d y = _mm512_maskz_rsqrt14_pd(0xff, r_2);
+    __m512d hr = _mm512_mul_pd(half, r_2);
+    y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(hr, y), y, three_halves));
+    y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(hr, y), y, three_halves));
+    __m512d w = _mm512_mul_pd(y, _mm512_mul_pd(y, y));
+    if (S == Softening::SPLINE) {
+        const __m512d support = _mm512_mul_pd(_mm512_set1_pd(spline_support), h);
+        const __m512d h_1 = _mm512_div_pd(_mm512_set1_pd(1.0), support);
+        const __m512d h_3 = _mm512_mul_pd(h_1, _mm512_mul_pd(h_1, h_1));
+        const __m512d u = _mm512_mul_pd(_mm512_mul_pd(d_2, y), h_1);
+        const __m512d u_2 = _mm512_mul_pd(u, u);
+        __m512d inner = _mm512_fmadd_pd(u_2, _mm512_fmsub_pd(_mm512_set1_pd(32.0), u, _mm512_set1_pd(38.4)),
+                                        _mm512_set1_pd(32.0 / 3.0));
+        __m512d middle = _mm512_fmadd_pd(u, _mm512_fmadd_pd(u, _mm512_fnmadd_pd(_mm512_set1_pd(32.0 / 3.0), u,
+                                         _mm512_set1_pd(38.4)), _mm512_set1_pd(-48.0)), _mm512_set1_pd(64.0 / 3.0));
+        inner = _mm512_mul_pd(h_3, inner);
+        middle = _mm512_fnmadd_pd(_mm512_set1_pd(1.0 / 15.0), w, _mm512_mul_pd(h_3, middle));
+        const __m512d close = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(u, half, _CMP_LT_OQ), middle, inner);
+        w = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(u, _mm512_set1_pd(1.0), _CMP_LT_OQ), w, close);
+    }
+    if (S == Softening::CUTOFF) {
+        live &= _mm512_cmp_pd_mask(d_2, _mm512_mul_pd(h, h), _CMP_GE_OQ);
+    } else {
+        live &= _mm512_cmp_pd_mask(d_2, _mm512_setzero_pd(), _CMP_GT_OQ);
+    }
+    return _mm512_maskz_mov_pd(live, w);
+}
+
+//
+//  Sum of the 8 lanes, in the order of _mm512_reduce_add_pd
+//
+//  The plain (unmasked) rsqrt14, max and extract of GCC start from an undefined
+//  vector, which -Wall reports as used uninitialized. The zero masked forms with
+//  every lane set give the same result without one.
+//
+NBODY_TARGET("avx512f")
+inline double sum_avx512(__m512d v) {
+    const __m256d quad = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xf, v, 0), _mm512_maskz_extractf64x4_pd(0xf, v, 1));
+    const __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(quad), _mm256_extractf128_pd(quad, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+template <Softening S>
+NBODY_TARGET("avx512f")
+inline void interact_avx512(double tx, double ty, double th,
+                            const double *sx, const double *sy, const double *sm, const double *sh,
+                            size_t n, double &ax, double &ay) {
+    const __m512d vtx = _mm512_set1_pd(tx), vty = _mm512_set1_pd(ty), vth = _mm512_set1_pd(th);
+    __m512d accx = _mm512_setzero_pd(), accy = _mm512_setzero_pd();
+    for (size_t j = 0; j < n; j += 8) {
+        // the last block is loaded with a mask, no scalar loop needed
+        __mmask8 live = n - j >= 8 ? (__mmask8) 0xff : (__mmask8) ((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, sx + j), vtx);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, sy + j), vty);
+        __m512d d_2 = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+        __m512d h = sh != nullptr ? _mm512_maskz_max_pd(0xff, vth, _mm512_maskz_loadu_pd(live, sh + j)) : vth;
+        __m512d w = _mm512_mul_pd(_mm512_maskz_loadu_pd(live, sm + j), softened_inverse_cube_avx512<S>(d_2, h, live));
+        accx = _mm512_fmadd_pd(w, dx, accx);
+        accy = _mm512_fmadd_pd(w, dy, accy);
+    }
+    ax += sum_avx512(accx);
+    ay += sum_avx512(accy);
+}
+
+template <Softening S>
+NBODY_TARGET("avx512f")
+inline void mutual_avx512(double tx, double ty, double tm, double th,
+                          const double *sx, const double *sy, const double *sm, const double *sh,
+                          size_t n, double &ax, double &ay, double *sax, double *say) {
+    const __m512d vtx = _mm512_set1_pd(tx), vty = _mm512_set1_pd(ty), vtm = _mm512_set1_pd(tm);
+    const __m512d vth = _mm512_set1_pd(th);
+    __m512d accx = _mm512_setzero_pd(), accy = _mm512_setzero_pd();
+    for (size_t j = 0; j < n; j += 8) {
+        __mmask8 live = n - j >= 8 ? (__mmask8) 0xff : (__mmask8) ((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, sx + j), vtx);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, sy + j), vty);
+        __m512d d_2 = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+        __m512d h = sh != nullptr ? _mm512_maskz_max_pd(0xff, vth, _mm512_maskz_loadu_pd(live, sh + j)) : vth;
+        __m512d w = softened_inverse_cube_avx512<S>(d_2, h, live);
+        __m512d ws = _mm512_mul_pd(_mm512_maskz_loadu_pd(live, sm + j), w);
+        __m512d wt = _mm512_mul_pd(vtm, w);
+        accx = _mm512_fmadd_pd(ws, dx, accx);
+        accy = _mm512_fmadd_pd(ws, dy, accy);
+        _mm512_mask_storeu_pd(sax + j, live, _mm512_fnmadd_pd(wt, dx, _mm512_maskz_loadu_pd(live, sax + j)));
+        _mm512_mask_storeu_pd(say + j, live, _mm512_fnmadd_pd(wt, dy, _mm512_maskz_loadu_pd(live, say + j)));
+    }
+    ax += sum_avx512(accx);
+    ay += sum_avx512(accy);
+}
+
+//
+//  Does the CPU (and the OS) support the instruction set?
+//
+inline bool cpu_supports(KernelIsa isa) {
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    switch (isa) {
+        case KernelIsa::SCALAR: return true;
+        case KernelIsa::SSE2: return __builtin_cpu_supports("sse2");
+        case KernelIsa::AVX2: return __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma");
+        case KernelIsa::AVX512: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool os_saves_ymm = (info[2] & (1 << 27)) != 0 and (_xgetbv(0) & 0x06) == 0x06;
+    bool os_saves_zmm = os_saves_ymm and (_xgetbv(0) & 0xe6) == 0xe6;
+    __cpuidex(info, 7, 0);
+    switch (isa) {
+        case KernelIsa::SCALAR: return true;
+        case KernelIsa::SSE2: return sse2;
+        case KernelIsa::AVX2: return os_saves_ymm and fma and (info[1] & (1 << 5)) != 0;
+        case KernelIsa::AVX512: return os_saves_zmm and (info[1] & (1 << 16)) != 0;
+    }
+    return false;
+#else
+    return isa == KernelIsa::SCALAR;
+#endif
+}
+
+#else // not x86
+
+inline bool cpu_supports(KernelIsa isa) { return isa == KernelIsa::SCALAR; }
+
+#endif
+
+template <Softening S>
+inline interaction_kernel get_kernel(KernelIsa isa) {
+#ifdef NBODY_KERNEL_X86
+    switch (isa) {
+        case KernelIsa::SSE2: return interact_sse2<S>;
+        case KernelIsa::AVX2: return interact_avx2<S>;
+        case KernelIsa::AVX512: return interact_avx512<S>;
+        default: break;
+    }
+#endif
+    return interact_scalar<S>;
+}
+inline interaction_kernel get_kernel(KernelIsa isa, Softening softening) {
+    switch (softening) {
+        case Softening::CUTOFF: return get_kernel<Softening::CUTOFF>(isa);
+        case Softening::PLUMMER: return get_kernel<Softening::PLUMMER>(isa);
+        default: return get_kernel<Softening::SPLINE>(isa);
+    }
+}
+
+template <Softening S>
+inline mutual_kernel get_mutual_kernel(KernelIsa isa) {
+#ifdef NBODY_KERNEL_X86
+    switch (isa) {
+        case KernelIsa::AVX2: return mutual_avx2<S>;
+        case KernelIsa::AVX512: return mutual_avx512<S>;
+        default: break;
+    }
+#endif
+    return mutual_scalar<S>;
+}
+inline mutual_kernel get_mutual_kernel(KernelIsa isa, Softening softening) {
+    switch (softening) {
+        case Softening::CUTOFF: return get_mutual_kernel<Softening::CUTOFF>(isa);
+        case Softening::PLUMMER: return get_mutual_kernel<Softening::PLUMMER>(isa);
+        default: return get_mutual_kernel<Softening::SPLINE>(isa);
+    }
+}
+
+template <Softening S>
+inline quadrupole_kernel get_quadrupole_kernel(KernelIsa isa) {
+#ifdef NBODY_KERNEL_X86
+    if (isa == KernelIsa::AVX2 or isa == KernelIsa::AVX512) {
+        return quadrupole_avx2<S>;
+    }
+#endif
+    return quadrupole_scalar<S>;
+}
+inline quadrupole_kernel get_quadrupole_kernel(KernelIsa isa, Softening softening) {
+    switch (softening) {
+        case Softening::CUTOFF: return get_quadrupole_kernel<Softening::CUTOFF>(isa);
+        case Softening::PLUMMER: return get_quadrupole_kernel<Softening::PLUMMER>(isa);
+        default: return get_quadrupole_kernel<Softening::SPLINE>(isa);
+    }
+}
+
+inline const char *kernel_name(KernelIsa isa) {
+    const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+    return names[isa];
+}
+
+//
+//  Best instruction set of this CPU (or the one asked for in NBODY_KERNEL)
+//
+inline KernelIsa detect_kernel_isa() {
+    const char *forced = std::getenv("NBODY_KERNEL");
+    for (int isa = KernelIsa::AVX512; isa >= KernelIsa::SCALAR; --isa) {
+        if (forced != nullptr and std::strcmp(forced, kernel_name((KernelIsa) isa)) != 0) {
+            continue;
+        }
+        if (cpu_supports((KernelIsa) isa)) {
+            return (KernelIsa) isa;
+        }
+    }
+    return KernelIsa::SCALAR;
+}
+
+//
+//  The kernel used by the tree, chosen once at startup
+//
+inline KernelIsa active_kernel_isa() {
+    static const KernelIsa isa = detect_kernel_isa();
+    return isa;
+}
+inline interaction_kernel active_kernel(Softening softening) {
+    static const interaction_kernel kernels[] = {
+            get_kernel(active_kernel_isa(), Softening::CUTOFF),
+            get_kernel(active_kernel_isa(), Softening::PLUMMER),
+            get_kernel(active_kernel_isa(), Softening::SPLINE) };
+    return kernels[softening];
+}
+inline mutual_kernel active_mutual_kernel(Softening softening) {
+    static const mutual_kernel kernels[] = {
+            get_mutual_kernel(active_kernel_isa(), Softening::CUTOFF),
+            get_mutual_kernel(active_kernel_isa(), Softening::PLUMMER),
+            get_mutual_kernel(active_kernel_isa(), Softening::SPLINE) };
+    return kernels[softening];
+}
+inline quadrupole_kernel active_quadrupole_kernel(Softening softening) {
+    static const quadrupole_kernel kernels[] = {
+            get_quadrupole_kernel(active_kernel_isa(), Softening::CUTOFF),
+            get_quadrupole_kernel(active_kernel_isa(), Softening::PLUMMER),
+            get_quadrupole_kernel(active_kernel_isa(), Softening::SPLINE) };
+    return kernels[softening];
+}
+
+
+//
+//  Test every kernel this CPU supports against the scalar kernel
+//
+//  The SIMD kernels use rsqrt and Newton steps instead of sqrt and a division, so
+//  they are not bit for bit the same. The relative difference of the sums has to stay
+//  below kernel_tolerance.
+//
+const double kernel_tolerance = 1e-12;
+
+inline bool test_kernels_match_scalar(bool verbose=true) {
+    std::mt19937 gen(2016);
+    std::uniform_real_distribution<> position(-1500.0, 1500.0);
+    std::uniform_real_distribution<> mass(1e3, 1e7);
+    std::uniform_real_distribution<> close(-60.0, 60.0);
+    std::uniform_real_distribution<> length(5.0, 40.0);
+    const char *softening_names[] = { "cutoff", "plummer", "spline" };
+
+    bool test_success = true;
+    for (size_t n : { 0, 1, 3, 4, 7, 8, 9, 31, 64, 257 }) {
+        std::vector<double> sx(n), sy(n), sm(n), sh(n);
+        for (size_t j = 0; j < n; ++j) {
+            sx[j] = position(gen);
+            sy[j] = position(gen);
+            sm[j] = mass(gen);
+            sh[j] = length(gen);
+        }
+        if (n > 2) { sx[1] = sx[0]; sy[1] = sy[0]; } // a source on top of the target
+        for (size_t j = 2; j < n; j += 3) {          // and some inside the softening
+            sx[j] = sx[0] + close(gen);
+            sy[j] = sy[0] + close(gen);
+        }
+        double tx = n > 0 ? sx[0] : 0.0, ty = n > 0 ? sy[0] : 0.0;
+
+        //  every softening, with one length for all and with a length per source
+        for (int softening = Softening::CUTOFF; softening <= Softening::SPLINE; ++softening) {
+            for (const double *lengths : { (const double *) nullptr, (const double *) sh.data() }) {
+                double rx = 0.0, ry = 0.0;
+                get_kernel(KernelIsa::SCALAR, (Softening) softening)(tx, ty, 2.0e1, sx.data(), sy.data(), sm.data(),
+                                                                     lengths, n, rx, ry);
+                double scale = std::sqrt(rx*rx + ry*ry);
+
+                for (int isa = KernelIsa::SSE2; isa <= KernelIsa::AVX512; ++isa) {
+                    if (!cpu_supports((KernelIsa) isa)) {
+                        continue;
+                    }
+                    double ax = 0.0, ay = 0.0;
+                    get_kernel((KernelIsa) isa, (Softening) softening)(tx, ty, 2.0e1, sx.data(), sy.data(), sm.data(),
+                                                                       lengths, n, ax, ay);
+                    double error = std::sqrt((ax - rx)*(ax - rx) + (ay - ry)*(ay - ry));
+                    if (error > kernel_tolerance * scale) {
+                        test_success = false;
+                        if (verbose) {
+                            std::cout << "kernel " << kernel_name((KernelIsa) isa) << " ("
+                                      << softening_names[softening] << ") differs for n = " << n
+                                      << ": relative error " << error / scale << std::endl;
+                        }
+                    }
+                }
+
+                //  the mutual kernel has to give the same sum for the target, and the
+                //  opposite of each term to the sources
+                std::vector<double> sax(n, 0.0), say(n, 0.0), rsx(n, 0.0), rsy(n, 0.0);
+                double tm = 2.5e6, mx = 0.0, my = 0.0;
+                get_mutual_kernel(KernelIsa::SCALAR, (Softening) softening)(tx, ty, tm, 2.0e1, sx.data(), sy.data(),
+                                                                            sm.data(), lengths, n, mx, my,
+                                                                            rsx.data(), rsy.data());
+                double pull_x = 0.0, pull_y = 0.0; // sum of m_j * (opposite term)
+                for (size_t j = 0; j < n; ++j) { pull_x += sm[j] * rsx[j]; pull_y += sm[j] * rsy[j]; }
+                double error = std::fabs(mx - rx) + std::fabs(my - ry)
+                               + std::fabs(pull_x + tm * rx) / tm + std::fabs(pull_y + tm * ry) / tm;
+                double ax = 0.0, ay = 0.0;
+                active_mutual_kernel((Softening) softening)(tx, ty, tm, 2.0e1, sx.data(), sy.data(), sm.data(),
+                                                            lengths, n, ax, ay, sax.data(), say.data());
+                error += std::fabs(ax - rx) + std::fabs(ay - ry);
+                for (size_t j = 0; j < n; ++j) {
+                    error += sm[j] * (std::fabs(sax[j] - rsx[j]) + std::fabs(say[j] - rsy[j])) / tm;
+                }
+                if (error > kernel_tolerance * scale) {
+                    test_success = false;
+                    if (verbose) {
+                        std::cout << "mutual kernel (" << softening_names[softening] << ") differs for n = " << n
+                                  << ": relative error " << error / scale << std::endl;
+                    }
+                }
+            }
+        }
+
+        //  the same lists as quadrupoles (the target is moved away from all of them),
+        //  with lengths that reach the nodes
+        std::vector<double> qyy(sm), ch(sh);
+        for (double &q : qyy) { q = -0.5 * q; }
+        for (double &h : ch) { h *= 100.0; }
+        tx += 4000.0;
+        for (int softening = Softening::CUTOFF; softening <= Softening::SPLINE; ++softening) {
+            for (const double *lengths : { (const double *) nullptr, (const double *) ch.data() }) {
+                double rx = 0.0, ry = 0.0;
+                get_quadrupole_kernel(KernelIsa::SCALAR, (Softening) softening)(tx, ty, 2.0e3, sx.data(), sy.data(),
+                                                                                lengths, sm.data(), sm.data(),
+                                                                                qyy.data(), n, rx, ry);
+                double scale = std::sqrt(rx*rx + ry*ry);
+                double ax = 0.0, ay = 0.0;
+                active_quadrupole_kernel((Softening) softening)(tx, ty, 2.0e3, sx.data(), sy.data(), lengths,
+                                                                sm.data(), sm.data(), qyy.data(), n, ax, ay);
+                double error = std::sqrt((ax - rx)*(ax - rx) + (ay - ry)*(ay - ry));
+                if (error > kernel_tolerance * scale) {
+                    test_success = false;
+                    if (verbose) {
+                        std::cout << "quadrupole kernel (" << softening_names[softening] << ") differs for n = "
+                                  << n << ": relative error " << error / scale << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    //
+    //  The factors of the quadrupole terms are the derivatives of the softened 1/d^3:
+    //  D2 = w'(r) / r and D3 = D2'(r) / r (see softened_quadrupole_factors), checked
+    //  with central differences across the softening
+    //
+    const double h = 10.0, step = 1e-4;
+    for (int softening = Softening::CUTOFF; softening <= Softening::SPLINE; ++softening) {
+        const Softening S = (Softening) softening;
+        auto factors = [S, h](double r, double &d2, double &d3) {
+            switch (S) {
+                case Softening::CUTOFF: softened_quadrupole_factors<Softening::CUTOFF>(r * r, h, d2, d3); break;
+                case Softening::PLUMMER: softened_quadrupole_factors<Softening::PLUMMER>(r * r, h, d2, d3); break;
+                default: softened_quadrupole_factors<Softening::SPLINE>(r * r, h, d2, d3); break;
+            }
+        };
+        for (double r = 0.37; r < 40.0; r += 0.61) {
+            double d2, d3, d2_minus, d2_plus, unused;
+            factors(r, d2, d3);
+            factors(r - step, d2_minus, unused);
+            factors(r + step, d2_plus, unused);
+            const double w_slope = (softened_inverse_cube(S, (r + step) * (r + step), h)
+                                    - softened_inverse_cube(S, (r - step) * (r - step), h)) / (2.0 * step);
+            const double e2 = std::fabs(-w_slope / r - d2) / std::max(std::fabs(d2), 1e-12);
+            const double e3 = std::fabs((d2_plus - d2_minus) / (2.0 * step) / r - d3) / std::max(std::fabs(d3), 1e-12);
+            if (e2 > 1e-6 or e3 > 1e-6) {
+                test_success = false;
+                if (verbose) {
+                    std::cout << "quadrupole factors (" << softening_names[softening] << ") are not the derivatives "
+                              << "of the softening at r = " << r << " (" << e2 << ", " << e3 << ")" << std::endl;
+                }
+            }
+        }
+    }
+    if (verbose) {
+        std::cout << "kernel test " << (test_success ? "passed" : "failed")
+                  << " (using " << kernel_name(active_kernel_isa()) << ")" << std::endl;
+    }
+    return test_success;
+}
+
+
+#endif //TREE_CODE_KERNEL_H
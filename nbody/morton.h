@@ -0,0 +1,134 @@
+//
+// Created on 10/17/26.
+//
+//  Keys for bulk building a bh_tree
+//
+//  A body's key is the path from the root of the tree down to the body, two bits
+//  per level. Bodies with the same first L digits end up in the same node at depth L,
+//  so once the keys are sorted every node of the tree is a contiguous range of the
+//  sorted array. This is the usual Morton (Z-order) trick, but the digits are
+//  computed with exactly the same comparisons as region::get_quadrant, so a tree built
+//  from the keys has the same shape as a tree built with bh_tree::insert_body.
+//
+
+#ifndef TREE_CODE_MORTON_H
+#define TREE_CODE_MORTON_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "region.h"
+#include "parallel.h"
+
+//
+//  31 levels of two bits fit in 62 bits of the key. The key of a body outside
+//  the region is morton_outside, which sorts after every other key.
+//
+const int morton_levels = 31;
+const uint64_t morton_outside = ~(uint64_t) 0;
+
+struct morton_entry {
+    uint64_t key;
+    uint32_t body;
+};
+
+//
+//  Digit (a Quadrant value) for the given level of a key
+//
+inline Quadrant morton_digit(uint64_t key, int level) {
+    return (Quadrant) ((key >> (2 * (morton_levels - 1 - level))) & 3u);
+}
+
+//
+//  Compute the key of a point, by walking down the quadrants of the region
+//
+//  The digit of each level is the Quadrant value, so sorted keys list children in
+//  NW, NE, SE, SW order (the same order bh_tree_node stores them in)
+//
+inline uint64_t morton_key(const region &r, const point &p) {
+    if (!r.is_in(p)) {
+        return morton_outside;
+    }
+    double xmin = r.get_min_corner().x, ymin = r.get_min_corner().y;
+    double xmax = r.get_max_corner().x, ymax = r.get_max_corner().y;
+
+    uint64_t key = 0;
+    for (int level = 0; level < morton_levels; ++level) {
+        // same arithmetic as the region constructor, and same tie breaking as get_quadrant
+        double cx = xmin + (xmax - xmin) / 2.0;
+        double cy = ymin + (ymax - ymin) / 2.0;
+        bool north = p.y >= cy;
+        bool west = p.x <= cx;
+        Quadrant q;
+        if (north) {
+            q = west ? Quadrant::NW : Quadrant::NE;
+        } else {
+            q = west ? Quadrant::SW : Quadrant::SE;
+        }
+        if (west) { xmax = cx; } else { xmin = cx; }
+        if (north) { ymin = cy; } else { ymax = cy; }
+        key = (key << 2) | (uint64_t) q;
+    }
+    return key;
+}
+
+//
+//  Stable least significant digit radix sort of the entries by key
+//
+//  Each pass uses 8 bits. The entries are cut into one part per thread of the pool,
+//  every part counts its own digits, and then scatters its entries to the offsets
+//  computed from all of the counts. Passes where every key has the same digit are
+//  skipped (clustered bodies share their high bits).
+//
+//  tmp and counts are scratch space, they are kept by the caller so repeated sorts do
+//  not allocate
+//
+inline void parallel_radix_sort(std::vector<morton_entry> &entries, std::vector<morton_entry> &tmp,
+                                std::vector<size_t> &counts, task_pool &pool = default_pool()) {
+    const size_t n = entries.size();
+    if (n < 2) { return; }
+    const unsigned parts = (unsigned) std::min<size_t>(pool.size(), n);
+    tmp.resize(n);
+    counts.resize(parts * 256);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+        run_parts(pool, n, parts, [&](size_t begin, size_t end, unsigned t) {
+            size_t *c = &counts[t * 256];
+            for (size_t i = begin; i < end; ++i) {
+                ++c[(entries[i].key >> shift) & 0xff];
+            }
+        });
+
+        // skip the pass if all keys share this digit
+        bool all_same = false;
+        for (int d = 0; d < 256 and !all_same; ++d) {
+            size_t total = 0;
+            for (unsigned t = 0; t < parts; ++t) { total += counts[t * 256 + d]; }
+            if (total == n) { all_same = true; }
+            if (total != 0) { break; }
+        }
+        if (all_same) { continue; }
+
+        // turn the counts into the first output position for each (part, digit)
+        size_t offset = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (unsigned t = 0; t < parts; ++t) {
+                size_t c = counts[t * 256 + d];
+                counts[t * 256 + d] = offset;
+                offset += c;
+            }
+        }
+
+        run_parts(pool, n, parts, [&](size_t begin, size_t end, unsigned t) {
+            size_t *c = &counts[t * 256];
+            for (size_t i = begin; i < end; ++i) {
+                tmp[c[(entries[i].key >> shift) & 0xff]++] = entries[i];
+            }
+        });
+        entries.swap(tmp);
+    }
+}
+
+#endif //TREE_CODE_MORTON_H
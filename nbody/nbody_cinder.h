@@ -5,17 +5,15 @@
 #ifndef BASICAPP_NBODY_CINDER_H
 #define BASICAPP_NBODY_CINDER_H
 
-#include <vector>
-
-#include "bh_tree.h"
+#include "forces.h"
 #include "cinder/gl/gl.h"
 
 
 // convert between cinder and my custom point types
-ci::vec2 point_to_vec2(const point p) {
+inline ci::vec2 point_to_vec2(const point p) {
     return ci::vec2(p.x, p.y);
 }
-point vec2_to_point(const ci::vec2 v2) {
+inline point vec2_to_point(const ci::vec2 v2) {
     return point(v2.x, v2.y);
 }
 
@@ -24,7 +22,7 @@ point vec2_to_point(const ci::vec2 v2) {
 //
 //   Used to convert between point on screen, and point in computational space
 //
-ci::ivec2 scale_point_to_screen(const point &p, const region &r, const ci::ivec2 screen) {
+inline ci::ivec2 scale_point_to_screen(const point &p, const region &r, const ci::ivec2 screen) {
     double x_offset = r.get_min_corner().x;
     double y_offset = r.get_min_corner().y;
 
@@ -39,7 +37,7 @@ ci::ivec2 scale_point_to_screen(const point &p, const region &r, const ci::ivec2
     ci::ivec2 pt((int)x, (int)y);
     return pt;
 }
-point scale_vec2_to_point(const ci::vec2 &v, const region &r, const ci::vec2 screen) {
+inline point scale_vec2_to_point(const ci::vec2 &v, const region &r, const ci::vec2 screen) {
     double x_offset = r.get_min_corner().x;
     double y_offset = r.get_min_corner().y;
 
@@ -55,92 +53,29 @@ point scale_vec2_to_point(const ci::vec2 &v, const region &r, const ci::vec2 scr
     return pt;
 }
 
-//
-// todo: figure out how to remove bodies, following code isn't working
-//
-void pluck_outside_bodies(std::vector<std::shared_ptr<body>> &bodies, const region &r) {
-    // use remove if to remove all elements outside the tree
-    auto ptr_begin = bodies.begin();
-    auto ptr_end = bodies.end();
-
-    std::vector<int> erase_list;
-
-    int index = 0;
-    for (auto ptr = ptr_begin; ptr != ptr_end; ++ptr) {
-        point pos = ptr->get()->get_position();
-        if (!r.is_in(pos)) {
-            std::cout << "something needs to be removed" << std::endl;
-            erase_list.push_back(index);
-        }
-        ++index;
-    }
-
-    for (int i = erase_list.size()-1; i >= 0; --i) {
-        bodies.erase(bodies.begin() + erase_list[i]);
-    }
-
-    //ptr_end = std::remove_if(ptr_begin, ptr_end, fnc);
-
-}
-
-//
-//  Compute forces for each body in the body vector
-//
-std::vector<point> compute_forces(std::vector<std::shared_ptr<body>> &bodies, const region r){
-    // Create tree for force computation
-    bh_tree tree(r);
-
-    // todo: uncomment code below once code to remove bodies is fixed
-    //pluck_outside_bodies(bodies, tree.get_global_region());
-
-    //
-    //  Put bodies in the tree
-    //
-    for (int i = 0; i < bodies.size(); ++i) {
-        tree.insert_body(bodies[i]);
-    }
-    //
-    // Update the tree so that all Conglomerate nodes will have the
-    //   proper mass and position (based on center of gravity)
-    //   this is much faster if we do it once all bodies are in place
-    //
-    tree.update();
-
-    //
-    // Compute vector of forces for each body
-    //
-    std::vector<point> forces;
-    for (auto &b : bodies) {
-        point force = tree.compute_force(b);
-        forces.push_back(force);
-    }
-
-    return forces;
-}
-
-
-void update_bodies_with_forces(std::vector<std::shared_ptr<body>> &bodies, const std::vector<point> &forces) {
-    double dt = 10000.0;
-    if (bodies.size() != forces.size()) {
-        std::cout << "error in updating bodies with forces, sizes don't match" << std::endl;
-    }
-    for (int i = 0; i < bodies.size(); ++i) {
-        bodies[i]->update_based_on_force_dt(forces[i], dt);
-    }
-}
-
-
-//
 //  Add bodies, based on a screen position
 //
 //  This uses scaling functions
 //
-void add_body_to_bodies(std::vector<std::shared_ptr<body>> &bodies, ci::vec2 screen, ci::vec2 pos, region disp_region) {
+inline void add_body_to_bodies(body_store &bodies, ci::vec2 screen, ci::vec2 pos, region disp_region) {
     point pt = scale_vec2_to_point(pos, disp_region, screen);
     double mass = 5000;
     point vel(0,0);
-    std::shared_ptr<body> body_ptr = std::make_shared<body>(mass, pt, vel);
-    bodies.push_back(body_ptr);
+    bodies.add(mass, pt, vel);
+}
+
+//
+//  Same as above, and put the new body straight into a persistent tree
+//
+//  If the tree doesn't hold the other bodies (for example the bodies were replaced)
+//  it is left alone, the next step will build it again.
+//
+inline void add_body_to_bodies(body_store &bodies, ci::vec2 screen, ci::vec2 pos, region disp_region,
+                        bh_tree &tree) {
+    add_body_to_bodies(bodies, screen, pos, disp_region);
+    if (!tree.is_empty() and tree.get_body_count() + 1 == bodies.size()) {
+        tree.insert_body(bodies, bodies.size() - 1);
+    }
 }
 
 
@@ -0,0 +1,281 @@
+//
+// Created on 10/17/26.
+//
+//  Small helpers for running loops over all cores
+//
+
+#ifndef TREE_CODE_PARALLEL_H
+#define TREE_CODE_PARALLEL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+//
+//  Number of threads to use when the caller does not say (0 means "all of them")
+//
+inline unsigned thread_count(unsigned requested = 0) {
+    if (requested != 0) { return requested; }
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw == 0 ? 1 : hw;
+}
+
+//
+//  Pool of worker threads that balance uneven loops by stealing work
+//
+//  Giving every thread the same share is fine when every item costs the same. Walking
+//  the tree does not: a body near a galaxy core opens many more nodes than one in the
+//  outer disk. Here the loop is cut into chunks of grain items, and every worker starts
+//  with a contiguous block of chunks (so neighbouring items, which are usually
+//  neighbouring bodies, stay on the same thread). A worker that runs out steals the
+//  second half of the chunks left to another worker.
+//
+//  The threads are started once and wait for work between loops, so a loop does not
+//  pay for starting threads. The calling thread is worker 0.
+//
+//  Loops can't be nested (f must not call run on the same pool).
+//
+class task_pool {
+protected:
+    //  chunks [begin, end) still to run by a worker, guarded by lock
+    struct chunk_range {
+        std::mutex lock;
+        size_t begin = 0, end = 0;
+    };
+
+    unsigned threads;
+    std::vector<std::thread> workers;
+    std::unique_ptr<chunk_range[]> ranges;
+
+    std::mutex job_lock;
+    std::condition_variable job_ready, job_done;
+    uint64_t generation;   // incremented for every loop
+    unsigned running;      // workers (other than the caller) still on the current loop
+    bool stopping;
+
+    std::function<void(size_t, size_t, unsigned)> job;
+    size_t job_n, job_grain;
+
+public:
+    explicit task_pool(unsigned requested = 0) : threads(0), generation(0), running(0), stopping(false) {
+        start(thread_count(requested));
+    }
+    ~task_pool() { stop(); }
+
+    task_pool(const task_pool &) = delete;
+    task_pool &operator=(const task_pool &) = delete;
+
+    unsigned size() const { return threads; }
+
+    //
+    //  Change the number of threads (0 means all cores)
+    //
+    void set_threads(unsigned requested) {
+        unsigned n = thread_count(requested);
+        if (n != threads) {
+            stop();
+            start(n);
+        }
+    }
+
+    //
+    //  Call f(begin, end, worker) for chunks of at most grain items covering [0, n)
+    //
+    //  worker is in [0, size()), so f can keep per-worker scratch space. When tracing
+    //  (trace.h), every chunk is an event on the track of the thread that ran it.
+    //
+    template <typename Function>
+    void run(size_t n, size_t grain, Function f) {
+        if (grain == 0) { grain = 1; }
+        const size_t chunks = (n + grain - 1) / grain;
+        if (threads == 1 or chunks <= 1) {
+            for (size_t c = 0; c < chunks; ++c) {
+                const size_t begin = c * grain, end = std::min(n, (c + 1) * grain);
+                trace_scope trace("chunk", begin, end);
+                f(begin, end, 0u);
+            }
+            return;
+        }
+
+        for (unsigned w = 0; w < threads; ++w) {
+            std::lock_guard<std::mutex> guard(ranges[w].lock);
+            ranges[w].begin = chunks * w / threads;
+            ranges[w].end = chunks * (w + 1) / threads;
+        }
+        {
+            std::lock_guard<std::mutex> guard(job_lock);
+            job = [&f](size_t begin, size_t end, unsigned w) { f(begin, end, w); };
+            job_n = n;
+            job_grain = grain;
+            running = threads - 1;
+            ++generation;
+        }
+        job_ready.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> guard(job_lock);
+        job_done.wait(guard, [this]() { return running == 0; });
+        job = nullptr;
+    }
+
+protected:
+    //
+    //  New workers start from the current generation: the pool may have run loops
+    //  before (set_threads), and a worker starting from 0 would take the last of them
+    //  for a new one
+    //
+    void start(unsigned n) {
+        threads = n;
+        stopping = false;
+        running = 0;
+        ranges.reset(new chunk_range[n]);
+        workers.reserve(n - 1);
+        const uint64_t seen = generation;
+        for (unsigned w = 1; w < n; ++w) {
+            workers.emplace_back([this, w, seen]() { worker_loop(w, seen); });
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(job_lock);
+            stopping = true;
+        }
+        job_ready.notify_all();
+        for (auto &t : workers) { t.join(); }
+        workers.clear();
+    }
+
+    void worker_loop(unsigned w, uint64_t seen) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(job_lock);
+                job_ready.wait(guard, [&]() { return stopping or generation != seen; });
+                if (stopping) { return; }
+                seen = generation;
+            }
+            work(w);
+            {
+                std::lock_guard<std::mutex> guard(job_lock);
+                --running;
+            }
+            job_done.notify_one();
+        }
+    }
+
+    //
+    //  Run chunks until there are none left anywhere
+    //
+    void work(unsigned w) {
+        size_t chunk;
+        while (next_chunk(w, chunk)) {
+            size_t begin = chunk * job_grain;
+            size_t end = std::min(job_n, begin + job_grain);
+            trace_scope trace("chunk", begin, end);
+            job(begin, end, w);
+        }
+    }
+
+    bool next_chunk(unsigned w, size_t &chunk) {
+        {
+            std::lock_guard<std::mutex> guard(ranges[w].lock);
+            if (ranges[w].begin < ranges[w].end) {
+                chunk = ranges[w].begin++;
+                return true;
+            }
+        }
+        //  steal the second half of what another worker has left
+        for (unsigned k = 1; k < threads; ++k) {
+            chunk_range &victim = ranges[(w + k) % threads];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                size_t left = victim.end - victim.begin;
+                if (left == 0) { continue; }
+                end = victim.end;
+                begin = end - (left + 1) / 2;
+                victim.end = begin;
+            }
+            std::lock_guard<std::mutex> guard(ranges[w].lock);
+            ranges[w].begin = begin + 1;
+            ranges[w].end = end;
+            chunk = begin;
+            return true;
+        }
+        return false;
+    }
+};
+
+//
+//  Split [0, n) into parts chunks of the same size and call
+//      f(begin, end, part)
+//  for each of them on the pool
+//
+//  For loops where every item costs about the same (computing keys, scattering during
+//  a sort, ...). The parts are fixed, whichever worker runs them, so f can keep a
+//  result per part (the digit counts of a radix sort) and use it again in a second
+//  loop over the same parts.
+//
+template <typename Function>
+void run_parts(task_pool &pool, size_t n, unsigned parts, Function f) {
+    if (parts == 0) { parts = 1; }
+    pool.run(parts, 1, [&f, n, parts](size_t begin, size_t end, unsigned) {
+        for (size_t p = begin; p < end; ++p) {
+            f(n * p / parts, n * (p + 1) / parts, (unsigned) p);
+        }
+    });
+}
+
+//
+//  Resize a pool between loops, over and over, and check that every loop runs each
+//  item exactly once and is done when run returns
+//
+inline bool test_pool_resize(bool verbose=true) {
+    task_pool pool(2);
+    const size_t n = 1000;
+    std::vector<unsigned> visits(n);
+    bool test_success = true;
+    for (int round = 0; round < 2000 and test_success; ++round) {
+        pool.set_threads(2 + round % 3);
+        std::fill(visits.begin(), visits.end(), 0u);
+        pool.run(n, 7, [&](size_t begin, size_t end, unsigned) {
+            for (size_t i = begin; i < end; ++i) { ++visits[i]; }
+        });
+        for (size_t i = 0; i < n; ++i) {
+            if (visits[i] != 1) {
+                test_success = false;
+                if (verbose) {
+                    std::cout << "pool with " << pool.size() << " threads ran item " << i << " "
+                              << visits[i] << " times in round " << round << std::endl;
+                }
+                break;
+            }
+        }
+    }
+    if (verbose) {
+        std::cout << "pool resize test " << (test_success ? "passed" : "failed") << std::endl;
+    }
+    return test_success;
+}
+
+//
+//  Pool shared by every phase of a step (the region, the build, the forces and the
+//  update, see compute_forces in forces.h), with all cores unless set_threads is
+//  called on it
+//
+inline task_pool &default_pool() {
+    static task_pool pool;
+    return pool;
+}
+
+#endif //TREE_CODE_PARALLEL_H
@@ -62,6 +62,12 @@ public:
         center = rhs.center;
         return *this;
     }
+    bool operator==(const region &rhs) const {
+        return min_corner == rhs.min_corner and max_corner == rhs.max_corner;
+    }
+    bool operator!=(const region &rhs) const {
+        return !(rhs == *this);
+    }
 
 
     point get_center() const { return center; }
@@ -133,34 +139,30 @@ public:
     //  This will be useful when we need to create new nodes of our trees
     //  todo: add tests for create_subregion
     //
-    // creating a pointer r and returning by reference saves an object destruction
-    region &create_subregion(Quadrant q) const {
+    // returned by value: the region is small, and handing back a reference to a
+    // heap allocated region leaked one region for every node we created
+    region create_subregion(Quadrant q) const {
         if (q == Quadrant::NW) {
             point new_min(min_corner.x, center.y);
             point new_max(center.x, max_corner.y);
-            region *r = new region(new_min, new_max);
-            return *r;
+            return region(new_min, new_max);
         }
         if (q == Quadrant::NE) {
             // northeast quadrant is easy to define with center and max corner
-            region *r = new region(center, max_corner);
-            return *r;
+            return region(center, max_corner);
         }
         if (q == Quadrant::SE) {
             point new_min(center.x, min_corner.y);
             point new_max(max_corner.x, center.y);
-            region *r = new region(new_min, new_max);
-            return *r;
+            return region(new_min, new_max);
         }
         if (q == Quadrant::SW) {
             // Southwest is easy to define with center and max corner
-            region *r = new region(min_corner, center);
-            return *r;
+            return region(min_corner, center);
         }
         std::cout << "this should never happen (in create_subregion)" << std::endl;
 
-        region *r = new region(0,0,0,0);
-        return *r; // this should never happen
+        return region(0,0,0,0); // this should never happen
     }
 
     region create_subregion(const point &p) const {
@@ -184,19 +186,28 @@ public:
 //
 //  Test that we are creating the center properly
 //
-void swap(double &a, double &b) {
+inline void swap(double &a, double &b) {
     double t = a;
     a = b;
     b = t;
 }
-double generate_random_in_range(double min, double max) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
+//
+//  Generator behind generate_random_in_range, seeded from random_device unless
+//  seed_random is called (runs that have to be repeated, see simulation.h)
+//
+inline std::mt19937 &random_engine() {
+    static std::mt19937 gen(std::random_device{}());
+    return gen;
+}
+inline void seed_random(unsigned seed) {
+    random_engine().seed(seed);
+}
+inline double generate_random_in_range(double min, double max) {
     // std::uniform_int_distribution<> create_random_number(-100, 100); // int number
     std::uniform_real_distribution<> create_random_number(min, max);
-    return create_random_number(gen);
+    return create_random_number(random_engine());
 }
-bool test_center_generated_single_test(bool verbose=true) {
+inline bool test_center_generated_single_test(bool verbose=true) {
     // generate random ranges
     double xmin = generate_random_in_range(-1000, 1000);
     double xmax = generate_random_in_range(-1000, 1000);
@@ -257,7 +268,7 @@ bool test_center_generated_single_test(bool verbose=true) {
 
     return test_success;
 }
-bool test_center_generated_correctly(bool verbose=true) {
+inline bool test_center_generated_correctly(bool verbose=true) {
     bool test_success = true;
     for (int i = 0; i < 1000; ++i) {
         if (!test_center_generated_single_test(verbose)){
@@ -273,7 +284,7 @@ bool test_center_generated_correctly(bool verbose=true) {
 //
 // todo: replace cout with ostream and return a tuple (bool, ostream) or just ostream
 //
-bool test_quadrants(bool verbose=true){
+inline bool test_quadrants(bool verbose=true){
     // Test NW
     point min(0, 0);
     point max(10, 10);
@@ -0,0 +1,304 @@
+//
+// Created on 10/17/26.
+//
+//  A simulation without a window
+//
+//  Holds everything the app keeps between frames (bodies, tree, FMM expansions,
+//  integrator) and steps the bodies with the same force function, so batch runs on a
+//  machine without a display (tools/nbody_run.cpp) give the same orbits as the app.
+//
+//      simulation sim;
+//      sim.generate(InitialConditions::TWO_GALAXIES, 20000, 2016);
+//      sim.step(100);
+//      std::cout << sim.get_time() << " " << sim.energy() << std::endl;
+//
+//  save() and resume() keep a run in a snapshot file (snapshot.h) and start it again
+//  from there, with any number of threads, on this machine or another one that runs
+//  the same build with the same kernels (see simulation::save).
+//
+//  Nothing here needs Cinder, the app adds drawing on top of the same headers.
+//
+
+#ifndef TREE_CODE_SIMULATION_H
+#define TREE_CODE_SIMULATION_H
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bh_tree.h"
+#include "body_builder.h"
+#include "body_store.h"
+#include "forces.h"
+#include "fmm.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "region.h"
+#include "snapshot.h"
+#include "timers.h"
+#include "trace.h"
+
+//
+//  Bodies generate() can create
+//
+//    TWO_GALAXIES : two disks turning opposite ways (create_two_galaxies), what the
+//                   app starts with
+//    DISK         : one disk around a black hole (many_bodies_test)
+//
+enum InitialConditions { TWO_GALAXIES, DISK };
+
+//
+//  solver, tree_mode, policy : see compute_forces in forces.h
+//  integration               : scheme, time step and block steps (integrator.h)
+//  count_interactions        : count the work of the walks, in total and for every
+//                              body (the interactions column of the store)
+//
+struct simulation_parameters {
+    Solver solver = Solver::BARNES_HUT;
+    TreeMode tree_mode = TreeMode::PERSISTENT;
+    region_policy policy;
+    integrator_parameters integration;
+    bool count_interactions = false;
+};
+
+class simulation {
+protected:
+    simulation_parameters params;
+
+    body_store bodies;
+    bh_tree tree;
+    fmm_solver fmm;
+    integrator stepper;
+
+    double time;    // simulated seconds since the bodies were set
+    size_t steps;   // steps since the bodies were set
+
+    //  with count_interactions, the work of the last step and of all steps
+    walk_counts step_counts, total_counts;
+
+    void restart() {
+        stepper.reset();
+        time = 0.0;
+        steps = 0;
+        step_counts = walk_counts();
+        total_counts = walk_counts();
+    }
+
+public:
+    explicit simulation(const simulation_parameters &p = simulation_parameters())
+            : params(p), stepper(p.integration), time(0.0), steps(0) {}
+
+    const simulation_parameters &get_parameters() const { return params; }
+    void set_parameters(const simulation_parameters &p) {
+        params = p;
+        stepper.set_parameters(p.integration);
+    }
+
+    //
+    //  New bodies, the clock starts again at 0
+    //
+    //  The same seed gives the same bodies (see seed_random in region.h)
+    //
+    void generate(InitialConditions ics, int num_bodies, unsigned seed) {
+        seed_random(seed);
+        if (ics == InitialConditions::TWO_GALAXIES) {
+            create_two_galaxies(bodies, region(-2.5e3, -2.5e3, 2.5e3, 2.5e3), num_bodies);
+        } else {
+            many_bodies_test(bodies, num_bodies);
+        }
+        restart();
+    }
+
+    //  bodies from a text file (see read_bodies in body_builder.h)
+    bool load(const std::string &path) {
+        const bool loaded = read_bodies(path, bodies);
+        restart();
+        return loaded;
+    }
+
+    void set_bodies(const body_store &b) {
+        bodies = b;
+        restart();
+    }
+
+    //
+    //  Move the bodies forward n steps of integration.dt
+    //
+    //  Every step is one frame of the phase timers (timers.h)
+    //
+    void step(size_t n = 1) {
+        bodies.count_interactions(params.count_interactions);
+        walk_counts *counts = params.count_interactions ? &step_counts : nullptr;
+        for (size_t s = 0; s < n; ++s) {
+            trace_scope trace("step");
+            step_counts = walk_counts();
+            stepper.block_step(bodies, [&](body_store &b, const std::vector<uint32_t> &active,
+                                           std::vector<point> &forces) {
+                compute_active_forces(b, active, forces, tree, fmm, params.solver, params.tree_mode, params.policy,
+                                      counts);
+            });
+            total_counts += step_counts;
+            time += stepper.get_parameters().dt;
+            ++steps;
+            default_timers().close_frame();
+        }
+    }
+
+    //
+    //  Snapshot of the run at this step, see snapshot.h
+    //
+    //  A resumed run gives the same bodies, bit for bit, as this run steps on to, with
+    //  every solver, when
+    //    - it runs with the same parameters (solver, tree mode, leaf size, walk,
+    //      softening, integrator, ...),
+    //    - it runs the same build with the same SIMD kernels (kernel.h picks them by
+    //      CPU, set NBODY_KERNEL to get the same ones on two machines).
+    //  The number of threads doesn't matter: the direct sum (direct.h) and the fitted
+    //  region (bounds.h) cut their sums into blocks that only depend on the number of
+    //  bodies, the walks and the FMM sum every body on its own. A persistent tree
+    //  depends on every step it was refit in, so the file keeps the tree as well
+    //  (tree_state in bh_tree.h) and the resumed run refits the same one. Saving
+    //  only reads the run, it steps on the same with or without snapshots.
+    //
+    bool save(const std::string &path) {
+        snapshot s;
+        capture_snapshot(bodies, stepper, time, steps, s, &tree);
+        return write_snapshot(s.view(), path);
+    }
+
+    //  the same, written on the thread of writer, step() can go on at once (false when
+    //  the writer is too far behind and skips it, see snapshot_writer)
+    bool save_async(const std::string &path, snapshot_writer &writer = default_snapshot_writer()) {
+        return writer.save(path, bodies, stepper, time, steps, &tree);
+    }
+
+    //
+    //  Go on from a snapshot: its bodies, clock, time step, forces and tree. The other
+    //  parameters stay as they are, they have to be those of the run that saved it.
+    //  Without a tree in the file, the next step builds one.
+    //
+    bool resume(const std::string &path) {
+        mapped_snapshot file;
+        if (!file.open(path)) {
+            return false;
+        }
+        const snapshot_view &s = file.view();
+        restore_snapshot(s, bodies, stepper);
+        params.integration = stepper.get_parameters();
+        time = s.header.time;
+        steps = (size_t) s.header.steps;
+        step_counts = walk_counts();
+        total_counts = walk_counts();
+        if (s.tree == nullptr or !tree.set_state(*s.tree, bodies)) {
+            tree.clear();
+        }
+        tree.set_previous_accelerations(bodies, stepper.get_forces());
+        return true;
+    }
+
+    const body_store &get_bodies() const { return bodies; }
+    double get_time() const { return time; }
+    size_t get_steps() const { return steps; }
+    const bh_tree &get_tree() const { return tree; }
+    const fmm_solver &get_fmm() const { return fmm; }
+    const integrator &get_integrator() const { return stepper; }
+    const step_timers &get_timers() const { return default_timers(); }
+
+    //
+    //  Work of the walks (with count_interactions), the cost of every single body is in
+    //  the interactions column of get_bodies()
+    //
+    const walk_counts &get_step_counts() const { return step_counts; }
+    const walk_counts &get_total_counts() const { return total_counts; }
+
+    //  interactions per second of force computation in the last step
+    double interactions_per_second() const {
+        const double seconds = default_timers().get(Phase::FORCES).last();
+        const uint64_t interactions = step_counts.node_interactions + step_counts.body_interactions;
+        return seconds > 0.0 ? interactions / seconds : 0.0;
+    }
+
+    //
+    //  Total energy (kinetic + potential) of the bodies
+    //
+    //  The potential is summed over all pairs with the Plummer softening of the tree,
+    //  O(N^2) like the direct solver: a check on the integration (it should stay
+    //  nearly constant), not something to call every step of a large run.
+    //
+    double kinetic_energy() const {
+        double sum = 0.0;
+        for (size_t i = 0; i < bodies.size(); ++i) {
+            sum += 0.5 * bodies.mass()[i] * (bodies.vx()[i] * bodies.vx()[i] + bodies.vy()[i] * bodies.vy()[i]);
+        }
+        return sum;
+    }
+
+    double potential_energy(task_pool &pool = default_pool()) const {
+        const size_t n = bodies.size();
+        const double *x = bodies.x(), *y = bodies.y(), *m = bodies.mass();
+        const double h_2 = tree.get_softening().length * tree.get_softening().length;
+        std::vector<double> sums(pool.size(), 0.0);
+        pool.run(n, 64, [&](size_t begin, size_t end, unsigned worker) {
+            double sum = 0.0;
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t j = i + 1; j < n; ++j) {
+                    const double dx = x[j] - x[i], dy = y[j] - y[i];
+                    sum -= gravity_G * m[i] * m[j] / std::sqrt(dx * dx + dy * dy + h_2);
+                }
+            }
+            sums[worker] += sum;
+        });
+        double sum = 0.0;
+        for (double s : sums) { sum += s; }
+        return sum;
+    }
+
+    double energy() const {
+        return kinetic_energy() + potential_energy();
+    }
+};
+
+//
+//  Save a run with a persistent tree halfway, and check that the saving run, a run
+//  that never saved and a run resumed from the file (on another number of threads)
+//  end with the same bodies, bit for bit
+//
+inline bool test_snapshot_restart(bool verbose=true) {
+    const std::string path = "restart_check.nbs";
+    const unsigned threads = default_pool().size();
+    simulation saved, plain, resumed;
+    saved.generate(InitialConditions::TWO_GALAXIES, 12000, 2016);
+    plain.generate(InitialConditions::TWO_GALAXIES, 12000, 2016);
+    saved.step(4);
+    bool test_success = saved.save(path);
+    saved.step(4);
+    plain.step(8);
+    default_pool().set_threads(threads == 1 ? 2 : 1);
+    test_success = test_success and resumed.resume(path);
+    resumed.step(4);
+    default_pool().set_threads(threads);
+    std::remove(path.c_str());
+
+    const body_store *runs[] = { &plain.get_bodies(), &resumed.get_bodies() };
+    const char *names[] = { "a run without snapshots", "the resumed run" };
+    const body_store &a = saved.get_bodies();
+    for (int r = 0; r < 2 and test_success; ++r) {
+        const body_store &b = *runs[r];
+        test_success = a.size() == b.size();
+        for (size_t i = 0; i < a.size() and test_success; ++i) {
+            test_success = a.x()[i] == b.x()[i] and a.y()[i] == b.y()[i]
+                           and a.vx()[i] == b.vx()[i] and a.vy()[i] == b.vy()[i];
+        }
+        if (!test_success and verbose) {
+            std::cout << "saving run and " << names[r] << " moved the bodies differently" << std::endl;
+        }
+    }
+    if (verbose) {
+        std::cout << "snapshot restart test " << (test_success ? "passed" : "failed") << std::endl;
+    }
+    return test_success;
+}
+
+#endif //TREE_CODE_SIMULATION_H
@@ -0,0 +1,687 @@
+//
+// Created on 10/17/26.
+//
+//  Snapshots of a run, to start it again later from where it was
+//
+//  A snapshot file is a header and one contiguous array per quantity, little endian
+//  doubles, so loading it is a memory mapping and a few pointers (mapped_snapshot),
+//  nothing to parse. It holds everything a step depends on: the bodies, the clock,
+//  the time step, the forces the integrator keeps between steps and the tree a refit
+//  goes on from (tree_state in bh_tree.h). Starting from a
+//  snapshot gives the same bodies, bit for bit, as the run that wrote it, with
+//  the same parameters and SIMD kernels, with any number of threads (see
+//  simulation::save).
+//
+//      sim.save("galaxies.nbs");
+//      ...
+//      simulation later;
+//      later.resume("galaxies.nbs");
+//
+//  Writing a large snapshot takes a while, snapshot_writer does it on a thread of its
+//  own: the step loop only copies the arrays (no disk) and goes on.
+//
+//  Layout of a file (version 1)
+//
+//      offset  size
+//           0     8  magic "NBODYSNP"
+//           8     4  version
+//          12     4  header bytes (64, where the first column starts)
+//          16     8  bodies
+//          24     8  steps since the start of the run
+//          32     8  time (seconds since the start of the run)
+//          40     8  time step
+//          48     4  flags (snapshot_flags)
+//          52     4  columns
+//          56     8  0
+//          64        mass, x, y, vx, vy, then softening and fx, fy when the flags
+//                    say so, every column bodies doubles
+//
+//  then, with HAS_TREE, the tree (every part padded to 8 bytes)
+//
+//          10 x 8    nodes, slots, bodies, empty leaves, bodies relocated and nodes
+//                    right after the last build, then the region xmin, ymin, xmax,
+//                    ymax (doubles)
+//                    nodes doubles each: xmin, ymin, xmax, ymax, x, y, mass
+//                    nodes uint32 each: the children NW, NE, SE, SW, parent, first
+//                    slot, bodies, slot capacity, depth, state
+//                    slots doubles each: x, y, mass, softening
+//                    slots uint32: body
+//
+
+#ifndef TREE_CODE_SNAPSHOT_H
+#define TREE_CODE_SNAPSHOT_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <iterator>
+#endif
+
+#include "bh_tree.h"
+#include "body_store.h"
+#include "integrator.h"
+#include "point.h"
+
+const char snapshot_magic[8] = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+const uint32_t snapshot_version = 1;
+const uint32_t snapshot_header_bytes = 64;
+
+//
+//  Optional columns of a snapshot
+//
+//    HAS_SOFTENING  : softening length of every body (body_store::use_softening)
+//    HAS_FORCES     : forces the integrator kept (integrator::get_forces)
+//    FORCES_CURRENT : the forces belong to the positions (after a leapfrog step)
+//    HAS_TREE       : the tree of the last step, after the columns
+//
+enum snapshot_flags : uint32_t { HAS_SOFTENING = 1, HAS_FORCES = 2, FORCES_CURRENT = 4, HAS_TREE = 8 };
+
+inline uint32_t snapshot_columns(uint32_t flags) {
+    return 5 + ((flags & HAS_SOFTENING) ? 1 : 0) + ((flags & HAS_FORCES) ? 2 : 0);
+}
+
+struct snapshot_header {
+    uint64_t bodies = 0;
+    uint64_t steps = 0;
+    double time = 0.0;
+    double dt = 0.0;
+    uint32_t flags = 0;
+};
+
+//
+//  A snapshot in memory, wherever its arrays are (nullptr for a column it doesn't have)
+//
+struct snapshot_view {
+    snapshot_header header;
+    const double *mass = nullptr, *x = nullptr, *y = nullptr, *vx = nullptr, *vy = nullptr;
+    const double *softening = nullptr;
+    const double *fx = nullptr, *fy = nullptr;
+    const tree_state *tree = nullptr;
+
+    //  column k in the order of the file
+    const double *column(uint32_t k) const {
+        const double *columns[] = { mass, x, y, vx, vy, softening, fx, fy };
+        if (k >= 5 and !(header.flags & HAS_SOFTENING)) { ++k; }
+        return columns[k];
+    }
+};
+
+//
+//  A snapshot with arrays of its own, what capture_snapshot fills in
+//
+struct snapshot {
+    snapshot_header header;
+    std::vector<double> mass, x, y, vx, vy, softening, fx, fy;
+    tree_state tree;
+
+    snapshot_view view() const {
+        snapshot_view v;
+        v.header = header;
+        v.mass = mass.data(); v.x = x.data(); v.y = y.data(); v.vx = vx.data(); v.vy = vy.data();
+        if (header.flags & HAS_SOFTENING) { v.softening = softening.data(); }
+        if (header.flags & HAS_FORCES) { v.fx = fx.data(); v.fy = fy.data(); }
+        if (header.flags & HAS_TREE) { v.tree = &tree; }
+        return v;
+    }
+};
+
+//
+//  Little endian encoding, whatever the byte order of the machine
+//
+inline bool little_endian_host() {
+    const uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+inline void put_u32(unsigned char *p, uint32_t v) {
+    for (int k = 0; k < 4; ++k) { p[k] = (unsigned char) (v >> (8 * k)); }
+}
+inline void put_u64(unsigned char *p, uint64_t v) {
+    for (int k = 0; k < 8; ++k) { p[k] = (unsigned char) (v >> (8 * k)); }
+}
+inline void put_f64(unsigned char *p, double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, 8);
+    put_u64(p, bits);
+}
+inline uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int k = 0; k < 4; ++k) { v |= (uint32_t) p[k] << (8 * k); }
+    return v;
+}
+inline uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int k = 0; k < 8; ++k) { v |= (uint64_t) p[k] << (8 * k); }
+    return v;
+}
+inline double get_f64(const unsigned char *p) {
+    const uint64_t bits = get_u64(p);
+    double v;
+    std::memcpy(&v, &bits, 8);
+    return v;
+}
+
+//
+//  Tree section (see the layout above)
+//
+const size_t snapshot_tree_words = 10;
+
+inline size_t padded_to_8(size_t bytes) { return (bytes + 7) / 8 * 8; }
+
+inline size_t tree_section_bytes(size_t nodes, size_t slots) {
+    return 8 * snapshot_tree_words + nodes * 7 * 8 + padded_to_8(nodes * 10 * 4) + slots * 4 * 8
+           + padded_to_8(slots * 4);
+}
+
+inline void encode_tree(const tree_state &t, std::vector<unsigned char> &out) {
+    const size_t nodes = t.nodes.size(), slots = t.slots.size();
+    out.assign(tree_section_bytes(nodes, slots), 0);
+    unsigned char *p = out.data();
+    const point lo = t.global_region.get_min_corner(), hi = t.global_region.get_max_corner();
+    const uint64_t counts[] = { nodes, slots, t.body_count, t.empty_leaves, t.relocated_since_build,
+                                t.nodes_at_build };
+    for (uint64_t c : counts) { put_u64(p, c); p += 8; }
+    for (double v : { lo.x, lo.y, hi.x, hi.y }) { put_f64(p, v); p += 8; }
+
+    for (int k = 0; k < 7; ++k) {
+        for (const bh_tree_node &node : t.nodes) {
+            const region &r = node.get_region();
+            const double values[] = { r.get_min_corner().x, r.get_min_corner().y, r.get_max_corner().x,
+                                      r.get_max_corner().y, node.get_position().x, node.get_position().y,
+                                      node.get_mass() };
+            put_f64(p, values[k]);
+            p += 8;
+        }
+    }
+    unsigned char *q = p;
+    for (int k = 0; k < 10; ++k) {
+        for (const bh_tree_node &node : t.nodes) {
+            const uint32_t values[] = { node.get_nw(), node.get_ne(), node.get_se(), node.get_sw(),
+                                        node.get_parent(), node.get_first_slot(), node.get_body_count(),
+                                        node.get_slot_capacity(), (uint32_t) node.get_depth(),
+                                        (uint32_t) node.get_state() };
+            put_u32(q, values[k]);
+            q += 4;
+        }
+    }
+    p += padded_to_8(nodes * 10 * 4);
+
+    for (int k = 0; k < 4; ++k) {
+        for (const leaf_entry &e : t.slots) {
+            const double values[] = { e.position.x, e.position.y, e.mass, (double) e.softening };
+            put_f64(p, values[k]);
+            p += 8;
+        }
+    }
+    for (const leaf_entry &e : t.slots) {
+        put_u32(p, e.body);
+        p += 4;
+    }
+}
+
+//  false when the bytes are too few for the tree they say they hold
+inline bool decode_tree(const unsigned char *p, size_t bytes, tree_state &t) {
+    if (bytes < 8 * snapshot_tree_words) {
+        return false;
+    }
+    const uint64_t nodes = get_u64(p), slots = get_u64(p + 8);
+    if (nodes > bytes / (7 * 8) or slots > bytes / (4 * 8)
+        or tree_section_bytes((size_t) nodes, (size_t) slots) > bytes) {
+        return false;
+    }
+    t.body_count = (uint32_t) get_u64(p + 16);
+    t.empty_leaves = (uint32_t) get_u64(p + 24);
+    t.relocated_since_build = (uint32_t) get_u64(p + 32);
+    t.nodes_at_build = get_u64(p + 40);
+    t.global_region = region(get_f64(p + 48), get_f64(p + 56), get_f64(p + 64), get_f64(p + 72));
+    p += 8 * snapshot_tree_words;
+
+    const size_t n = (size_t) nodes;
+    const unsigned char *f = p, *u = p + n * 7 * 8;
+    t.nodes.clear();
+    t.nodes.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        double d[7];
+        uint32_t w[10];
+        for (int k = 0; k < 7; ++k) { d[k] = get_f64(f + 8 * (k * n + i)); }
+        for (int k = 0; k < 10; ++k) { w[k] = get_u32(u + 4 * (k * n + i)); }
+        t.nodes.push_back(bh_tree_node(region(d[0], d[1], d[2], d[3]), point(d[4], d[5]), d[6], w, w[4],
+                                       w[5], w[6], w[7], (int) w[8],
+                                       w[9] == NodeState::LEAF ? NodeState::LEAF : NodeState::CONGLOMERATE));
+    }
+    p += n * 7 * 8 + padded_to_8(n * 10 * 4);
+
+    const size_t m = (size_t) slots;
+    t.slots.resize(m);
+    for (size_t i = 0; i < m; ++i) {
+        leaf_entry &e = t.slots[i];
+        e.position = point(get_f64(p + 8 * i), get_f64(p + 8 * (m + i)));
+        e.mass = get_f64(p + 8 * (2 * m + i));
+        e.softening = (float) get_f64(p + 8 * (3 * m + i));
+        e.body = get_u32(p + 8 * 4 * m + 4 * i);
+    }
+    return true;
+}
+
+//
+//  Copy the state of a run into s (its arrays are reused, no allocation once they are
+//  large enough), with the tree of the last step when there is one
+//
+inline void capture_snapshot(const body_store &bodies, const integrator &stepper, double time, size_t steps,
+                             snapshot &s, const bh_tree *tree = nullptr) {
+    const size_t n = bodies.size();
+    s.header.bodies = n;
+    s.header.steps = steps;
+    s.header.time = time;
+    s.header.dt = stepper.get_parameters().dt;
+    s.header.flags = 0;
+    s.mass.assign(bodies.mass(), bodies.mass() + n);
+    s.x.assign(bodies.x(), bodies.x() + n);
+    s.y.assign(bodies.y(), bodies.y() + n);
+    s.vx.assign(bodies.vx(), bodies.vx() + n);
+    s.vy.assign(bodies.vy(), bodies.vy() + n);
+    if (bodies.has_softening()) {
+        s.header.flags |= HAS_SOFTENING;
+        s.softening.assign(bodies.softening(), bodies.softening() + n);
+    }
+    const std::vector<point> &forces = stepper.get_forces();
+    if (forces.size() == n and n > 0) {
+        s.header.flags |= HAS_FORCES;
+        if (stepper.has_current_forces()) { s.header.flags |= FORCES_CURRENT; }
+        s.fx.resize(n);
+        s.fy.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            s.fx[i] = forces[i].x;
+            s.fy[i] = forces[i].y;
+        }
+    }
+    if (tree != nullptr and !tree->is_empty()) {
+        s.header.flags |= HAS_TREE;
+        tree->get_state(s.tree);
+    }
+}
+
+//
+//  Put the state of a snapshot back: the bodies (the columns the store tracks, like
+//  last positions, start again from the snapshot), the time step and the forces of
+//  the integrator. The clock is in s.header.
+//
+inline void restore_snapshot(const snapshot_view &s, body_store &bodies, integrator &stepper) {
+    const size_t n = (size_t) s.header.bodies;
+    bodies.clear();
+    bodies.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        bodies.add(s.mass[i], point(s.x[i], s.y[i]), point(s.vx[i], s.vy[i]));
+    }
+    if (s.softening != nullptr) {
+        bodies.use_softening(true, gravity_epsilon);
+        std::copy(s.softening, s.softening + n, bodies.softening());
+    } else {
+        bodies.use_softening(false, gravity_epsilon);
+    }
+
+    integrator_parameters params = stepper.get_parameters();
+    params.dt = s.header.dt;
+    stepper.set_parameters(params);
+    if (s.fx != nullptr) {
+        std::vector<point> forces(n);
+        for (size_t i = 0; i < n; ++i) { forces[i] = point(s.fx[i], s.fy[i]); }
+        stepper.set_forces(forces, (s.header.flags & FORCES_CURRENT) != 0);
+    } else {
+        stepper.set_forces(std::vector<point>(), false);
+    }
+}
+
+//
+//  Write a snapshot to path
+//
+//  The file is written next to path and renamed when it is complete, so path is
+//  always either the old snapshot or the new one, never half of one.
+//
+inline bool write_snapshot(const snapshot_view &s, const std::string &path) {
+    const uint32_t flags = s.tree != nullptr ? s.header.flags : s.header.flags & ~(uint32_t) HAS_TREE;
+    unsigned char header[snapshot_header_bytes] = {};
+    std::memcpy(header, snapshot_magic, 8);
+    put_u32(header + 8, snapshot_version);
+    put_u32(header + 12, snapshot_header_bytes);
+    put_u64(header + 16, s.header.bodies);
+    put_u64(header + 24, s.header.steps);
+    put_f64(header + 32, s.header.time);
+    put_f64(header + 40, s.header.dt);
+    put_u32(header + 48, flags);
+    put_u32(header + 52, snapshot_columns(flags));
+
+    const std::string partial = path + ".part";
+    {
+        std::ofstream file(partial, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cout << "can't write " << partial << std::endl;
+            return false;
+        }
+        file.write((const char *) header, snapshot_header_bytes);
+        const size_t n = (size_t) s.header.bodies;
+        const bool swap = !little_endian_host();
+        std::vector<unsigned char> swapped(swap ? n * 8 : 0);
+        for (uint32_t k = 0; k < snapshot_columns(s.header.flags); ++k) {
+            const double *column = s.column(k);
+            if (swap) {
+                for (size_t i = 0; i < n; ++i) { put_f64(swapped.data() + 8 * i, column[i]); }
+                file.write((const char *) swapped.data(), (std::streamsize) (n * 8));
+            } else {
+                file.write((const char *) column, (std::streamsize) (n * 8));
+            }
+        }
+        if (flags & HAS_TREE) {
+            std::vector<unsigned char> section;
+            encode_tree(*s.tree, section);
+            file.write((const char *) section.data(), (std::streamsize) section.size());
+        }
+        if (!file) {
+            std::cout << "can't write " << partial << std::endl;
+            return false;
+        }
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (std::rename(partial.c_str(), path.c_str()) != 0) {
+        std::cout << "can't rename " << partial << " to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//
+//  A snapshot file mapped into memory
+//
+//  On a little endian machine the columns of view() point straight into the mapping,
+//  pages are only read when restore_snapshot touches them. Elsewhere (Windows, big
+//  endian) the file is read and converted into arrays of its own.
+//
+class mapped_snapshot {
+protected:
+    const unsigned char *data;
+    size_t bytes;
+    bool mapped;
+    std::vector<unsigned char> contents;   // the file, when it isn't mapped
+    std::vector<double> columns;           // converted columns, when the bytes can't be used as they are
+    tree_state tree;                       // the tree, always decoded (it isn't doubles only)
+    snapshot_view v;
+
+    void unmap() {
+#ifndef _WIN32
+        if (mapped) { munmap((void *) data, bytes); }
+#endif
+        data = nullptr;
+        bytes = 0;
+        mapped = false;
+        contents.clear();
+        columns.clear();
+        v = snapshot_view();
+    }
+
+    bool map_file(const std::string &path) {
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 or info.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        data = (const unsigned char *) p;
+        bytes = (size_t) info.st_size;
+        mapped = true;
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = contents.data();
+        bytes = contents.size();
+        return true;
+#endif
+    }
+
+public:
+    mapped_snapshot() : data(nullptr), bytes(0), mapped(false) {}
+    explicit mapped_snapshot(const std::string &path) : mapped_snapshot() { open(path); }
+    ~mapped_snapshot() { unmap(); }
+
+    mapped_snapshot(const mapped_snapshot &) = delete;
+    mapped_snapshot &operator=(const mapped_snapshot &) = delete;
+
+    //
+    //  Map the file at path, false (and a message) when it isn't a snapshot this
+    //  version can read
+    //
+    bool open(const std::string &path) {
+        unmap();
+        if (!map_file(path)) {
+            std::cout << "can't read " << path << std::endl;
+            return false;
+        }
+        if (bytes < snapshot_header_bytes or std::memcmp(data, snapshot_magic, 8) != 0) {
+            std::cout << path << " is not a snapshot" << std::endl;
+            unmap();
+            return false;
+        }
+        const uint32_t version = get_u32(data + 8);
+        const uint32_t offset = get_u32(data + 12);
+        if (version != snapshot_version or offset < snapshot_header_bytes or offset % 8 != 0 or offset > bytes) {
+            std::cout << path << " is a snapshot of version " << version << ", can only read version "
+                      << snapshot_version << std::endl;
+            unmap();
+            return false;
+        }
+        v.header.bodies = get_u64(data + 16);
+        v.header.steps = get_u64(data + 24);
+        v.header.time = get_f64(data + 32);
+        v.header.dt = get_f64(data + 40);
+        v.header.flags = get_u32(data + 48);
+        const uint32_t count = snapshot_columns(v.header.flags);
+        const uint64_t n = v.header.bodies;
+        if (get_u32(data + 52) != count or n > (bytes - offset) / 8 / count) {
+            std::cout << path << " is truncated" << std::endl;
+            unmap();
+            return false;
+        }
+
+        const double *first = (const double *) (data + offset);
+        if (!little_endian_host()) {
+            columns.resize((size_t) (n * count));
+            for (size_t i = 0; i < columns.size(); ++i) { columns[i] = get_f64(data + offset + 8 * i); }
+            first = columns.data();
+        }
+        const double **targets[] = { &v.mass, &v.x, &v.y, &v.vx, &v.vy, &v.softening, &v.fx, &v.fy };
+        uint32_t k = 0;
+        for (uint32_t t = 0; t < 8; ++t) {
+            if (t == 5 and !(v.header.flags & HAS_SOFTENING)) { continue; }
+            if (t >= 6 and !(v.header.flags & HAS_FORCES)) { continue; }
+            *targets[t] = first + (size_t) n * k++;
+        }
+        if (v.header.flags & HAS_TREE) {
+            const size_t tree_offset = offset + (size_t) n * count * 8;
+            if (!decode_tree(data + tree_offset, bytes - tree_offset, tree)) {
+                std::cout << path << " is truncated" << std::endl;
+                unmap();
+                return false;
+            }
+            v.tree = &tree;
+        }
+        return true;
+    }
+
+    bool is_open() const { return data != nullptr; }
+    const snapshot_view &view() const { return v; }
+};
+
+//
+//  Writes snapshots on a thread of its own
+//
+//  save() copies the state into a buffer and hands it to the thread, the caller never
+//  waits for the disk. Snapshots are written in the order they came in. A snapshot
+//  that is still waiting when a newer one for the same file comes in is replaced by
+//  it (and counted as skipped, that file only ever holds the newest); snapshots for
+//  other files wait their turn. At most snapshot_queue_limit of them wait: when the
+//  disk can't keep up, save() for yet another file is skipped (and counted) instead
+//  of holding one more copy of the run in memory, so the writer never holds more
+//  than snapshot_queue_limit + 1 snapshots plus the spares. Written buffers are kept
+//  for the next save(), so once they are large enough a snapshot costs a copy of the
+//  arrays and no allocation. flush() waits until everything handed in is on disk.
+//
+const size_t snapshot_queue_limit = 4;
+const size_t snapshot_spares = 2;
+
+class snapshot_writer {
+protected:
+    struct job {
+        std::string path;
+        snapshot data;
+    };
+
+    std::mutex lock;
+    std::condition_variable wake, idle;
+    std::deque<job> queue;            // waiting to be written, oldest first
+    std::vector<snapshot> spares;     // buffers of written snapshots
+    bool busy, stopping;
+    size_t written, skipped, failed;
+    std::thread worker;
+
+    //  called with lock held
+    bool is_queued(const std::string &path) const {
+        return std::any_of(queue.begin(), queue.end(), [&](const job &j) { return j.path == path; });
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return !queue.empty() or stopping; });
+            if (queue.empty()) {
+                return;
+            }
+            job next = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+            guard.unlock();
+            const bool ok = write_snapshot(next.data.view(), next.path);
+            guard.lock();
+            busy = false;
+            if (ok) { ++written; } else { ++failed; }
+            if (spares.size() < snapshot_spares) { spares.push_back(std::move(next.data)); }
+            idle.notify_all();
+        }
+    }
+
+public:
+    snapshot_writer() : busy(false), stopping(false), written(0), skipped(0), failed(0),
+                        worker(&snapshot_writer::run, this) {}
+
+    //  writes what is still waiting, then stops the thread
+    ~snapshot_writer() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    snapshot_writer(const snapshot_writer &) = delete;
+    snapshot_writer &operator=(const snapshot_writer &) = delete;
+
+    //
+    //  the state of a run, to be written to path (see capture_snapshot), false when it
+    //  is skipped because snapshot_queue_limit snapshots for other files are waiting
+    //
+    bool save(const std::string &path, const body_store &bodies, const integrator &stepper, double time,
+              size_t steps, const bh_tree *tree = nullptr) {
+        snapshot copy;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (queue.size() >= snapshot_queue_limit and !is_queued(path)) {
+                ++skipped;
+                return false;
+            }
+            if (!spares.empty()) {
+                copy = std::move(spares.back());
+                spares.pop_back();
+            }
+        }
+        capture_snapshot(bodies, stepper, time, steps, copy, tree);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto same = std::find_if(queue.begin(), queue.end(), [&](const job &j) { return j.path == path; });
+            if (same != queue.end()) {
+                ++skipped;
+                std::swap(same->data, copy);
+                if (spares.size() < snapshot_spares) { spares.push_back(std::move(copy)); }
+            } else if (queue.size() >= snapshot_queue_limit) {
+                ++skipped; // filled up by another thread while copying
+                if (spares.size() < snapshot_spares) { spares.push_back(std::move(copy)); }
+                return false;
+            } else {
+                queue.push_back(job{ path, std::move(copy) });
+            }
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    //  wait until every snapshot handed to save() is written
+    void flush() {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return queue.empty() and !busy; });
+    }
+
+    size_t get_written() {
+        std::lock_guard<std::mutex> guard(lock);
+        return written;
+    }
+    size_t get_skipped() {
+        std::lock_guard<std::mutex> guard(lock);
+        return skipped;
+    }
+    size_t get_failed() {
+        std::lock_guard<std::mutex> guard(lock);
+        return failed;
+    }
+};
+
+//
+//  Writer of the run, like default_pool
+//
+inline snapshot_writer &default_snapshot_writer() {
+    static snapshot_writer writer;
+    return writer;
+}
+
+#endif //TREE_CODE_SNAPSHOT_H
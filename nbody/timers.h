@@ -0,0 +1,164 @@
+//
+// Created on 10/17/26.
+//
+//  Wall time of the phases of a step
+//
+//  A scoped_timer adds the wall time of its scope to one phase. Every frame (a step of
+//  the simulation, or a frame of the app) close_frame keeps the total of every phase
+//  in a window of the last timer_window frames, and the mean, median and 99th
+//  percentile come from that window, so a slow phase shows up at once and one slow
+//  frame does not hide the others.
+//
+//      {
+//          scoped_timer timer(Phase::TREE_BUILD);
+//          tree.build(bodies);
+//      }
+//      ...
+//      default_timers().close_frame();
+//
+//  The timers are always on, a timer is two reads of steady_clock. When tracing is on
+//  (trace.h) every timer is also an event of the trace. They are only used
+//  from the thread that drives the step (the phases split their work over the pool
+//  themselves), so they need no locks.
+//
+
+#ifndef TREE_CODE_TIMERS_H
+#define TREE_CODE_TIMERS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "trace.h"
+
+//
+//  The phases of a step
+//
+//    TREE_BUILD : bodies into the tree (bh_tree::build, refit_or_build)
+//    MOMENTS    : masses and centers of mass of the nodes (bh_tree::update)
+//    FORCES     : force walk, FMM or direct sum
+//    INTEGRATE  : kicks and drifts (integrator.h)
+//    DRAW       : drawing the bodies (the app only)
+//
+enum Phase { TREE_BUILD, MOMENTS, FORCES, INTEGRATE, DRAW };
+const int phase_count = 5;
+
+inline const char *phase_name(Phase phase) {
+    static const char *names[phase_count] = { "build", "moments", "forces", "integrate", "draw" };
+    return names[phase];
+}
+
+//
+//  Frames kept for the statistics
+//
+const size_t timer_window = 120;
+
+//
+//  Time of one phase in the last frames (seconds)
+//
+class rolling_timer {
+protected:
+    std::vector<double> frames;   // ring of the last timer_window frames
+    size_t next;                  // where the next frame goes
+    double pending;               // time of the current frame so far
+
+public:
+    rolling_timer() : next(0), pending(0.0) {}
+
+    void add(double seconds) { pending += seconds; }
+
+    void close_frame() {
+        if (frames.size() < timer_window) {
+            frames.push_back(pending);
+        } else {
+            frames[next] = pending;
+        }
+        next = (next + 1) % timer_window;
+        pending = 0.0;
+    }
+
+    size_t size() const { return frames.size(); }
+
+    double last() const {
+        return frames.empty() ? 0.0 : frames[(next + timer_window - 1) % timer_window];
+    }
+
+    double mean() const {
+        if (frames.empty()) {
+            return 0.0;
+        }
+        double sum = 0.0;
+        for (double t : frames) { sum += t; }
+        return sum / frames.size();
+    }
+
+    //  p in [0, 1], p = 0.5 is the median
+    double percentile(double p) const {
+        if (frames.empty()) {
+            return 0.0;
+        }
+        std::vector<double> sorted(frames);
+        const size_t k = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+//
+//  One rolling_timer per phase
+//
+class step_timers {
+protected:
+    rolling_timer phases[phase_count];
+
+public:
+    void add(Phase phase, double seconds) { phases[phase].add(seconds); }
+
+    //  the end of a step or frame, phases that did not run count as 0
+    void close_frame() {
+        for (rolling_timer &timer : phases) { timer.close_frame(); }
+    }
+
+    const rolling_timer &get(Phase phase) const { return phases[phase]; }
+
+    //  mean time of a whole frame, all phases
+    double frame_mean() const {
+        double sum = 0.0;
+        for (const rolling_timer &timer : phases) { sum += timer.mean(); }
+        return sum;
+    }
+};
+
+//
+//  Timers shared by the force and integration functions (forces.h, integrator.h),
+//  like default_pool
+//
+inline step_timers &default_timers() {
+    static step_timers timers;
+    return timers;
+}
+
+//
+//  Adds the wall time from its construction to its destruction to a phase (and records
+//  it in the trace)
+//
+class scoped_timer {
+protected:
+    Phase phase;
+    step_timers &timers;
+    std::chrono::steady_clock::time_point start;
+    trace_scope trace;
+
+public:
+    explicit scoped_timer(Phase p, step_timers &t = default_timers())
+            : phase(p), timers(t), start(std::chrono::steady_clock::now()), trace(phase_name(p)) {}
+    ~scoped_timer() {
+        timers.add(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    scoped_timer(const scoped_timer &) = delete;
+    scoped_timer &operator=(const scoped_timer &) = delete;
+};
+
+#endif //TREE_CODE_TIMERS_H
@@ -0,0 +1,229 @@
+//
+// Created on 10/17/26.
+//
+//  Timeline of a run in the Chrome trace event format
+//
+//  The phase timers (timers.h) give the time of a phase over many frames, a trace shows
+//  every single one of them: when each phase of each step started and ended, and which
+//  worker of the pool ran which chunk of a loop. That is where stalls, threads that
+//  finish late and the one step that took ten times longer show up. Open the file in
+//  chrome://tracing or ui.perfetto.dev.
+//
+//      default_tracer().start();
+//      sim.step(20);
+//      default_tracer().stop();
+//      default_tracer().write("nbody_trace.json");
+//
+//  Every thread records into a ring buffer of its own (trace_capacity events, the
+//  oldest are overwritten), so recording takes no lock and threads don't share cache
+//  lines. A buffer is only written by its thread, write() reads them after stop().
+//
+//  Tracing is off unless start() is called. A trace_scope then costs one load of the
+//  flag, and a branch on it that always goes the same way.
+//
+
+#ifndef TREE_CODE_TRACE_H
+#define TREE_CODE_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//
+//  Events kept per thread
+//
+const size_t trace_capacity = 1 << 16;
+
+//
+//  One complete event (begin and end), times in nanoseconds since start()
+//
+//  name has to outlive the trace (a string literal), begin and end are the range of
+//  items of a loop chunk, 0 for other events
+//
+struct trace_event {
+    const char *name;
+    int64_t start_ns, end_ns;
+    uint64_t begin, end;
+};
+
+//
+//  Ring of the events of one thread
+//
+class trace_buffer {
+protected:
+    std::unique_ptr<trace_event[]> events;
+    size_t capacity;
+    std::atomic<uint64_t> written;   // events recorded since start()
+    uint32_t thread;
+
+public:
+    trace_buffer(size_t c, uint32_t t) : events(new trace_event[c]), capacity(c), written(0), thread(t) {}
+
+    uint32_t get_thread() const { return thread; }
+
+    //  only called by the thread of the buffer
+    void record(const trace_event &e) {
+        const uint64_t w = written.load(std::memory_order_relaxed);
+        events[w % capacity] = e;
+        written.store(w + 1, std::memory_order_release);
+    }
+
+    //  the events still in the ring, oldest first
+    void collect(std::vector<trace_event> &out) const {
+        const uint64_t w = written.load(std::memory_order_acquire);
+        const uint64_t first = w > capacity ? w - capacity : 0;
+        for (uint64_t k = first; k < w; ++k) { out.push_back(events[k % capacity]); }
+    }
+
+    void clear(size_t c) {
+        if (c != capacity) {
+            events.reset(new trace_event[c]);
+            capacity = c;
+        }
+        written.store(0, std::memory_order_relaxed);
+    }
+};
+
+//
+//  Whether tracing is on
+//
+//  Kept out of the tracer: the flag is initialized at compile time, so checking it is
+//  one load, without the check of a function static that the tracer would need.
+//
+inline std::atomic<bool> &trace_flag() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+inline bool tracing() {
+    return trace_flag().load(std::memory_order_relaxed);
+}
+
+class tracer {
+protected:
+    std::chrono::steady_clock::time_point origin;
+    size_t capacity;
+
+    std::mutex lock;   // guards buffers (a thread adds its buffer the first time it records)
+    std::vector<std::unique_ptr<trace_buffer>> buffers;
+
+    trace_buffer &local_buffer() {
+        static thread_local trace_buffer *buffer = nullptr;
+        if (buffer == nullptr) {
+            std::lock_guard<std::mutex> guard(lock);
+            buffers.emplace_back(new trace_buffer(capacity, (uint32_t) buffers.size()));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    static void write_event(std::ostream &os, const trace_event &e, uint32_t thread) {
+        os << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+           << ",\"ts\":" << e.start_ns / 1000 << '.' << (e.start_ns % 1000) / 100
+           << ",\"dur\":" << (e.end_ns - e.start_ns) / 1000 << '.' << ((e.end_ns - e.start_ns) % 1000) / 100;
+        if (e.end > e.begin) {
+            os << ",\"args\":{\"begin\":" << e.begin << ",\"end\":" << e.end << '}';
+        }
+        os << '}';
+    }
+
+public:
+    tracer() : origin(std::chrono::steady_clock::now()), capacity(trace_capacity) {}
+
+    //
+    //  Drop the events of the last trace and start recording
+    //
+    //  Call it (and stop) between steps, not while a loop of the pool is running.
+    //
+    void start(size_t events_per_thread = trace_capacity) {
+        std::lock_guard<std::mutex> guard(lock);
+        capacity = std::max<size_t>(events_per_thread, 1);
+        for (auto &buffer : buffers) { buffer->clear(capacity); }
+        origin = std::chrono::steady_clock::now();
+        trace_flag().store(true, std::memory_order_relaxed);
+    }
+
+    void stop() { trace_flag().store(false, std::memory_order_relaxed); }
+
+    int64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void record(const char *name, int64_t start_ns, int64_t end_ns, uint64_t begin = 0, uint64_t end = 0) {
+        local_buffer().record(trace_event{ name, start_ns, end_ns, begin, end });
+    }
+
+    //
+    //  All events as Chrome trace JSON, one track per thread
+    //
+    void write(std::ostream &os) {
+        std::lock_guard<std::mutex> guard(lock);
+        os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::vector<trace_event> events;
+        for (const auto &buffer : buffers) {
+            const uint32_t thread = buffer->get_thread();
+            if (!first) { os << ','; }
+            first = false;
+            os << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+               << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+            events.clear();
+            buffer->collect(events);
+            for (const trace_event &e : events) {
+                os << ",\n";
+                write_event(os, e, thread);
+            }
+        }
+        os << "\n]}" << std::endl;
+    }
+
+    bool write(const std::string &path) {
+        std::ofstream file(path);
+        if (!file) {
+            std::cout << "can't write " << path << std::endl;
+            return false;
+        }
+        write(file);
+        return true;
+    }
+};
+
+//
+//  Tracer of the run, like default_pool
+//
+inline tracer &default_tracer() {
+    static tracer t;
+    return t;
+}
+
+//
+//  Records its scope as one event when tracing is on
+//
+class trace_scope {
+protected:
+    const char *name;   // nullptr when tracing is off
+    int64_t start_ns;
+    uint64_t begin, end;
+
+public:
+    explicit trace_scope(const char *n, uint64_t b = 0, uint64_t e = 0)
+            : name(tracing() ? n : nullptr), start_ns(0), begin(b), end(e) {
+        if (name != nullptr) { start_ns = default_tracer().now_ns(); }
+    }
+    ~trace_scope() {
+        if (name != nullptr) { default_tracer().record(name, start_ns, default_tracer().now_ns(), begin, end); }
+    }
+
+    trace_scope(const trace_scope &) = delete;
+    trace_scope &operator=(const trace_scope &) = delete;
+};
+
+#endif //TREE_CODE_TRACE_H
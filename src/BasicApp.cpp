@@ -18,6 +18,9 @@
 #include "bh_tree.h"
 #include "body_builder.h"
 #include "nbody_cinder.h"
+#include "snapshot.h"
+#include "timers.h"
+#include "trace.h"
 
 // used for writing number of bodies to screen
 #include <sstream>
@@ -69,7 +72,20 @@ public:
 private:
     // This will maintain a list of points which we will draw line segments between
     std::vector<vec2> mPoints;
-    std::vector<std::shared_ptr<body>> bodies;
+    body_store bodies;
+    bh_tree tree;  // kept between steps so the node pool is reused
+    TreeMode tree_mode = TreeMode::PERSISTENT;
+    fmm_solver fmm;
+    Solver solver = Solver::BARNES_HUT;
+    integrator stepper;  // leapfrog by default, keeps the forces of the last step
+    walk_counts step_counts;  // work of the walks in the last step, while the bodies count it
+    double sim_time = 0.0;    // simulated seconds and steps, kept in snapshots
+    size_t sim_steps = 0;
+    std::string snapshot_path = "nbody_snapshot.nbs";
+
+    void step();
+    void save_snapshot();
+    bool resume_snapshot(const std::string &path);
 
     bool go_go_go;
     bool draw_velocity;
@@ -79,11 +95,7 @@ private:
     std::vector<int> body_numbers { 10, 15, 25, 50, 100, 250, 500, 1000, 2000, 3000, 4000, 5000, 10000, 25000, 50000, 100000, 250000};
     int body_number_index = 6;
 
-    // timing variables
-    std::vector<clock_t> times;
-    double fps;
-    double frame_draw_time;
-    // double avg_draw_time;
+    // timing of the phases is in default_timers (timers.h), one frame per draw()
 
     // todo: add the region to the Basic APP
     region tree_region;
@@ -102,7 +114,7 @@ void BasicApp::mouseDrag( MouseEvent event )
 {
 	// Store the current mouse position in the list.
 	// mPoints.push_back( event.getPos() );
-    add_body_to_bodies(bodies, getWindowSize(), event.getPos(), draw_region);
+    add_body_to_bodies(bodies, getWindowSize(), event.getPos(), draw_region, tree);
 }
 
 void BasicApp::keyDown( KeyEvent event )
@@ -122,16 +134,100 @@ void BasicApp::keyDown( KeyEvent event )
 		else
 			quit();
 	} else if (event.getCode() == 'n') {
-        region r( -1e6, -1e6, 1e6, 1e6);
         std::cout << "bodies before: " << bodies.size() << ", bodies after: ";
-        auto forces = compute_forces(bodies, r);
-        update_bodies_with_forces(bodies, forces);
+        step();
         std::cout << bodies.size() << std::endl;
 
+    } else if (event.getCode() == 'p') {
+        // toggle between keeping the tree and building it every step
+        tree_mode = tree_mode == TreeMode::PERSISTENT ? TreeMode::REBUILD : TreeMode::PERSISTENT;
+    } else if (event.getCode() == 'k') {
+        // cycle through Barnes Hut, the group walk, the fast multipole method and the direct sum,
+        // each with its leaf size (below direct_crossover bodies all of them use the direct sum)
+        solver = solver == Solver::BARNES_HUT ? Solver::GROUP_WALK
+                 : solver == Solver::GROUP_WALK ? Solver::FMM
+                 : solver == Solver::FMM ? Solver::DIRECT : Solver::BARNES_HUT;
+        tree_parameters params = tree.get_parameters();
+        params.leaf_capacity = solver == Solver::FMM ? 32 : 8;
+        tree.set_parameters(params);
+    } else if (event.getCode() == 'q') {
+        // quadrupoles on or off, at the same opening angle (smaller error, same nodes opened)
+        walk_parameters walk = tree.get_walk_parameters();
+        walk.quadrupole = !walk.quadrupole;
+        tree.set_walk_parameters(walk);
+        std::cout << "quadrupoles: " << (walk.quadrupole ? "on" : "off") << ", theta: " << walk.theta << std::endl;
+    } else if (event.getCode() == 'o') {
+        // cycle through the opening criteria: geometric, bmax, relative error
+        walk_parameters walk = tree.get_walk_parameters();
+        walk.criterion = walk.criterion == OpeningCriterion::GEOMETRIC ? OpeningCriterion::BMAX
+                         : walk.criterion == OpeningCriterion::BMAX ? OpeningCriterion::RELATIVE_ERROR
+                         : OpeningCriterion::GEOMETRIC;
+        tree.set_walk_parameters(walk);
+        const char *names[] = { "geometric", "bmax", "relative error" };
+        std::cout << "opening criterion: " << names[walk.criterion] << std::endl;
+    } else if (event.getCode() == 'e') {
+        // cycle through the softening kernels: plummer, spline, cutoff (the tree is rebuilt)
+        softening_parameters soft = tree.get_softening();
+        soft.kernel = soft.kernel == Softening::PLUMMER ? Softening::SPLINE
+                      : soft.kernel == Softening::SPLINE ? Softening::CUTOFF
+                      : Softening::PLUMMER;
+        tree.set_softening(soft);
+        const char *names[] = { "cutoff", "plummer", "spline" };
+        std::cout << "softening: " << names[soft.kernel] << std::endl;
+    } else if (event.getCode() == 'i') {
+        // cycle through the integrators: leapfrog, yoshida, euler
+        integrator_parameters params = stepper.get_parameters();
+        params.scheme = params.scheme == Integrator::LEAPFROG ? Integrator::YOSHIDA
+                        : params.scheme == Integrator::YOSHIDA ? Integrator::EULER
+                        : Integrator::LEAPFROG;
+        stepper.set_parameters(params);
+        const char *names[] = { "euler", "leapfrog", "yoshida" };
+        std::cout << "integrator: " << names[params.scheme] << std::endl;
+    } else if (event.getChar() == '[' or event.getChar() == ']') {
+        // halve or double the time step
+        integrator_parameters params = stepper.get_parameters();
+        params.dt *= event.getChar() == ']' ? 2.0 : 0.5;
+        stepper.set_parameters(params);
+        std::cout << "time step: " << params.dt << std::endl;
+    } else if (event.getCode() == 'h') {
+        // block time steps (every body takes the step it needs, down to dt / 2^max_rung) on or off
+        integrator_parameters params = stepper.get_parameters();
+        params.block_steps = !params.block_steps;
+        stepper.set_parameters(params);
+        std::cout << "block time steps: " << (params.block_steps ? "on" : "off") << std::endl;
+    } else if (event.getCode() == 't') {
+        // threads of every phase of a step: 1, 2, 4, ... up to all cores, then back to 1
+        unsigned threads = default_pool().size() * 2;
+        default_pool().set_threads(threads > thread_count() ? 1 : threads);
+        std::cout << "threads: " << default_pool().size() << std::endl;
+    } else if (event.getCode() == 'c') {
+        // count the interactions of the walks (every body, and the totals on the HUD)
+        bodies.count_interactions(!bodies.has_interaction_counts());
+        step_counts = walk_counts();
+        std::cout << "interaction counts: " << (bodies.has_interaction_counts() ? "on" : "off") << std::endl;
+    } else if (event.getCode() == 'r') {
+        // record a Chrome trace of the steps (trace.h), written out when 'r' is pressed again
+        if (tracing()) {
+            default_tracer().stop();
+            default_tracer().write("nbody_trace.json");
+            std::cout << "trace written to nbody_trace.json" << std::endl;
+        } else {
+            default_tracer().start();
+            std::cout << "tracing" << std::endl;
+        }
+    } else if (event.getCode() == 's') {
+        // save a snapshot (snapshot.h), written in the background while the bodies keep moving
+        save_snapshot();
+    } else if (event.getCode() == 'a') {
+        // go back to the last snapshot
+        default_snapshot_writer().flush();
+        resume_snapshot(snapshot_path);
     } else if (event.getCode() == 'g') {
         go_go_go = !go_go_go;
     } else if (event.getCode() == 'l') {
         draw_as_line = !draw_as_line;
+        // the last positions are only kept while they are drawn
+        bodies.track_last_position(draw_as_line);
     } else if (event.getCode() == 'v') {
         draw_velocity = !draw_velocity;
     } else if (event.getCode() == 'b') {
@@ -142,6 +238,9 @@ void BasicApp::keyDown( KeyEvent event )
             ++body_number_index;
         }
         many_bodies_test(bodies, body_numbers[body_number_index]);
+        stepper.reset();
+        sim_time = 0.0;
+        sim_steps = 0;
 
     } else if (event.getCode() == KeyEvent::KEY_DOWN ) {
         bodies.clear();
@@ -149,9 +248,15 @@ void BasicApp::keyDown( KeyEvent event )
             --body_number_index;
         }
         many_bodies_test(bodies, body_numbers[body_number_index]);
+        stepper.reset();
+        sim_time = 0.0;
+        sim_steps = 0;
 
     } else if (event.getCode() == 'm') {
         run_multigalaxy();
+        stepper.reset();
+        sim_time = 0.0;
+        sim_steps = 0;
     }
 
 }
@@ -169,29 +274,32 @@ void BasicApp::draw()
 	//gl::clear( Color(gray, gray, gray), true);
     gl::clear();
 
+    // a frame of the timers is the last draw and the step of this update
+    default_timers().close_frame();
+    scoped_timer draw_timer(Phase::DRAW);
 
     gl::color( 0.0f, 0.0f, 1.0f);
     if (draw_bodies) {
-        for (auto &e : bodies) {
+        for (size_t i = 0; i < bodies.size(); ++i) {
             gl::color( 0.0f, 0.2f, 1.0f);
-            if (e->get_mass() > 10000) {
+            if (bodies.get_mass(i) > 10000) {
                 gl::color( 1.0f, 0.1f, 0.1f);
             }
-            auto pt = scale_point_to_screen(e->get_position(), draw_region, getWindowSize());
-            auto mass = std::log(std::sqrt(e->get_mass()))/std::log(10);
+            auto pt = scale_point_to_screen(bodies.get_position(i), draw_region, getWindowSize());
+            auto mass = std::log(std::sqrt(bodies.get_mass(i)))/std::log(10);
             gl::drawSolidCircle(pt, mass);
         }
     }
 
     gl::color( 0.0f, 1.0f, 0.5f);
-    if (draw_as_line) {
-        for (auto &e : bodies) {
+    if (draw_as_line and bodies.has_last_position()) {
+        for (size_t i = 0; i < bodies.size(); ++i) {
             gl::color( 0.0f, 1.0f, 0.5f);
-            if (e->get_mass() > 10000) {
+            if (bodies.get_mass(i) > 10000) {
                 gl::color( 0.0f, 1.0f, 1.0f);
             }
-            auto pt_last = scale_point_to_screen(e->get_last_position(), draw_region, getWindowSize());
-            auto pt_curr = scale_point_to_screen(e->get_position(), draw_region, getWindowSize());
+            auto pt_last = scale_point_to_screen(bodies.get_last_position(i), draw_region, getWindowSize());
+            auto pt_curr = scale_point_to_screen(bodies.get_position(i), draw_region, getWindowSize());
             gl::begin(GL_LINE_STRIP);
             gl::vertex(pt_last);
             gl::vertex(pt_curr);
@@ -201,15 +309,15 @@ void BasicApp::draw()
 
     // draw velocity vectors
     if (draw_velocity) {
-        for (auto &e : bodies) {
+        for (size_t i = 0; i < bodies.size(); ++i) {
             gl::color( 0.0f, 1.0f, 0.5f);
-            if (e->get_mass() > 10000) {
+            if (bodies.get_mass(i) > 10000) {
                 gl::color( 0.0f, 1.0f, 1.0f);
             }
-            auto pt = e->get_position();
+            auto pt = bodies.get_position(i);
             double scale = 40000.0;
             auto pt_pos = scale_point_to_screen(pt, draw_region, getWindowSize());
-            auto pt_vel = scale_point_to_screen(pt + e->get_velocity()*scale, draw_region, getWindowSize());
+            auto pt_vel = scale_point_to_screen(pt + bodies.get_velocity(i)*scale, draw_region, getWindowSize());
             gl::begin(GL_LINE_STRIP);
             gl::vertex(pt_pos);
             gl::vertex(pt_vel);
@@ -241,25 +349,65 @@ void BasicApp::draw()
     //  Display number of bodies on screen
     //
     std::stringstream display_text;
-    display_text << "Number of Bodies: " << bodies.size();
+    display_text << "Number of Bodies: " << bodies.size() << ", step " << sim_steps;
 
-    //std::stringstream timing_display_01;
-    std::stringstream timing_display_02;
-    std::stringstream timing_display_03;
-    //timing_display_01 << "avg draw time: " << avg_draw_time;
-    timing_display_02 << "last draw time: " << frame_draw_time;
-    timing_display_03 << "fps: " << fps;
+    //
+    //  Wall time of every phase per frame, over the last frames (timers.h)
+    //
+    const step_timers &timers = default_timers();
+    const double frame_time = timers.frame_mean();
+    std::stringstream frame_display;
+    frame_display.precision(3);
+    frame_display << "frame: " << frame_time * 1e3 << " ms (" << (frame_time > 0.0 ? 1.0 / frame_time : 0.0)
+                  << " fps)";
+    std::vector<std::string> phase_displays;
+    for (int p = 0; p < phase_count; ++p) {
+        const rolling_timer &timer = timers.get((Phase) p);
+        std::stringstream phase_display;
+        phase_display.precision(3);
+        phase_display << phase_name((Phase) p) << ": " << timer.mean() * 1e3 << " ms  p50 "
+                      << timer.percentile(0.5) * 1e3 << "  p99 " << timer.percentile(0.99) * 1e3;
+        phase_displays.push_back(phase_display.str());
+    }
 
 
+    //  Shape of the tree, one pass over its nodes (bh_tree::get_stats)
+    std::stringstream tree_display;
+    tree_display.precision(3);
+    if (!tree.is_empty()) {
+        const tree_stats stats = tree.get_stats();
+        tree_display << "tree: " << stats.nodes << " nodes, depth " << stats.max_depth << ", "
+                     << stats.mean_occupancy() << " bodies/leaf, " << stats.outside_fraction() * 100.0
+                     << "% outside, " << stats.bytes_allocated / 1024 << " kB";
+    }
+
+    //  Work of the walks in the last step (when counting, 'c')
+    std::stringstream counts_display;
+    counts_display.precision(3);
+    if (bodies.has_interaction_counts()) {
+        const uint64_t interactions = step_counts.node_interactions + step_counts.body_interactions;
+        const double seconds = timers.get(Phase::FORCES).last();
+        counts_display << "walks: " << (bodies.empty() ? 0.0 : (double) interactions / bodies.size())
+                       << " interactions/body, " << (seconds > 0.0 ? interactions / seconds / 1e6 : 0.0)
+                       << " M interactions/s";
+    }
+
     TextLayout layout;                               // controls the layout
 
     layout.clear(ColorA(0.1f, 0.1f, 0.1f, 0.7f));
     layout.setColor(Color(0.1f, 0.9f, 0.9f));
     layout.setFont( Font("Arial Black", 16));
     layout.addCenteredLine(display_text.str());
-    //layout.addCenteredLine(timing_display_01.str());
-    layout.addCenteredLine(timing_display_02.str());
-    layout.addCenteredLine(timing_display_03.str());
+    layout.addCenteredLine(frame_display.str());
+    for (const std::string &line : phase_displays) {
+        layout.addLine(line);
+    }
+    if (!tree.is_empty()) {
+        layout.addLine(tree_display.str());
+    }
+    if (bodies.has_interaction_counts()) {
+        layout.addLine(counts_display.str());
+    }
 
 
     Surface8u rendered = layout.render( true, true);
@@ -286,39 +434,62 @@ void BasicApp::setup() {
 
     draw_bodies = true;
 
-    fps = 0;
-    frame_draw_time = 0;
+    // start from a snapshot given on the command line (BasicApp nbody_snapshot.nbs)
+    const std::vector<std::string> &args = getCommandLineArgs();
+    if (args.size() > 1) {
+        snapshot_path = args.back();
+        resume_snapshot(snapshot_path);
+    }
 }
 
 void BasicApp::update() {
     //AppBase::update();
 
     if (go_go_go) {
-        auto t = clock();
-
-        region r( -1e6, -1e6, 1e6, 1e6);
-        auto forces = compute_forces(bodies, r);
-        update_bodies_with_forces(bodies, forces);
-
-        t = clock() - t;
-        /*
-        times.push_back(t);
-        double sum = 0.0;
-        for (auto &e : times) {
-            sum += t;
-        }
-        sum /= CLOCKS_PER_SEC;
-        sum /= times.size();
-        */
-        // update time vars for on-screen display
-        //avg_draw_time = sum;
-        frame_draw_time = (double) t / (double) CLOCKS_PER_SEC;
-        fps = 1 / frame_draw_time;
+        // the phases of the step time themselves (see the HUD in draw)
+        step();
+    }
 
-        // std::cout << "average time: " << sum << ", for number of bodies = " << bodies.size() << std::endl;
+}
 
-    }
+//
+//  Move the bodies one time step, the region of the tree follows the bodies
+//
+void BasicApp::step() {
+    trace_scope trace("step");
+    walk_counts *counts = bodies.has_interaction_counts() ? &step_counts : nullptr;
+    step_counts = walk_counts();
+    stepper.block_step(bodies, [&](body_store &b, const std::vector<uint32_t> &active, std::vector<point> &forces) {
+        compute_active_forces(b, active, forces, tree, fmm, solver, tree_mode, region_policy(), counts);
+    });
+    sim_time += stepper.get_parameters().dt;
+    ++sim_steps;
+}
 
+//
+//  Snapshot of the bodies and the tree (see simulation::save, a resumed run moves the
+//  bodies exactly like this one)
+//
+void BasicApp::save_snapshot() {
+    default_snapshot_writer().save(snapshot_path, bodies, stepper, sim_time, sim_steps, &tree);
+    std::cout << "snapshot of step " << sim_steps << " to " << snapshot_path << std::endl;
+}
+
+bool BasicApp::resume_snapshot(const std::string &path) {
+    mapped_snapshot file;
+    if (!file.open(path)) {
+        return false;
+    }
+    restore_snapshot(file.view(), bodies, stepper);
+    sim_time = file.view().header.time;
+    sim_steps = (size_t) file.view().header.steps;
+    step_counts = walk_counts();
+    if (file.view().tree == nullptr or !tree.set_state(*file.view().tree, bodies)) {
+        tree.clear();
+    }
+    tree.set_previous_accelerations(bodies, stepper.get_forces());
+    std::cout << "resumed " << path << " at step " << sim_steps << std::endl;
+    return true;
 }
 
 
@@ -0,0 +1,367 @@
+//
+// Created on 10/17/26.
+//
+//  Accuracy versus cost of the tree solvers
+//
+//  Computes the exact forces of a configuration with the direct sum (direct.h), then
+//  runs the tree solvers over a grid of settings and writes one CSV line per setting:
+//  the RMS, 99th percentile and largest relative force error against the exact
+//  forces, the wall time of building the tree and of the force phase, and how many
+//  interactions the walks did. The settings on the Pareto front of error against time
+//  are the ones worth using.
+//
+//  No Cinder needed, build it with
+//
+//      g++ -std=c++14 -O2 -pthread -I nbody tools/accuracy_sweep.cpp -o accuracy_sweep
+//
+//  Options (lists are comma separated)
+//
+//    --ics galaxies|disk|FILE  two galaxies (create_two_galaxies), one disk around a
+//                              black hole (many_bodies_test), or a text file with one
+//                              body per line: mass x y vx vy   (default galaxies)
+//    --bodies N                bodies to generate (default 20000)
+//    --seed S                  seed of the generators (default 2016)
+//    --solvers LIST            bh, group and fmm (default all three)
+//    --theta LIST              opening angles (default 0.3,0.4,0.5,0.6,0.7,0.8,1.0)
+//    --leaf LIST               leaf capacities (default 4,8,16,32)
+//    --order LIST              orders of the FMM expansions (default 2,3,4,6)
+//    --softening LIST          softening lengths (default 20)
+//    --kernel LIST             softening kernels: plummer, spline, cutoff (default plummer)
+//    --repeats R               runs of every setting, the median time is kept (default 3)
+//    --output FILE             CSV file (default standard output)
+//
+//  The precision of bh and group is swept with and without quadrupoles, the one of
+//  fmm with the order.
+//
+//    --check                   exit with 1 when a setting of bh or group has a larger
+//                              RMS error with quadrupoles than without (run by ctest)
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "region.h"
+#include "bh_tree.h"
+#include "body_builder.h"
+#include "bounds.h"
+#include "direct.h"
+#include "fmm.h"
+
+struct sweep_options {
+    std::string ics = "galaxies";
+    int bodies = 20000;
+    unsigned seed = 2016;
+    std::vector<std::string> solvers { "bh", "group", "fmm" };
+    std::vector<double> thetas { 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 1.0 };
+    std::vector<double> leaves { 4, 8, 16, 32 };
+    std::vector<double> orders { 2, 3, 4, 6 };
+    std::vector<double> softenings { gravity_epsilon };
+    std::vector<std::string> kernels { "plummer" };
+    int repeats = 3;
+    std::string output;
+    bool check = false;
+};
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) { items.push_back(item); }
+    }
+    return items;
+}
+
+std::vector<double> split_numbers(const std::string &list) {
+    std::vector<double> numbers;
+    for (const std::string &item : split(list)) { numbers.push_back(std::atof(item.c_str())); }
+    return numbers;
+}
+
+bool parse_options(int argc, char **argv, sweep_options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--check") {
+            options.check = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--ics") { options.ics = value; }
+        else if (arg == "--bodies") { options.bodies = std::atoi(value.c_str()); }
+        else if (arg == "--seed") { options.seed = (unsigned) std::atoi(value.c_str()); }
+        else if (arg == "--solvers") { options.solvers = split(value); }
+        else if (arg == "--theta") { options.thetas = split_numbers(value); }
+        else if (arg == "--leaf") { options.leaves = split_numbers(value); }
+        else if (arg == "--order") { options.orders = split_numbers(value); }
+        else if (arg == "--softening") { options.softenings = split_numbers(value); }
+        else if (arg == "--kernel") { options.kernels = split(value); }
+        else if (arg == "--repeats") { options.repeats = std::max(1, std::atoi(value.c_str())); }
+        else if (arg == "--output") { options.output = value; }
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    for (const std::string &kernel : options.kernels) {
+        if (kernel != "plummer" and kernel != "spline" and kernel != "cutoff") {
+            std::cerr << "unknown softening kernel " << kernel << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+Softening softening_kernel(const std::string &name) {
+    if (name == "spline") { return Softening::SPLINE; }
+    return name == "cutoff" ? Softening::CUTOFF : Softening::PLUMMER;
+}
+
+//
+//  The bodies, generated or read from a file (see read_bodies in body_builder.h)
+//
+bool load_bodies(const sweep_options &options, body_store &bodies) {
+    seed_random(options.seed);
+    if (options.ics == "galaxies") {
+        create_two_galaxies(bodies, region(-1e4, -1e4, 1e4, 1e4), options.bodies);
+        return true;
+    }
+    if (options.ics == "disk") {
+        many_bodies_test(bodies, options.bodies);
+        return true;
+    }
+    return read_bodies(options.ics, bodies);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+//
+//  Relative error of every force against the exact one
+//
+struct force_errors {
+    double rms, p99, max;
+};
+
+force_errors compare(const std::vector<point> &forces, const std::vector<point> &exact) {
+    std::vector<double> errors;
+    errors.reserve(forces.size());
+    double sum_2 = 0.0;
+    for (size_t i = 0; i < forces.size(); ++i) {
+        const double scale = exact[i].length();
+        if (scale == 0.0) {
+            continue;
+        }
+        const double e = (forces[i] - exact[i]).length() / scale;
+        errors.push_back(e);
+        sum_2 += e * e;
+    }
+    if (errors.empty()) {
+        return force_errors{ 0.0, 0.0, 0.0 };
+    }
+    force_errors result;
+    result.rms = std::sqrt(sum_2 / errors.size());
+    result.max = *std::max_element(errors.begin(), errors.end());
+    const size_t k = std::min(errors.size() - 1, (size_t) std::ceil(0.99 * errors.size()) - 1);
+    std::nth_element(errors.begin(), errors.begin() + k, errors.end());
+    result.p99 = errors[k];
+    return result;
+}
+
+struct sweep_row {
+    std::string solver;
+    double theta = 0.0;
+    int leaf_capacity = 0;
+    bool quadrupole = false;
+    int order = 0;
+    std::string kernel;
+    double softening = 0.0;
+    double build_s = 0.0, force_s = 0.0;
+    force_errors errors { 0.0, 0.0, 0.0 };
+    walk_counts counts;
+};
+
+void write_header(std::ostream &os) {
+    os << "ics,bodies,solver,theta,leaf_capacity,quadrupole,order,kernel,softening,build_ms,force_ms,total_ms,"
+          "rms_error,p99_error,max_error,nodes_visited,node_interactions,body_interactions,"
+          "interactions_per_body" << std::endl;
+}
+
+void write_row(std::ostream &os, const sweep_options &options, size_t n, const sweep_row &row) {
+    const uint64_t interactions = row.counts.node_interactions + row.counts.body_interactions;
+    os << options.ics << ',' << n << ',' << row.solver << ',' << row.theta << ',' << row.leaf_capacity << ','
+       << (row.quadrupole ? 1 : 0) << ',' << row.order << ',' << row.kernel << ',' << row.softening << ','
+       << row.build_s * 1e3 << ',' << row.force_s * 1e3 << ',' << (row.build_s + row.force_s) * 1e3 << ','
+       << row.errors.rms << ',' << row.errors.p99 << ',' << row.errors.max << ','
+       << row.counts.nodes_visited << ',' << row.counts.node_interactions << ',' << row.counts.body_interactions
+       << ',' << (n > 0 ? (double) interactions / n : 0.0) << std::endl;
+}
+
+//
+//  One setting of a tree solver: build the tree and compute the forces repeats times
+//
+void run_tree(const sweep_options &options, const body_store &bodies, const std::vector<point> &exact,
+              bh_tree &tree, fmm_solver &fmm, sweep_row &row) {
+    std::vector<double> build_times, force_times;
+    std::vector<point> forces;
+    for (int r = 0; r < options.repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        tree.set_region(fit_region(bodies));
+        tree.build(bodies);
+        tree.update();
+        build_times.push_back(seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        if (row.solver == "bh") {
+            tree.compute_forces(bodies, forces);
+        } else if (row.solver == "group") {
+            tree.compute_group_forces(bodies, forces);
+        } else {
+            fmm.compute_forces(tree, bodies, forces);
+        }
+        force_times.push_back(seconds_since(start));
+    }
+    row.build_s = median(build_times);
+    row.force_s = median(force_times);
+    row.errors = compare(forces, exact);
+
+    //  the counts come from one more (untimed) run
+    row.counts = walk_counts();
+    if (row.solver == "bh") {
+        tree.compute_forces(bodies, forces, default_pool(), &row.counts);
+    } else if (row.solver == "group") {
+        tree.compute_group_forces(bodies, forces, 32, default_pool(), &row.counts);
+    } else {
+        row.counts.node_interactions = fmm.get_m2l_count();
+        row.counts.body_interactions = fmm.get_p2p_count();
+    }
+}
+
+//
+//  Every solver setting at one softening, false when --check finds quadrupoles that
+//  make a setting worse
+//
+bool sweep(const sweep_options &options, const body_store &bodies, const std::string &kernel, double length,
+           std::ostream &os) {
+    const size_t n = bodies.size();
+    bool passed = true;
+    softening_parameters soft;
+    soft.kernel = softening_kernel(kernel);
+    soft.length = length;
+
+    //  the exact forces, and what they cost
+    sweep_row reference;
+    reference.solver = "direct";
+    reference.kernel = kernel;
+    reference.softening = length;
+    std::vector<point> exact;
+    std::vector<double> times;
+    for (int r = 0; r < options.repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        default_direct_solver().compute_forces(bodies, soft, exact);
+        times.push_back(seconds_since(start));
+    }
+    reference.force_s = median(times);
+    reference.counts.body_interactions = (uint64_t) n * (n > 0 ? n - 1 : 0);
+    write_row(os, options, n, reference);
+
+    for (const std::string &solver : options.solvers) {
+        for (double leaf : options.leaves) {
+            bh_tree tree;
+            tree.set_softening(soft);
+            tree_parameters params = tree.get_parameters();
+            params.leaf_capacity = (uint32_t) leaf;
+            tree.set_parameters(params);
+
+            for (double theta : options.thetas) {
+                if (solver == "fmm") {
+                    for (double order : options.orders) {
+                        fmm_solver fmm((int) order, theta);
+                        sweep_row row;
+                        row.solver = solver;
+                        row.theta = theta;
+                        row.leaf_capacity = (int) leaf;
+                        row.order = fmm.get_order();
+                        row.kernel = kernel;
+                        row.softening = length;
+                        run_tree(options, bodies, exact, tree, fmm, row);
+                        write_row(os, options, n, row);
+                    }
+                    continue;
+                }
+                double monopole_rms = 0.0;
+                for (bool quadrupole : { false, true }) {
+                    walk_parameters walk;
+                    walk.theta = theta;
+                    walk.quadrupole = quadrupole;
+                    tree.set_walk_parameters(walk);
+                    fmm_solver unused;
+                    sweep_row row;
+                    row.solver = solver;
+                    row.theta = theta;
+                    row.leaf_capacity = (int) leaf;
+                    row.quadrupole = quadrupole;
+                    row.kernel = kernel;
+                    row.softening = length;
+                    run_tree(options, bodies, exact, tree, unused, row);
+                    write_row(os, options, n, row);
+                    if (!quadrupole) {
+                        monopole_rms = row.errors.rms;
+                    } else if (options.check and row.errors.rms > monopole_rms) {
+                        passed = false;
+                        std::cerr << "quadrupoles increase the error of " << solver << " (theta " << theta
+                                  << ", leaf " << leaf << ", " << kernel << " " << length << "): rms "
+                                  << monopole_rms << " -> " << row.errors.rms << std::endl;
+                    }
+                }
+            }
+        }
+    }
+    return passed;
+}
+
+int main(int argc, char **argv) {
+    sweep_options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+    body_store bodies;
+    if (!load_bodies(options, bodies)) {
+        return 1;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            std::cerr << "can't write " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &os = options.output.empty() ? std::cout : file;
+    write_header(os);
+
+    bool passed = true;
+    for (const std::string &kernel : options.kernels) {
+        for (double length : options.softenings) {
+            passed = sweep(options, bodies, kernel, length, os) and passed;
+        }
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+//
+// Created on 10/17/26.
+//
+//  Benchmark of the phases of a step, over numbers of bodies and of threads
+//
+//  For every number of bodies and every thread count, the phases of a step are timed
+//  one by one (wall time), after warmup runs that are thrown away:
+//
+//    build      : bh_tree::build, bodies into a tree from scratch
+//    moments    : bh_tree::update, masses, centers of mass (and quadrupoles)
+//    walk       : the force walk of the solver (bh_tree::compute_forces,
+//                 compute_group_forces or fmm_solver::compute_forces)
+//    integrate  : one kick and one drift over the store (integrator.h)
+//
+//  The bodies come from a fixed seed, so two builds of the code time the same
+//  configurations. Every line of the CSV output is one phase at one setting, with the
+//  minimum, median, mean, maximum and standard deviation over the trials. --label
+//  goes in the first column, so runs of two versions of bh_tree can be put in one file
+//  and compared.
+//
+//  Build it with the CMake project at the top of the repository, or by hand
+//
+//      g++ -std=c++14 -O2 -pthread -I nbody tools/benchmark.cpp -o benchmark
+//
+//  Options (lists are comma separated)
+//
+//    --label NAME              first column of every line (default current)
+//    --ics galaxies|disk       two galaxies or one disk (default disk, like the app's
+//                              up and down keys)
+//    --bodies LIST             numbers of bodies (default the app's ladder,
+//                              10 to 250000)
+//    --threads LIST            thread counts (default 1, 2, 4, ... up to all cores)
+//    --solver bh|group|fmm     walk that is timed (default bh)
+//    --seed S                  seed of the generators (default 2016)
+//    --warmup W                untimed runs before the trials (default 2)
+//    --trials T                timed runs (default 7)
+//    --output FILE             CSV file (default standard output)
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bh_tree.h"
+#include "body_builder.h"
+#include "bounds.h"
+#include "fmm.h"
+#include "integrator.h"
+#include "parallel.h"
+
+//
+//  Same ladder as the up and down keys of the app (BasicApp::body_numbers)
+//
+const std::vector<int> body_number_ladder { 10, 15, 25, 50, 100, 250, 500, 1000, 2000, 3000, 4000, 5000,
+                                            10000, 25000, 50000, 100000, 250000 };
+
+struct benchmark_options {
+    std::string label = "current";
+    std::string ics = "disk";
+    std::vector<int> bodies = body_number_ladder;
+    std::vector<int> threads;
+    std::string solver = "bh";
+    unsigned seed = 2016;
+    int warmup = 2;
+    int trials = 7;
+    std::string output;
+};
+
+std::vector<int> split_numbers(const std::string &list) {
+    std::vector<int> numbers;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) { numbers.push_back(std::atoi(item.c_str())); }
+    }
+    return numbers;
+}
+
+bool parse_options(int argc, char **argv, benchmark_options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--label") { options.label = value; }
+        else if (arg == "--ics") { options.ics = value; }
+        else if (arg == "--bodies") { options.bodies = split_numbers(value); }
+        else if (arg == "--threads") { options.threads = split_numbers(value); }
+        else if (arg == "--solver") { options.solver = value; }
+        else if (arg == "--seed") { options.seed = (unsigned) std::atoi(value.c_str()); }
+        else if (arg == "--warmup") { options.warmup = std::max(0, std::atoi(value.c_str())); }
+        else if (arg == "--trials") { options.trials = std::max(1, std::atoi(value.c_str())); }
+        else if (arg == "--output") { options.output = value; }
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    if (options.ics != "galaxies" and options.ics != "disk") {
+        std::cerr << "unknown initial conditions " << options.ics << std::endl;
+        return false;
+    }
+    if (options.solver != "bh" and options.solver != "group" and options.solver != "fmm") {
+        std::cerr << "unknown solver " << options.solver << std::endl;
+        return false;
+    }
+    if (options.threads.empty()) {
+        const int cores = (int) thread_count();
+        for (int t = 1; t < cores; t *= 2) { options.threads.push_back(t); }
+        options.threads.push_back(cores);
+    }
+    return true;
+}
+
+//
+//  Times of one phase over the trials (seconds)
+//
+struct phase_times {
+    std::string phase;
+    std::vector<double> seconds;
+};
+
+void write_header(std::ostream &os) {
+    os << "label,ics,bodies,threads,solver,phase,trials,min_ms,median_ms,mean_ms,max_ms,stddev_ms,"
+          "bodies_per_s" << std::endl;
+}
+
+void write_row(std::ostream &os, const benchmark_options &options, size_t n, int threads,
+               const phase_times &times) {
+    std::vector<double> s = times.seconds;
+    std::sort(s.begin(), s.end());
+    double mean = 0.0;
+    for (double t : s) { mean += t; }
+    mean /= s.size();
+    double variance = 0.0;
+    for (double t : s) { variance += (t - mean) * (t - mean); }
+    const double stddev = s.size() > 1 ? std::sqrt(variance / (s.size() - 1)) : 0.0;
+    const double median = s[s.size() / 2];
+    os << options.label << ',' << options.ics << ',' << n << ',' << threads << ',' << options.solver << ','
+       << times.phase << ',' << s.size() << ',' << s.front() * 1e3 << ',' << median * 1e3 << ','
+       << mean * 1e3 << ',' << s.back() * 1e3 << ',' << stddev * 1e3 << ','
+       << (median > 0.0 ? n / median : 0.0) << std::endl;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//
+//  All phases at one setting, the trials follow the warmup runs
+//
+void run_setting(const benchmark_options &options, const body_store &bodies, int threads, std::ostream &os) {
+    default_pool().set_threads((unsigned) threads);
+
+    bh_tree tree;
+    fmm_solver fmm;
+    if (options.solver == "fmm") {
+        tree_parameters params = tree.get_parameters();
+        params.leaf_capacity = 32;
+        tree.set_parameters(params);
+    }
+    const region r = fit_region(bodies);
+    std::vector<point> forces;
+    body_store moved;
+
+    phase_times build { "build", {} }, moments { "moments", {} }, walk { "walk", {} };
+    phase_times integrate { "integrate", {} };
+    for (int run = 0; run < options.warmup + options.trials; ++run) {
+        const bool timed = run >= options.warmup;
+
+        auto start = std::chrono::steady_clock::now();
+        tree.set_region(r);
+        tree.build(bodies);
+        if (timed) { build.seconds.push_back(seconds_since(start)); }
+
+        start = std::chrono::steady_clock::now();
+        tree.update();
+        if (timed) { moments.seconds.push_back(seconds_since(start)); }
+
+        start = std::chrono::steady_clock::now();
+        if (options.solver == "bh") {
+            tree.compute_forces(bodies, forces);
+        } else if (options.solver == "group") {
+            tree.compute_group_forces(bodies, forces);
+        } else {
+            fmm.compute_forces(tree, bodies, forces);
+        }
+        if (timed) { walk.seconds.push_back(seconds_since(start)); }
+
+        //  on a copy, so every run starts from the same positions
+        moved = bodies;
+        start = std::chrono::steady_clock::now();
+        kick(moved, forces, default_time_step);
+        drift(moved, default_time_step);
+        if (timed) { integrate.seconds.push_back(seconds_since(start)); }
+    }
+    for (const phase_times *times : { &build, &moments, &walk, &integrate }) {
+        write_row(os, options, bodies.size(), threads, *times);
+    }
+}
+
+int main(int argc, char **argv) {
+    benchmark_options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            std::cerr << "can't write " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &os = options.output.empty() ? std::cout : file;
+    write_header(os);
+
+    body_store bodies;
+    for (int n : options.bodies) {
+        seed_random(options.seed);
+        if (options.ics == "galaxies") {
+            create_two_galaxies(bodies, region(-2.5e3, -2.5e3, 2.5e3, 2.5e3), n);
+        } else {
+            many_bodies_test(bodies, n);
+        }
+        for (int threads : options.threads) {
+            run_setting(options, bodies, threads, os);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,303 @@
+//
+// Created on 10/17/26.
+//
+//  Batch runs without a window
+//
+//  Steps a simulation (simulation.h) as fast as it goes, no drawing, and reports how
+//  many steps per second it managed and the time of every phase of a step (timers.h).
+//  For long runs on machines without a display.
+//
+//  Build it with the CMake project at the top of the repository, or by hand
+//
+//      g++ -std=c++14 -O2 -pthread -I nbody tools/nbody_run.cpp -o nbody_run
+//
+//  Options
+//
+//    --ics galaxies|disk|FILE         two galaxies (default), one disk around a black
+//                                     hole, or a text file (see read_bodies)
+//    --bodies N                       bodies to generate (default 20000)
+//    --seed S                         seed of the generators (default 2016)
+//    --steps N                        steps to run (default 100)
+//    --dt DT                          time step in seconds (default 1e4)
+//    --solver bh|group|fmm|direct     force solver (default bh)
+//    --integrator euler|leapfrog|yoshida   (default leapfrog)
+//    --block                          block time steps (leapfrog only)
+//    --threads T                      threads of the pool (default all cores)
+//    --energy                         print the energy before and after (O(N^2))
+//    --report K                       print progress every K steps (default 0, off)
+//    --tree-stats                     print the depth histogram and the leaf occupancy of
+//                                     the tree at the end (the summary is always printed)
+//    --count                          count the interactions of the walks, print the totals,
+//                                     interactions per second and the spread of the cost
+//                                     of single bodies
+//    --trace FILE                     write a Chrome trace of the run (trace.h), the
+//                                     last trace_capacity events of every thread
+//    --resume FILE                    go on from a snapshot (snapshot.h) instead of new
+//                                     bodies, run it with the options of the run that
+//                                     saved it (the time step comes from the file)
+//    --snapshot PREFIX                write a snapshot PREFIX_<step>.nbs at the end
+//    --snapshot-every K               and at every step that is a multiple of K on
+//                                     the way, written in the background while the
+//                                     run goes on. Saving doesn't change the run, a
+//                                     run resumed from any of them repeats the steps
+//                                     of this one bit for bit (see simulation::save).
+//                                     If the disk falls behind by snapshot_queue_limit
+//                                     snapshots, the next ones are skipped (counted
+//                                     at the end)
+//    --check                          run the self checks of the headers (every SIMD
+//                                     kernel this CPU has against the scalar one, the
+//                                     pool resized between loops, the FMM against the
+//                                     direct sum, a run resumed from a snapshot) and
+//                                     exit, 0 when they pass
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "simulation.h"
+
+struct run_options {
+    std::string ics = "galaxies";
+    int bodies = 20000;
+    unsigned seed = 2016;
+    size_t steps = 100;
+    unsigned threads = 0;
+    bool energy = false;
+    bool tree_stats = false;
+    bool check = false;
+    size_t report = 0;
+    std::string trace;
+    std::string resume;
+    std::string snapshot;
+    size_t snapshot_every = 0;
+    simulation_parameters params;
+};
+
+bool parse_options(int argc, char **argv, run_options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--block") {
+            options.params.integration.block_steps = true;
+            continue;
+        }
+        if (arg == "--energy") {
+            options.energy = true;
+            continue;
+        }
+        if (arg == "--count") {
+            options.params.count_interactions = true;
+            continue;
+        }
+        if (arg == "--tree-stats") {
+            options.tree_stats = true;
+            continue;
+        }
+        if (arg == "--check") {
+            options.check = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--ics") { options.ics = value; }
+        else if (arg == "--bodies") { options.bodies = std::atoi(value.c_str()); }
+        else if (arg == "--seed") { options.seed = (unsigned) std::atoi(value.c_str()); }
+        else if (arg == "--steps") { options.steps = (size_t) std::atol(value.c_str()); }
+        else if (arg == "--dt") { options.params.integration.dt = std::atof(value.c_str()); }
+        else if (arg == "--threads") { options.threads = (unsigned) std::atoi(value.c_str()); }
+        else if (arg == "--report") { options.report = (size_t) std::atol(value.c_str()); }
+        else if (arg == "--trace") { options.trace = value; }
+        else if (arg == "--resume") { options.resume = value; }
+        else if (arg == "--snapshot") { options.snapshot = value; }
+        else if (arg == "--snapshot-every") { options.snapshot_every = (size_t) std::atol(value.c_str()); }
+        else if (arg == "--solver") {
+            if (value == "bh") { options.params.solver = Solver::BARNES_HUT; }
+            else if (value == "group") { options.params.solver = Solver::GROUP_WALK; }
+            else if (value == "fmm") { options.params.solver = Solver::FMM; }
+            else if (value == "direct") { options.params.solver = Solver::DIRECT; }
+            else {
+                std::cerr << "unknown solver " << value << std::endl;
+                return false;
+            }
+        } else if (arg == "--integrator") {
+            if (value == "euler") { options.params.integration.scheme = Integrator::EULER; }
+            else if (value == "leapfrog") { options.params.integration.scheme = Integrator::LEAPFROG; }
+            else if (value == "yoshida") { options.params.integration.scheme = Integrator::YOSHIDA; }
+            else {
+                std::cerr << "unknown integrator " << value << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+//  Self checks of the headers (--check)
+//
+bool run_checks() {
+    bool passed = true;
+    passed = test_kernels_match_scalar() and passed;
+    passed = test_pool_resize() and passed;
+    passed = test_fmm_matches_direct() and passed;
+    passed = test_snapshot_restart() and passed;
+    return passed;
+}
+
+//  name of the snapshot of a step
+std::string snapshot_path(const std::string &prefix, size_t step) {
+    return prefix + "_" + std::to_string(step) + ".nbs";
+}
+
+//
+//  Time of every phase per step, over the last steps (see timers.h)
+//
+void print_timers(const step_timers &timers) {
+    std::cout << "ms per step over the last " << timers.get(Phase::FORCES).size() << " steps" << std::endl;
+    for (int p = 0; p < phase_count; ++p) {
+        const Phase phase = (Phase) p;
+        const rolling_timer &timer = timers.get(phase);
+        std::cout << "  " << phase_name(phase) << ": mean " << timer.mean() * 1e3
+                  << ", p50 " << timer.percentile(0.5) * 1e3 << ", p99 " << timer.percentile(0.99) * 1e3
+                  << std::endl;
+    }
+}
+
+//
+//  Shape of the tree at the end of the run (see bh_tree::get_stats)
+//
+void print_tree_stats(const bh_tree &tree, bool histograms) {
+    const tree_stats stats = tree.get_stats();
+    std::cout << "tree: " << stats << std::endl;
+    if (!histograms) {
+        return;
+    }
+    std::cout << "  depth: nodes / leaves" << std::endl;
+    for (size_t d = 0; d < stats.nodes_per_depth.size(); ++d) {
+        std::cout << "    " << d << ": " << stats.nodes_per_depth[d] << " / " << stats.leaves_per_depth[d] << std::endl;
+    }
+    std::cout << "  bodies in a leaf: leaves" << std::endl;
+    for (size_t k = 0; k < stats.leaf_occupancy.size(); ++k) {
+        if (stats.leaf_occupancy[k] > 0) {
+            std::cout << "    " << k << ": " << stats.leaf_occupancy[k] << std::endl;
+        }
+    }
+}
+
+//
+//  Work of the walks (see --count)
+//
+void print_counts(const simulation &sim, double seconds) {
+    const walk_counts &total = sim.get_total_counts();
+    const uint64_t interactions = total.node_interactions + total.body_interactions;
+    const size_t n = sim.get_bodies().size();
+    const size_t steps = std::max<size_t>(sim.get_steps(), 1);
+    std::cout << "walks: " << total.nodes_visited / steps << " nodes visited, "
+              << total.node_interactions / steps << " cell-body and " << total.body_interactions / steps
+              << " body-body interactions per step (" << (n > 0 ? (double) interactions / steps / n : 0.0)
+              << " per body), " << interactions / seconds << " interactions/s over the run, "
+              << sim.interactions_per_second() << " in the force phase of the last step" << std::endl;
+
+    //  spread of the cost of the bodies, how uneven the work of the walks is
+    const body_store &bodies = sim.get_bodies();
+    if (bodies.has_interaction_counts() and n > 0) {
+        uint64_t sum = 0;
+        uint32_t most = 0, least = 0xffffffffu;
+        for (size_t i = 0; i < n; ++i) {
+            const uint32_t cost = bodies.get_interactions(i).cost();
+            sum += cost;
+            most = std::max(most, cost);
+            least = std::min(least, cost);
+        }
+        std::cout << "cost per body (last walk): min " << least << ", mean " << (double) sum / n << ", max "
+                  << most << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    run_options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+    if (options.check) {
+        return run_checks() ? 0 : 1;
+    }
+    default_pool().set_threads(options.threads);
+
+    simulation sim(options.params);
+    if (!options.resume.empty()) {
+        if (!sim.resume(options.resume)) {
+            return 1;
+        }
+        std::cout << "resumed at step " << sim.get_steps() << ", t = " << sim.get_time() << " s" << std::endl;
+    } else if (options.ics == "galaxies") {
+        sim.generate(InitialConditions::TWO_GALAXIES, options.bodies, options.seed);
+    } else if (options.ics == "disk") {
+        sim.generate(InitialConditions::DISK, options.bodies, options.seed);
+    } else if (!sim.load(options.ics)) {
+        return 1;
+    }
+
+    std::cout << sim.get_bodies().size() << " bodies, " << default_pool().size() << " threads" << std::endl;
+    const double energy_before = options.energy ? sim.energy() : 0.0;
+
+    if (!options.trace.empty()) {
+        default_tracer().start();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+    const size_t snapshot_every = options.snapshot.empty() ? 0 : options.snapshot_every;
+    while (done < options.steps) {
+        //  run to the next report or snapshot, whichever comes first
+        size_t chunk = options.steps - done;
+        if (options.report > 0) { chunk = std::min(chunk, options.report - done % options.report); }
+        if (snapshot_every > 0) { chunk = std::min(chunk, snapshot_every - sim.get_steps() % snapshot_every); }
+        sim.step(chunk);
+        done += chunk;
+        if (options.report > 0 and done % options.report == 0) {
+            std::cout << "step " << sim.get_steps() << ", t = " << sim.get_time() << " s" << std::endl;
+        }
+        if (snapshot_every > 0 and sim.get_steps() % snapshot_every == 0 and done < options.steps) {
+            sim.save_async(snapshot_path(options.snapshot, sim.get_steps()));
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!options.trace.empty()) {
+        default_tracer().stop();
+        default_tracer().write(options.trace);
+    }
+
+    std::cout << done << " steps in " << seconds << " s, "
+              << (seconds > 0.0 ? done / seconds : 0.0) << " steps/s, "
+              << sim.get_integrator().get_force_evaluations() << " force evaluations" << std::endl;
+    print_timers(sim.get_timers());
+    print_tree_stats(sim.get_tree(), options.tree_stats);
+    if (options.params.count_interactions) {
+        print_counts(sim, seconds);
+    }
+    if (options.energy) {
+        const double energy_after = sim.energy();
+        std::cout << "energy " << energy_before << " -> " << energy_after << " (relative change "
+                  << (energy_after - energy_before) / std::abs(energy_before) << ")" << std::endl;
+    }
+
+    if (!options.snapshot.empty()) {
+        const std::string path = snapshot_path(options.snapshot, sim.get_steps());
+        default_snapshot_writer().flush();
+        if (!sim.save(path)) {
+            return 1;
+        }
+        std::cout << "snapshots: " << default_snapshot_writer().get_written() + 1 << " written, "
+                  << default_snapshot_writer().get_skipped() << " skipped, " << default_snapshot_writer().get_failed()
+                  << " failed, the last one " << path << std::endl;
+    }
+    return 0;
+}